@@ -0,0 +1,73 @@
+#!/bin/sh
+# Times the tools against images built by sfsgen. Set BENCH_RUNS to change
+# the repetitions and BENCH_DIR to keep the images somewhere other than a
+# temporary directory. Syscall counts need strace and show '-' without it.
+
+RUNS=${BENCH_RUNS:-20}
+DIR=${BENCH_DIR:-$(mktemp -d)}
+HERE=$(cd "$(dirname "$0")" && pwd)
+unset SFSD_SOCKET
+mkdir -p "$DIR"
+
+now() {
+    date +%s%N
+}
+
+# syscalls <command...>: total syscalls made by one run of the command.
+syscalls() {
+    if command -v strace >/dev/null 2>&1; then
+        strace -f -c -o "$DIR/strace.out" "$@" >/dev/null 2>&1
+        awk '$NF == "total" { print $(NF - 2) }' "$DIR/strace.out"
+    else
+        echo -
+    fi
+}
+
+# report <image> <tool> <runs> <bytes per run> <start ns> <end ns> <syscalls>
+report() {
+    awk -v image="$1" -v tool="$2" -v runs="$3" -v bytes="$4" -v start="$5" -v end="$6" -v calls="$7" 'BEGIN {
+        secs = (end - start) / 1e9
+        if (secs <= 0) secs = 1e-9
+        mbs = (bytes > 0) ? sprintf("%10.1f", runs * bytes / secs / 1e6) : sprintf("%10s", "-")
+        printf "%-12s %-10s %10.1f %s %10s\n", image, tool, runs / secs, mbs, calls
+    }'
+}
+
+bench_image() {
+    name=$1
+    shift
+    image="$DIR/$name.img"
+    "$HERE/sfsgen" "$@" "$image" >/dev/null || exit 1
+
+    start=$(now)
+    i=0; while [ $i -lt "$RUNS" ]; do "$HERE/diskinfo" "$image" >/dev/null; i=$((i + 1)); done
+    report "$name" diskinfo "$RUNS" 0 "$start" "$(now)" "$(syscalls "$HERE/diskinfo" "$image")"
+
+    deepest=$("$HERE/disklist" "$image" / | awk '$1 == "D" { print "/" $3; exit }')
+    start=$(now)
+    i=0; while [ $i -lt "$RUNS" ]; do "$HERE/disklist" "$image" "${deepest:-/}" >/dev/null; i=$((i + 1)); done
+    report "$name" disklist "$RUNS" 0 "$start" "$(now)" "$(syscalls "$HERE/disklist" "$image" "${deepest:-/}")"
+
+    largest=$("$HERE/disklist" "$image" / | awk '$1 == "F" && $2 > max { max = $2; name = $3 } END { print max, name }')
+    bytes=${largest% *}
+    file=/${largest#* }
+    start=$(now)
+    i=0; while [ $i -lt "$RUNS" ]; do "$HERE/diskget" "$image" "$file" "$DIR/get.out"; i=$((i + 1)); done
+    report "$name" diskget "$RUNS" "$bytes" "$start" "$(now)" "$(syscalls "$HERE/diskget" "$image" "$file" "$DIR/get.out")"
+
+    cp "$image" "$DIR/put.img"
+    start=$(now)
+    i=0; while [ $i -lt "$RUNS" ]; do "$HERE/diskput" "$DIR/put.img" "$DIR/get.out" "/put$i.bin"; i=$((i + 1)); done
+    end=$(now)
+    report "$name" diskput "$RUNS" "$bytes" "$start" "$end" "$(syscalls "$HERE/diskput" "$DIR/put.img" "$DIR/get.out" /put.bin)"
+    rm -f "$DIR/put.img" "$DIR/get.out"
+}
+
+printf "%-12s %-10s %10s %10s %10s\n" image tool ops/s MB/s syscalls
+bench_image small-files -b 512 -n 131072 -r 32 -d 3 -w 4 -f 16 -s 64:8192
+bench_image large-files -b 4096 -n 65536 -d 1 -w 2 -f 4 -s 1048576:16777216
+bench_image fragmented -b 4096 -n 65536 -d 1 -w 2 -f 4 -s 1048576:16777216 -F 5
+
+if [ -z "$BENCH_DIR" ]; then
+    rm -rf "$DIR"
+fi
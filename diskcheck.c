@@ -0,0 +1,836 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "sfs.h"
+
+#define CHECK_MAX_THREADS 32
+#define CHECK_BATCH 64
+#define SCRUB_PIECE_BYTES (1024 * 1024)
+
+#define EXIT_CLEAN 0
+#define EXIT_REPAIRED 1
+#define EXIT_UNREPAIRED 4
+#define EXIT_FAILED 8
+
+typedef enum {
+    CHAIN_OK,
+    CHAIN_BAD_BLOCK,
+    CHAIN_LOOP,
+    CHAIN_CROSS_LINKED,
+    CHAIN_TOO_LONG,
+    CHAIN_TOO_SHORT
+} chain_state_t;
+
+/*
+ * A file or subdirectory chain and how far it checked out: valid is the
+ * number of blocks walked before the problem, bad_block where it showed.
+ */
+typedef struct {
+    dir_entry_t *entry;
+    char *path;
+    uint32_t start;
+    uint32_t blocks;
+    uint32_t valid;
+    uint32_t bad_block;
+    chain_state_t state;
+    bool is_dir;
+} chain_t;
+
+typedef struct {
+    sfs_image_t *img;
+    bool repair;
+    uint32_t entries;
+    uint64_t *visited;
+    chain_t *chains;
+    size_t num_chains;
+    size_t capacity;
+    size_t next_chain;
+    uint32_t files;
+    uint32_t dirs;
+    uint32_t problems;
+    uint32_t repaired;
+} check_t;
+
+/* A run of contiguous blocks of one checksummed file, verified by one worker. */
+typedef struct {
+    size_t chain;
+    uint32_t block;
+    uint32_t count;
+} scrub_piece_t;
+
+typedef struct {
+    size_t chain;
+    uint32_t block;
+} bad_block_t;
+
+/* The first shared block of a cross-linked chain, and the chain that claimed it first. */
+typedef struct {
+    uint32_t block;
+    size_t chain;
+    size_t owner;
+    uint32_t owner_index;
+} shared_block_t;
+
+typedef struct {
+    const sfs_image_t *img;
+    scrub_piece_t *pieces;
+    size_t num_pieces;
+    size_t next_piece;
+    bad_block_t *bad;
+    size_t num_bad;
+    size_t bad_capacity;
+    pthread_mutex_t lock;
+    uint64_t blocks;
+    uint32_t files;
+    bool failed;
+} scrub_t;
+
+void problem(check_t *check, bool repaired, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+void problem(check_t *check, bool repaired, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf(repaired ? " (repaired)\n" : "\n");
+    check->problems++;
+    check->repaired += repaired;
+}
+
+bool is_allocated(const check_t *check, uint32_t block) {
+    if (block >= check->entries) {
+        return false;
+    }
+    uint32_t value = sfs_fat_get(check->img, block);
+    return value != SFS_FAT_FREE && value != SFS_FAT_RESERVED;
+}
+
+/* Returns whether the block had already been claimed by some chain. */
+bool mark_visited(check_t *check, uint32_t block) {
+    uint64_t bit = (uint64_t)1 << (block % 64);
+    return __atomic_fetch_or(&check->visited[block / 64], bit, __ATOMIC_RELAXED) & bit;
+}
+
+bool is_visited(const check_t *check, uint32_t block) {
+    return check->visited[block / 64] >> (block % 64) & 1;
+}
+
+void unmark_chain(check_t *check, uint32_t block, uint32_t count) {
+    while (count-- > 0 && block < check->entries) {
+        check->visited[block / 64] &= ~((uint64_t)1 << (block % 64));
+        block = sfs_fat_get(check->img, block);
+    }
+}
+
+uint32_t nth_block(const sfs_image_t *img, uint32_t block, uint32_t n) {
+    while (n-- > 0) {
+        block = sfs_fat_get(img, block);
+    }
+    return block;
+}
+
+/*
+ * Follows a chain for its recorded length, claiming each block in the
+ * shared bitmap. A block claimed earlier is a loop when it appears in the
+ * part of this chain already walked, and a cross-link otherwise.
+ */
+void walk_chain(check_t *check, chain_t *chain) {
+    const sfs_image_t *img = check->img;
+    uint32_t block = chain->start;
+    chain->valid = 0;
+    chain->state = CHAIN_OK;
+    while (chain->valid < chain->blocks) {
+        chain->bad_block = block;
+        if (!is_allocated(check, block)) {
+            chain->state = CHAIN_BAD_BLOCK;
+            break;
+        }
+        if (mark_visited(check, block)) {
+            uint32_t walked = chain->start;
+            uint32_t i = 0;
+            while (i < chain->valid && walked != block) {
+                walked = sfs_fat_get(img, walked);
+                i++;
+            }
+            chain->state = (i < chain->valid) ? CHAIN_LOOP : CHAIN_CROSS_LINKED;
+            break;
+        }
+        chain->valid++;
+        uint32_t next = sfs_fat_get(img, block);
+        if (chain->valid == chain->blocks) {
+            chain->state = (next == SFS_FAT_EOF) ? CHAIN_OK : CHAIN_TOO_LONG;
+        } else if (next == SFS_FAT_EOF) {
+            chain->state = CHAIN_TOO_SHORT;
+            break;
+        }
+        block = next;
+    }
+    SFS_COUNT(blocks_visited, chain->valid);
+}
+
+bool add_chain(check_t *check, dir_entry_t *entry, const char *parent) {
+    char name[32];
+    if (check->num_chains == check->capacity) {
+        size_t capacity = check->capacity ? check->capacity * 2 : 1024;
+        chain_t *grown = realloc(check->chains, capacity * sizeof(chain_t));
+        if (grown == NULL) {
+            perror("Error allocating memory for the file list.");
+            return false;
+        }
+        check->chains = grown;
+        check->capacity = capacity;
+    }
+    chain_t *chain = &check->chains[check->num_chains];
+    sfs_entry_name(entry, name);
+    memset(chain, 0, sizeof(chain_t));
+    chain->entry = entry;
+    chain->start = ntohl(entry->starting_block);
+    chain->blocks = ntohl(entry->block_count);
+    chain->is_dir = sfs_entry_is_dir(entry);
+    chain->path = malloc(strlen(parent) + strlen(name) + 2);
+    if (chain->path == NULL) {
+        perror("Error allocating memory for the file list.");
+        return false;
+    }
+    sprintf(chain->path, "%s/%s", parent, name);
+    check->num_chains++;
+    return true;
+}
+
+/*
+ * An index is only trusted when its header matches the directory and its
+ * run checks out. Anything else is reported; repair detaches it, lookups
+ * fall back to scanning, and the run is reclaimed as leaked blocks.
+ */
+void check_index(check_t *check, sfs_dir_iter_t *dir, const char *path) {
+    uint32_t block = sfs_index_block(dir);
+    if (block == 0) {
+        return;
+    }
+    sfs_dir_index_t *index = sfs_dir_index(dir);
+    chain_t run = {NULL, NULL, block, 0, 0, block, CHAIN_BAD_BLOCK, false};
+    if (index != NULL) {
+        run.blocks = sfs_index_length(check->img, index);
+        walk_chain(check, &run);
+        if (run.state == CHAIN_OK) {
+            return;
+        }
+        unmark_chain(check, run.start, run.valid);
+    }
+    if (check->repair) {
+        sfs_index_detach(check->img, dir);
+    }
+    problem(check, check->repair, "%s: directory index at block %u does not match the directory", *path ? path : "/", block);
+}
+
+bool scan_directory(check_t *check, sfs_dir_iter_t *dir, const char *path) {
+    dir_entry_t *entry;
+    sfs_dir_readahead(dir);
+    sfs_dir_prefetch_children(dir);
+    check_index(check, dir, path);
+    while ((entry = sfs_dir_next(dir)) != NULL) {
+        if (!sfs_entry_in_use(entry) || sfs_entry_is_dot(entry)) {
+            continue;
+        }
+        if (!add_chain(check, entry, path)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Directories are walked breadth first on this thread, since their
+ * entries are what find the remaining chains; the chains array doubles as
+ * the queue. Each directory is only read as far as its chain checked out,
+ * and the bitmap stops a directory that links back to an ancestor from
+ * being read twice.
+ */
+bool scan_tree(check_t *check) {
+    sfs_dir_iter_t dir;
+    sfs_dir_open_root(check->img, &dir);
+    if (!scan_directory(check, &dir, "")) {
+        return false;
+    }
+    for (size_t i = 0; i < check->num_chains; i++) {
+        chain_t *chain = &check->chains[i];
+        if (!chain->is_dir) {
+            check->files++;
+            continue;
+        }
+        check->dirs++;
+        walk_chain(check, chain);
+        sfs_dir_open(check->img, chain->entry, &dir);
+        dir.num_blocks = chain->valid;
+        sfs_dir_rewind(&dir);
+        if (!scan_directory(check, &dir, chain->path)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void *check_worker(void *arg) {
+    check_t *check = arg;
+    for (;;) {
+        size_t first = __atomic_fetch_add(&check->next_chain, CHECK_BATCH, __ATOMIC_RELAXED);
+        if (first >= check->num_chains) {
+            break;
+        }
+        size_t last = (first + CHECK_BATCH < check->num_chains) ? first + CHECK_BATCH : check->num_chains;
+        for (size_t i = first; i < last; i++) {
+            if (!check->chains[i].is_dir) {
+                walk_chain(check, &check->chains[i]);
+            }
+        }
+    }
+    return NULL;
+}
+
+void check_files(check_t *check) {
+    uint64_t phase SFS_PHASE_SCOPED = SFS_PHASE_BEGIN();
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads > CHECK_MAX_THREADS) {
+        num_threads = CHECK_MAX_THREADS;
+    }
+    if ((size_t)num_threads > check->num_chains / CHECK_BATCH) {
+        num_threads = check->num_chains / CHECK_BATCH;
+    }
+    pthread_t threads[CHECK_MAX_THREADS];
+    long started = 0;
+    for (long i = 1; i < num_threads; i++) {
+        if (pthread_create(&threads[started], NULL, check_worker, check) == 0) {
+            started++;
+        }
+    }
+    check_worker(check);
+    for (long i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    SFS_PHASE_END(SFS_PHASE_FAT, phase);
+}
+
+int compare_shared(const void *a, const void *b) {
+    uint32_t x = ((const shared_block_t *)a)->block;
+    uint32_t y = ((const shared_block_t *)b)->block;
+    return (x > y) - (x < y);
+}
+
+/* Whether a cross-linked chain, followed on through the shared blocks, ends exactly at its block count. */
+bool runs_to_length(const check_t *check, const chain_t *chain) {
+    uint32_t block = chain->bad_block;
+    for (uint32_t n = chain->valid + 1; n <= chain->blocks; n++) {
+        if (!is_allocated(check, block)) {
+            return false;
+        }
+        uint32_t next = sfs_fat_get(check->img, block);
+        if (n == chain->blocks || next == SFS_FAT_EOF) {
+            return n == chain->blocks && next == SFS_FAT_EOF;
+        }
+        block = next;
+    }
+    return false;
+}
+
+/*
+ * The parallel walk reports a cross-link against whichever chain reached
+ * the shared block second. When the chain that got there first is itself
+ * broken and the other one runs exactly its own length through the
+ * shared tail, the tail is the other one's: the blame moves to the broken
+ * chain, so it is the one that gets a copy or is cut.
+ */
+bool blame_cross_links(check_t *check) {
+    shared_block_t *shared = NULL;
+    size_t num_shared = 0;
+    for (size_t i = 0; i < check->num_chains; i++) {
+        if (check->chains[i].state != CHAIN_CROSS_LINKED) {
+            continue;
+        }
+        if (num_shared % 64 == 0) {
+            shared_block_t *grown = realloc(shared, (num_shared + 64) * sizeof(shared_block_t));
+            if (grown == NULL) {
+                free(shared);
+                perror("Error allocating memory for the cross-link list.");
+                return false;
+            }
+            shared = grown;
+        }
+        shared[num_shared++] = (shared_block_t){check->chains[i].bad_block, i, SIZE_MAX, 0};
+    }
+    if (num_shared == 0) {
+        return true;
+    }
+    qsort(shared, num_shared, sizeof(shared_block_t), compare_shared);
+
+    /* One pass over the walked part of every chain finds who claimed each shared block. */
+    for (size_t i = 0; i < check->num_chains; i++) {
+        const chain_t *chain = &check->chains[i];
+        uint32_t block = chain->start;
+        for (uint32_t n = 0; n < chain->valid; n++) {
+            size_t low = 0;
+            size_t high = num_shared;
+            while (low < high) {
+                size_t mid = (low + high) / 2;
+                if (shared[mid].block < block) {
+                    low = mid + 1;
+                } else {
+                    high = mid;
+                }
+            }
+            for (size_t s = low; s < num_shared && shared[s].block == block; s++) {
+                shared[s].owner = i;
+                shared[s].owner_index = n;
+            }
+            block = sfs_fat_get(check->img, block);
+        }
+    }
+
+    for (size_t s = 0; s < num_shared; s++) {
+        chain_t *crossed = &check->chains[shared[s].chain];
+        if (shared[s].owner == SIZE_MAX) {
+            continue;
+        }
+        chain_t *owner = &check->chains[shared[s].owner];
+        if (owner->state == CHAIN_OK || owner->state == CHAIN_CROSS_LINKED || !runs_to_length(check, crossed)) {
+            continue;
+        }
+        /* The owner walked only part of the tail; the rest is claimed now. */
+        uint32_t block = crossed->bad_block;
+        for (uint32_t n = crossed->valid; n < crossed->blocks; n++) {
+            mark_visited(check, block);
+            block = sfs_fat_get(check->img, block);
+        }
+        crossed->valid = crossed->blocks;
+        crossed->state = CHAIN_OK;
+        owner->valid = shared[s].owner_index;
+        owner->bad_block = shared[s].block;
+        owner->state = CHAIN_CROSS_LINKED;
+    }
+    free(shared);
+    return true;
+}
+
+void truncate_chain(check_t *check, chain_t *chain, uint32_t keep) {
+    sfs_image_t *img = check->img;
+    if (keep == 0) {
+        chain->start = SFS_FAT_EOF;
+        chain->entry->starting_block = htonl(SFS_FAT_EOF);
+    } else {
+        sfs_fat_set(img, nth_block(img, chain->start, keep - 1), SFS_FAT_EOF);
+    }
+    chain->blocks = keep;
+    chain->entry->block_count = htonl(keep);
+    sfs_mark_dirty(img, chain->entry, sizeof(dir_entry_t));
+}
+
+/*
+ * Gives a file that lost a cross-link its own copy of the shared tail, so
+ * both owners keep their data. Unreadable tail blocks come back as zeros.
+ */
+bool clone_tail(check_t *check, sfs_allocator_t *alloc, chain_t *chain) {
+    sfs_image_t *img = check->img;
+    uint32_t block_size = img->super_block.block_size;
+    uint32_t count = chain->blocks - chain->valid;
+    uint32_t first = sfs_allocate_chain(alloc, count);
+    if (first == SFS_FAT_EOF) {
+        return false;
+    }
+    uint32_t source = chain->bad_block;
+    uint32_t block = first;
+    for (uint32_t i = 0; i < count; i++) {
+        bool readable = is_allocated(check, source);
+        if (readable) {
+            memcpy(sfs_block(img, block), sfs_block(img, source), block_size);
+        } else {
+            memset(sfs_block(img, block), 0, block_size);
+        }
+        sfs_mark_dirty(img, sfs_block(img, block), block_size);
+        if (img->checksums != NULL && sfs_entry_is_checksummed(chain->entry)) {
+            sfs_checksum_set(img, block, sfs_block(img, block), 1);
+        }
+        mark_visited(check, block);
+        source = readable ? sfs_fat_get(img, source) : SFS_FAT_EOF;
+        block = sfs_fat_get(img, block);
+    }
+    if (chain->valid == 0) {
+        chain->start = first;
+        chain->entry->starting_block = htonl(first);
+        sfs_mark_dirty(img, chain->entry, sizeof(dir_entry_t));
+    } else {
+        sfs_fat_set(img, nth_block(img, chain->start, chain->valid - 1), first);
+    }
+    return true;
+}
+
+void repair_chain(check_t *check, sfs_allocator_t *alloc, chain_t *chain) {
+    const char *path = chain->path;
+    bool fix = check->repair;
+    switch (chain->state) {
+    case CHAIN_OK:
+        break;
+    case CHAIN_BAD_BLOCK:
+        problem(check, fix, "%s: block %u of %u is %u, which is free, reserved or outside the image", path, chain->valid + 1, chain->blocks, chain->bad_block);
+        break;
+    case CHAIN_LOOP:
+        problem(check, fix, "%s: chain loops back to block %u after %u of %u blocks", path, chain->bad_block, chain->valid, chain->blocks);
+        break;
+    case CHAIN_CROSS_LINKED:
+        if (fix && !chain->is_dir && clone_tail(check, alloc, chain)) {
+            problem(check, true, "%s: block %u is shared with another chain; copied %u blocks", path, chain->bad_block, chain->blocks - chain->valid);
+            return;
+        }
+        problem(check, fix, "%s: block %u is shared with another chain", path, chain->bad_block);
+        break;
+    case CHAIN_TOO_LONG:
+        problem(check, fix, "%s: chain continues past its %u blocks", path, chain->blocks);
+        break;
+    case CHAIN_TOO_SHORT:
+        problem(check, fix, "%s: chain ends after %u of %u blocks", path, chain->valid, chain->blocks);
+        break;
+    }
+    if (fix && chain->state != CHAIN_OK) {
+        truncate_chain(check, chain, chain->valid);
+    }
+}
+
+/* A file needs exactly the blocks that hold its size. */
+void trim_chain(check_t *check, chain_t *chain, uint32_t needed) {
+    uint32_t tail = nth_block(check->img, chain->start, needed);
+    uint32_t extra = chain->blocks - needed;
+    truncate_chain(check, chain, needed);
+    unmark_chain(check, tail, extra);
+}
+
+/*
+ * A compressed file needs the blocks its chunk table ends in. A chain
+ * longer than that is trimmed; a shorter one has lost data and is left.
+ */
+void check_compressed_size(check_t *check, chain_t *chain) {
+    uint32_t block_size = check->img->super_block.block_size;
+    uint64_t stored = sfs_stored_size(check->img, chain->entry);
+    uint32_t needed = (stored + block_size - 1) / block_size;
+    if (stored == 0) {
+        problem(check, false, "%s: the chunk table of the compressed file is damaged", chain->path);
+        return;
+    }
+    if (needed == chain->blocks) {
+        return;
+    }
+    bool fixable = needed < chain->blocks;
+    problem(check, check->repair && fixable, "%s: compressed data needs %u blocks but the file has %u", chain->path, needed, chain->blocks);
+    if (check->repair && fixable) {
+        trim_chain(check, chain, needed);
+    }
+}
+
+void check_size(check_t *check, chain_t *chain) {
+    sfs_image_t *img = check->img;
+    uint32_t block_size = img->super_block.block_size;
+    uint64_t size = sfs_entry_size(chain->entry);
+    uint64_t needed = (size + block_size - 1) / block_size;
+    if (chain->is_dir) {
+        return;
+    }
+    if (sfs_entry_is_compressed(chain->entry)) {
+        check_compressed_size(check, chain);
+        return;
+    }
+    if (needed == chain->blocks) {
+        return;
+    }
+    problem(check, check->repair, "%s: size %llu needs %llu blocks but the file has %u", chain->path, (unsigned long long)size, (unsigned long long)needed, chain->blocks);
+    if (!check->repair) {
+        return;
+    }
+    if (needed > chain->blocks) {
+        sfs_entry_set_size(chain->entry, (uint64_t)chain->blocks * block_size);
+        sfs_mark_dirty(img, chain->entry, sizeof(dir_entry_t));
+        return;
+    }
+    trim_chain(check, chain, needed);
+}
+
+/* Allocated blocks that no chain reached: leftovers of interrupted writes. */
+void check_leaks(check_t *check) {
+    uint32_t leaked = 0;
+    for (uint32_t block = 0; block < check->entries; block++) {
+        if (is_allocated(check, block) && !is_visited(check, block)) {
+            leaked++;
+            if (check->repair) {
+                sfs_fat_set(check->img, block, SFS_FAT_FREE);
+            }
+        }
+    }
+    if (leaked > 0) {
+        problem(check, check->repair, "%u blocks are allocated but not used by any file or directory", leaked);
+    }
+}
+
+void check_summary(check_t *check) {
+    sfs_image_t *img = check->img;
+    const sfs_ext_t *ext = sfs_ext(img);
+    sfs_census_t recorded, actual;
+    if (ext == NULL || ntohl(ext->magic) != SFS_EXT_MAGIC) {
+        return;
+    }
+    if (ntohl(ext->summary_state) == SFS_SUMMARY_DIRTY) {
+        problem(check, check->repair, "Summary record is marked dirty; an earlier write did not finish");
+        return;
+    }
+    sfs_fat_census(img->fat, img->fat_entries, &actual);
+    if (!sfs_read_summary(img, &recorded) || memcmp(&recorded, &actual, sizeof(sfs_census_t)) != 0) {
+        problem(check, check->repair, "Summary record does not match the FAT");
+    }
+}
+
+bool add_piece(scrub_t *scrub, size_t chain, uint32_t block, uint32_t count) {
+    if (scrub->num_pieces % 1024 == 0) {
+        scrub_piece_t *grown = realloc(scrub->pieces, (scrub->num_pieces + 1024) * sizeof(scrub_piece_t));
+        if (grown == NULL) {
+            perror("Error allocating memory for the scrub list.");
+            return false;
+        }
+        scrub->pieces = grown;
+    }
+    scrub->pieces[scrub->num_pieces++] = (scrub_piece_t){chain, block, count};
+    scrub->blocks += count;
+    return true;
+}
+
+void add_bad_block(scrub_t *scrub, size_t chain, uint32_t block) {
+    pthread_mutex_lock(&scrub->lock);
+    if (scrub->num_bad == scrub->bad_capacity) {
+        size_t capacity = scrub->bad_capacity ? scrub->bad_capacity * 2 : 64;
+        bad_block_t *grown = realloc(scrub->bad, capacity * sizeof(bad_block_t));
+        if (grown == NULL) {
+            scrub->failed = true;
+            pthread_mutex_unlock(&scrub->lock);
+            return;
+        }
+        scrub->bad = grown;
+        scrub->bad_capacity = capacity;
+    }
+    scrub->bad[scrub->num_bad++] = (bad_block_t){chain, block};
+    pthread_mutex_unlock(&scrub->lock);
+}
+
+void *scrub_worker(void *arg) {
+    scrub_t *scrub = arg;
+    const sfs_image_t *img = scrub->img;
+    uint8_t *buffer = malloc(SCRUB_PIECE_BYTES);
+    if (buffer == NULL) {
+        __atomic_store_n(&scrub->failed, true, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    for (;;) {
+        size_t i = __atomic_fetch_add(&scrub->next_piece, 1, __ATOMIC_RELAXED);
+        if (i >= scrub->num_pieces) {
+            break;
+        }
+        const scrub_piece_t *piece = &scrub->pieces[i];
+        uint32_t bad_block;
+        if (sfs_read_verified(img, piece->block, piece->count, buffer, &bad_block)) {
+            continue;
+        }
+        if (bad_block == SFS_FAT_EOF) {
+            __atomic_store_n(&scrub->failed, true, __ATOMIC_RELAXED);
+            continue;
+        }
+        /* Past the first mismatch the piece is already in memory; find the rest. */
+        uint32_t done = bad_block - piece->block;
+        while (done < piece->count) {
+            add_bad_block(scrub, piece->chain, piece->block + done);
+            done++;
+            done += sfs_checksum_verify(img, piece->block + done, buffer + (size_t)done * img->super_block.block_size, piece->count - done);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+int compare_bad_blocks(const void *a, const void *b) {
+    const bad_block_t *x = a;
+    const bad_block_t *y = b;
+    if (x->chain != y->chain) {
+        return (x->chain > y->chain) - (x->chain < y->chain);
+    }
+    return (x->block > y->block) - (x->block < y->block);
+}
+
+/*
+ * Reads every block of every checksummed file whose chain checked out and
+ * verifies it. The files are cut into runs of contiguous blocks up to
+ * SCRUB_PIECE_BYTES, which workers take in turn, so one large file is
+ * spread over every thread.
+ */
+bool scrub_files(check_t *check, scrub_t *scrub) {
+    const sfs_image_t *img = check->img;
+    uint32_t per_piece = SCRUB_PIECE_BYTES / img->super_block.block_size;
+    bool ok = true;
+    scrub->img = img;
+    pthread_mutex_init(&scrub->lock, NULL);
+    for (size_t i = 0; ok && i < check->num_chains; i++) {
+        const chain_t *chain = &check->chains[i];
+        if (chain->is_dir || chain->state != CHAIN_OK || !sfs_entry_is_checksummed(chain->entry)) {
+            continue;
+        }
+        sfs_extent_t *extents;
+        uint32_t num_extents = sfs_chain_extents(img, chain->start, chain->blocks, &extents);
+        ok = extents != NULL;
+        for (uint32_t e = 0; ok && e < num_extents; e++) {
+            for (uint32_t done = 0; ok && done < extents[e].length; done += per_piece) {
+                uint32_t count = (extents[e].length - done < per_piece) ? extents[e].length - done : per_piece;
+                ok = add_piece(scrub, i, extents[e].start + done, count);
+            }
+        }
+        free(extents);
+        scrub->files++;
+    }
+
+    uint64_t phase SFS_PHASE_SCOPED = SFS_PHASE_BEGIN();
+    posix_fadvise(img->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads > CHECK_MAX_THREADS) {
+        num_threads = CHECK_MAX_THREADS;
+    }
+    pthread_t threads[CHECK_MAX_THREADS];
+    long started = 0;
+    for (long i = 1; ok && i < num_threads && (size_t)i < scrub->num_pieces; i++) {
+        if (pthread_create(&threads[started], NULL, scrub_worker, scrub) == 0) {
+            started++;
+        }
+    }
+    if (ok) {
+        scrub_worker(scrub);
+    }
+    for (long i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    SFS_PHASE_END(SFS_PHASE_COPY, phase);
+
+    qsort(scrub->bad, scrub->num_bad, sizeof(bad_block_t), compare_bad_blocks);
+    for (size_t i = 0; i < scrub->num_bad; i++) {
+        problem(check, false, "%s: block %u fails its checksum", check->chains[scrub->bad[i].chain].path, scrub->bad[i].block);
+    }
+    if (ok && scrub->failed) {
+        perror("Error reading file data.");
+    }
+    pthread_mutex_destroy(&scrub->lock);
+    free(scrub->pieces);
+    free(scrub->bad);
+    return ok && !scrub->failed;
+}
+
+int main(int argc, char *argv[]) {
+    sfs_stats_args(&argc, argv);
+    bool repair = false;
+    bool scrub_data = false;
+    while (argc > 2 && (strcmp(argv[1], "-r") == 0 || strcmp(argv[1], "--scrub") == 0)) {
+        repair = repair || strcmp(argv[1], "-r") == 0;
+        scrub_data = scrub_data || strcmp(argv[1], "--scrub") == 0;
+        argv++;
+        argc--;
+    }
+    if (argc != 2) {
+        fprintf(stderr, "Usage: diskcheck [-r] [--scrub] <file system image>\n");
+        return EXIT_FAILED;
+    }
+
+    sfs_image_t img;
+    check_t check;
+    memset(&check, 0, sizeof(check));
+    check.img = &img;
+    check.repair = repair;
+    if (!sfs_open(argv[argc - 1], repair, &img)) {
+        return EXIT_FAILED;
+    }
+    /* Repairs rewrite the summary from a fresh census of the FAT. */
+    img.summary_known = false;
+    check.entries = (img.fat_entries < img.super_block.block_count) ? img.fat_entries : img.super_block.block_count;
+    posix_fadvise(img.fd, sfs_block_offset(&img, img.super_block.fat_start), (off_t)img.super_block.fat_blocks * img.super_block.block_size, POSIX_FADV_WILLNEED);
+    check.visited = calloc((check.entries + 63) / 64, sizeof(uint64_t));
+    if (check.visited == NULL) {
+        perror("Error allocating memory for the block map.");
+        sfs_close(&img);
+        return EXIT_FAILED;
+    }
+
+    sfs_allocator_t alloc;
+    bool ok = scan_tree(&check);
+    if (ok) {
+        check_files(&check);
+        ok = blame_cross_links(&check);
+        check_summary(&check);
+        ok = ok && (!repair || sfs_allocator_init(&img, &alloc));
+    }
+    scrub_t scrub;
+    memset(&scrub, 0, sizeof(scrub));
+    if (ok && scrub_data && img.checksums == NULL) {
+        printf("The image has no block checksums to scrub.\n");
+    } else if (ok && scrub_data) {
+        ok = scrub_files(&check, &scrub);
+    }
+    if (ok) {
+        /* Copies follow shared tails through the FAT, so all of them are made before any chain is cut. */
+        for (size_t i = 0; i < check.num_chains; i++) {
+            if (check.chains[i].state == CHAIN_CROSS_LINKED) {
+                repair_chain(&check, &alloc, &check.chains[i]);
+            }
+        }
+        for (size_t i = 0; i < check.num_chains; i++) {
+            if (check.chains[i].state != CHAIN_CROSS_LINKED) {
+                repair_chain(&check, &alloc, &check.chains[i]);
+            }
+        }
+        for (size_t i = 0; i < check.num_chains; i++) {
+            check_size(&check, &check.chains[i]);
+        }
+        check_leaks(&check);
+        if (repair) {
+            sfs_allocator_free(&alloc);
+            if (sfs_ext(&img) != NULL) {
+                sfs_mark_dirty(&img, sfs_ext(&img), sizeof(sfs_ext_t));
+            }
+            if (!sfs_flush(&img) || fdatasync(img.fd) == -1) {
+                fprintf(stderr, "Failed to write file system metadata.\n");
+                ok = false;
+            }
+        }
+    }
+    if (ok) {
+        uint64_t in_use = 0;
+        for (uint32_t w = 0; w < (check.entries + 63) / 64; w++) {
+            in_use += __builtin_popcountll(check.visited[w]);
+        }
+        printf("Files: %u, directories: %u, blocks in use: %llu\n", check.files, check.dirs, (unsigned long long)in_use);
+        if (scrub_data && img.checksums != NULL) {
+            printf("Scrubbed %llu blocks of %u checksummed files.\n", (unsigned long long)scrub.blocks, scrub.files);
+        }
+        if (check.problems == 0) {
+            printf("No problems found.\n");
+        } else {
+            printf("%u problems found, %u repaired.\n", check.problems, check.repaired);
+        }
+    }
+
+    for (size_t i = 0; i < check.num_chains; i++) {
+        free(check.chains[i].path);
+    }
+    free(check.chains);
+    free(check.visited);
+    sfs_close(&img);
+    if (!ok) {
+        return EXIT_FAILED;
+    }
+    if (check.problems == 0) {
+        return EXIT_CLEAN;
+    }
+    return (check.repaired == check.problems) ? EXIT_REPAIRED : EXIT_UNREPAIRED;
+}
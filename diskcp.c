@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "sfs.h"
+
+bool remote_copy(int sock, const char *source_path, const char *dest_path, char *error, size_t error_size) {
+    char request[2100];
+    uint64_t size;
+    snprintf(request, sizeof(request), "COPY\t%s\t%s\n", source_path, dest_path);
+    return sfs_client_request(sock, request, &size, error, error_size);
+}
+
+int main(int argc, char *argv[]) {
+    sfs_stats_args(&argc, argv);
+    if (argc != 4) {
+        fprintf(stderr, "Usage: diskcp <file system image> <source path> <destination path>\n");
+        return 1;
+    }
+
+    char error[128];
+    int sock = sfs_client_connect(argv[1]);
+    if (sock != -1) {
+        bool ok = remote_copy(sock, argv[2], argv[3], error, sizeof(error));
+        if (!ok) {
+            fprintf(stderr, "%s: %s\n", argv[2], error);
+        }
+        close(sock);
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    sfs_image_t img;
+    sfs_put_session_t session;
+    if (!sfs_open(argv[1], true, &img)) {
+        return EXIT_FAILURE;
+    }
+    if (!sfs_put_begin(&img, &session)) {
+        sfs_close(&img);
+        return EXIT_FAILURE;
+    }
+    bool ok = sfs_copy_path(&session, argv[2], argv[3]);
+    if (!ok) {
+        fprintf(stderr, "%s: %s\n", argv[2], session.error);
+    } else if (!sfs_flush(&img)) {
+        fprintf(stderr, "Failed to write file system metadata.\n");
+        ok = false;
+    }
+    sfs_put_end(&session);
+    sfs_close(&img);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "sfs.h"
+
+#define DEFRAG_BATCH 256
+#define DEFRAG_MAX_DEPTH 64
+
+/* A file or subdirectory chain and the directory entry that owns it. */
+typedef struct {
+    dir_entry_t *entry;
+    uint32_t start;
+    uint32_t blocks;
+    uint32_t extents;
+    bool is_dir;
+} chain_t;
+
+typedef struct {
+    chain_t *chain;
+    uint32_t old_start;
+    uint32_t target;
+} move_t;
+
+typedef struct {
+    sfs_image_t *img;
+    sfs_allocator_t alloc;
+    sfs_copier_t copier;
+    chain_t *chains;
+    size_t num_chains;
+    size_t capacity;
+    move_t batch[DEFRAG_BATCH];
+    int batch_size;
+    uint32_t moves;
+    uint64_t blocks_moved;
+} defrag_t;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+void request_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+uint32_t count_extents(const sfs_image_t *img, uint32_t start, uint32_t blocks) {
+    uint32_t extents = 0;
+    uint32_t prev = SFS_FAT_EOF;
+    uint32_t block = start;
+    while (blocks-- > 0 && block < img->super_block.block_count) {
+        if (block != prev + 1) {
+            extents++;
+        }
+        prev = block;
+        block = sfs_fat_get(img, block);
+    }
+    return extents;
+}
+
+bool collect_chains(defrag_t *defrag, sfs_dir_iter_t *dir, int depth) {
+    const sfs_image_t *img = defrag->img;
+    dir_entry_t *entry;
+    while ((entry = sfs_dir_next(dir)) != NULL) {
+        uint32_t start = ntohl(entry->starting_block);
+        uint32_t blocks = ntohl(entry->block_count);
+        if (!sfs_entry_in_use(entry) || sfs_entry_is_dot(entry) || blocks == 0 || start >= img->super_block.block_count) {
+            continue;
+        }
+        if (defrag->num_chains == defrag->capacity) {
+            size_t capacity = defrag->capacity ? defrag->capacity * 2 : 1024;
+            chain_t *grown = realloc(defrag->chains, capacity * sizeof(chain_t));
+            if (grown == NULL) {
+                perror("Error allocating memory for the file list.");
+                return false;
+            }
+            defrag->chains = grown;
+            defrag->capacity = capacity;
+        }
+        chain_t *chain = &defrag->chains[defrag->num_chains++];
+        chain->entry = entry;
+        chain->start = start;
+        chain->blocks = blocks;
+        chain->extents = count_extents(img, start, blocks);
+        chain->is_dir = sfs_entry_is_dir(entry);
+        if (chain->is_dir && depth < DEFRAG_MAX_DEPTH) {
+            sfs_dir_iter_t child;
+            sfs_dir_open(img, entry, &child);
+            if (!collect_chains(defrag, &child, depth + 1)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool rescan(defrag_t *defrag) {
+    sfs_dir_iter_t root;
+    defrag->num_chains = 0;
+    sfs_dir_open_root(defrag->img, &root);
+    return collect_chains(defrag, &root, 0);
+}
+
+/*
+ * The score is the share of block-to-block steps inside files that are
+ * not contiguous: 0% when every chain is one extent, 100% when no two
+ * consecutive blocks of any file are adjacent.
+ */
+void report(const defrag_t *defrag, const char *label) {
+    uint64_t extents = 0;
+    uint64_t blocks = 0;
+    uint32_t files = 0;
+    uint32_t dirs = 0;
+    uint32_t fragmented = 0;
+    for (size_t i = 0; i < defrag->num_chains; i++) {
+        const chain_t *chain = &defrag->chains[i];
+        extents += chain->extents;
+        blocks += chain->blocks;
+        fragmented += chain->extents > 1;
+        if (chain->is_dir) {
+            dirs++;
+        } else {
+            files++;
+        }
+    }
+    uint32_t free_runs = 0;
+    uint32_t largest = 0;
+    uint32_t run = 0;
+    for (uint32_t block = 0; block < defrag->alloc.entries; block++) {
+        if (defrag->alloc.free_map[block / 64] >> (block % 64) & 1) {
+            free_runs += (run == 0);
+            run++;
+            largest = (run > largest) ? run : largest;
+        } else {
+            run = 0;
+        }
+    }
+    double score = (blocks > defrag->num_chains) ? 100.0 * (extents - defrag->num_chains) / (blocks - defrag->num_chains) : 0.0;
+    printf("%s\n", label);
+    printf("Files: %u, directories: %u, extents: %llu (%u fragmented)\n", files, dirs, (unsigned long long)extents, fragmented);
+    printf("Fragmentation score: %.1f%%\n", score);
+    printf("Free space: %u blocks in %u runs, largest run %u blocks\n", defrag->alloc.free_count, free_runs, largest);
+}
+
+bool copy_chain(defrag_t *defrag, const chain_t *chain, uint32_t target) {
+    sfs_image_t *img = defrag->img;
+    uint32_t block_size = img->super_block.block_size;
+    sfs_extent_t *extents;
+    uint32_t num_extents = sfs_chain_extents(img, chain->start, chain->blocks, &extents);
+    sfs_copy_seg_t *segs = malloc(num_extents * sizeof(sfs_copy_seg_t));
+    bool ok = extents != NULL && segs != NULL;
+    uint32_t offset = 0;
+
+    for (uint32_t i = 0; ok && i < num_extents; i++) {
+        if (chain->is_dir) {
+            /* Directory blocks are metadata and move through the mapping. */
+            memcpy(sfs_block(img, target + offset), sfs_block(img, extents[i].start), (size_t)extents[i].length * block_size);
+            sfs_mark_dirty(img, sfs_block(img, target + offset), (size_t)extents[i].length * block_size);
+        } else {
+            if (img->checksums != NULL && sfs_entry_is_checksummed(chain->entry)) {
+                sfs_checksum_copy(img, extents[i].start, target + offset, extents[i].length);
+            }
+            segs[i].src_offset = sfs_block_offset(img, extents[i].start);
+            segs[i].dst_offset = sfs_block_offset(img, target + offset);
+            segs[i].length = (size_t)extents[i].length * block_size;
+        }
+        offset += extents[i].length;
+    }
+    if (ok && !chain->is_dir && !sfs_copy(&defrag->copier, img->fd, img->fd, segs, num_extents)) {
+        perror("Error moving file data.");
+        ok = false;
+    }
+    free(extents);
+    free(segs);
+    return ok;
+}
+
+bool write_back(sfs_image_t *img) {
+    if (!sfs_flush(img) || fdatasync(img->fd) == -1) {
+        fprintf(stderr, "Failed to write file system metadata.\n");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Commits the queued moves in three durable steps: the copies and their
+ * new chains, then the directory entries switched over, then the old
+ * chains freed. Stopping between any two steps leaves every file intact;
+ * the worst case is blocks still allocated to a chain nothing points at.
+ */
+bool commit_batch(defrag_t *defrag) {
+    sfs_image_t *img = defrag->img;
+    if (defrag->batch_size == 0) {
+        return true;
+    }
+    if (!write_back(img)) {
+        return false;
+    }
+    for (int i = 0; i < defrag->batch_size; i++) {
+        move_t *move = &defrag->batch[i];
+        if (move->chain->is_dir) {
+            sfs_dir_iter_t dir;
+            sfs_dir_open(img, move->chain->entry, &dir);
+            sfs_index_relocate(img, &dir, move->target);
+        }
+        move->chain->entry->starting_block = htonl(move->target);
+        sfs_mark_dirty(img, move->chain->entry, sizeof(dir_entry_t));
+    }
+    if (!write_back(img)) {
+        return false;
+    }
+    for (int i = 0; i < defrag->batch_size; i++) {
+        move_t *move = &defrag->batch[i];
+        sfs_free_chain(&defrag->alloc, move->old_start);
+        move->chain->start = move->target;
+        move->chain->extents = 1;
+        defrag->moves++;
+        defrag->blocks_moved += move->chain->blocks;
+    }
+    defrag->batch_size = 0;
+    return write_back(img);
+}
+
+/*
+ * One sweep in block order. A fragmented chain moves to the first free
+ * run that holds it whole; a contiguous chain moves only to a free run
+ * entirely below where it starts, so free space drifts to the end and
+ * every sweep makes progress. A directory move changes the address of
+ * every entry inside it, so it is committed on its own and ends the
+ * sweep for a fresh scan.
+ */
+bool sweep(defrag_t *defrag, bool *moved) {
+    *moved = false;
+    for (size_t i = 0; i < defrag->num_chains && !stop_requested; i++) {
+        chain_t *chain = &defrag->chains[i];
+        uint32_t limit = (chain->extents > 1) ? defrag->alloc.entries : chain->start;
+        uint32_t target = sfs_find_contiguous(&defrag->alloc, chain->blocks, limit);
+        if (target == SFS_FAT_EOF) {
+            continue;
+        }
+        if (chain->is_dir && !commit_batch(defrag)) {
+            return false;
+        }
+        sfs_claim_contiguous(&defrag->alloc, target, chain->blocks);
+        if (!copy_chain(defrag, chain, target)) {
+            sfs_free_chain(&defrag->alloc, target);
+            return false;
+        }
+        defrag->batch[defrag->batch_size++] = (move_t){chain, chain->start, target};
+        *moved = true;
+        if (chain->is_dir) {
+            return commit_batch(defrag);
+        }
+        if (defrag->batch_size == DEFRAG_BATCH && !commit_batch(defrag)) {
+            return false;
+        }
+    }
+    return commit_batch(defrag);
+}
+
+int compare_chains(const void *a, const void *b) {
+    uint32_t start_a = ((const chain_t *)a)->start;
+    uint32_t start_b = ((const chain_t *)b)->start;
+    return (start_a > start_b) - (start_a < start_b);
+}
+
+int main(int argc, char *argv[]) {
+    sfs_stats_args(&argc, argv);
+    bool dry_run = argc == 3 && strcmp(argv[1], "-n") == 0;
+    if (argc != 2 && !dry_run) {
+        fprintf(stderr, "Usage: diskdefrag [-n] <file system image>\n");
+        return 1;
+    }
+
+    sfs_image_t img;
+    defrag_t defrag;
+    memset(&defrag, 0, sizeof(defrag));
+    defrag.img = &img;
+    if (!sfs_open(argv[argc - 1], !dry_run, &img)) {
+        return 1;
+    }
+    if (!sfs_allocator_init(&img, &defrag.alloc) || !sfs_copier_init(&defrag.copier)) {
+        sfs_close(&img);
+        return 1;
+    }
+
+    bool ok = rescan(&defrag);
+    if (ok) {
+        report(&defrag, "Before");
+    }
+    if (ok && !dry_run) {
+        signal(SIGINT, request_stop);
+        signal(SIGTERM, request_stop);
+        bool moved = true;
+        while (ok && moved && !stop_requested) {
+            qsort(defrag.chains, defrag.num_chains, sizeof(chain_t), compare_chains);
+            ok = sweep(&defrag, &moved) && rescan(&defrag);
+        }
+        if (stop_requested) {
+            printf("\nStopped early; the image is consistent.\n");
+        }
+        printf("\nMoved %u chains (%llu blocks)\n\n", defrag.moves, (unsigned long long)defrag.blocks_moved);
+        report(&defrag, "After");
+    }
+
+    sfs_copier_free(&defrag.copier);
+    sfs_allocator_free(&defrag.alloc);
+    free(defrag.chains);
+    sfs_close(&img);
+    return ok ? 0 : 1;
+}
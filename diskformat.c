@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "sfs.h"
+
+void usage(void) {
+    fprintf(stderr, "Usage: diskformat [-b block size] [-r root directory blocks] [-p] <file system image> <size>\n");
+}
+
+int main(int argc, char *argv[]) {
+    sfs_stats_args(&argc, argv);
+    sfs_format_t format = {512, 0, 16, false};
+    int i = 1;
+    while (i < argc - 2 && argv[i][0] == '-') {
+        if (strcmp(argv[i], "-p") == 0) {
+            format.preallocate = true;
+        } else if (strcmp(argv[i], "-b") == 0) {
+            format.block_size = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-r") == 0) {
+            format.root_dir_blocks = strtoul(argv[++i], NULL, 10);
+        } else {
+            break;
+        }
+        i++;
+    }
+    if (argc - i != 2) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    uint64_t size = sfs_parse_size(argv[i + 1]);
+    if (size == 0 || format.block_size == 0 || size / format.block_size >= SFS_FAT_EOF) {
+        fprintf(stderr, "Invalid image size %s.\n", argv[i + 1]);
+        return EXIT_FAILURE;
+    }
+    format.block_count = size / format.block_size;
+    if (!sfs_format(argv[i], &format)) {
+        return EXIT_FAILURE;
+    }
+    printf("%s: %u blocks of %u bytes\n", argv[i], format.block_count, format.block_size);
+    return EXIT_SUCCESS;
+}
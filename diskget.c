@@ -1,167 +1,505 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <arpa/inet.h>
 #include <string.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include "sfs.h"
 
-typedef struct __attribute__((packed)) {
-    char fs_id[8];
-    uint16_t block_size;
-    uint32_t block_count;
-    uint32_t fat_start;
-    uint32_t fat_blocks;
-    uint32_t root_dir_start;
-    uint32_t root_dir_blocks;
-} superblock_t;
-
-typedef struct __attribute__((packed)) {
-    uint16_t year;
-    uint8_t month;
-    uint8_t day;
-    uint8_t hour;
-    uint8_t minute;
-    uint8_t second;
-} dir_entry_timedate_t;
-
-typedef struct __attribute__((packed)) {
-    uint8_t status;
-    uint32_t starting_block;
-    uint32_t block_count;
-    uint32_t size;
-    dir_entry_timedate_t create_time;
-    dir_entry_timedate_t modify_time;
-    char filename[31];
-    char unused[6];
-} dir_entry_t;
-
-void find_subdirectories(const char *path, char subdirs[10][32], int *num_subdirs) {
-    char *cur;
-    char temp_path[100];
-    strncpy(temp_path, path, sizeof(temp_path) - 1);
-    temp_path[sizeof(temp_path) - 1] = '\0';
-    *num_subdirs = 0;
-    cur = strtok(temp_path, "/");
-    while (cur != NULL) {
-        strncpy(subdirs[*num_subdirs], cur, 31);
-        subdirs[*num_subdirs][31] = '\0';
-        (*num_subdirs)++;
-        cur = strtok(NULL, "/");
+#define EXPORT_CHUNK_SIZE (4 * 1024 * 1024)
+#define EXPORT_MAX_THREADS 32
+#define EXPORT_MAX_DEPTH 64
+
+/*
+ * One piece of a tree export: a run of image bytes and where it lands in
+ * a host file. Files copied as a single chunk carry their open descriptor;
+ * chunks of larger files reopen the destination so they can run on any
+ * worker.
+ */
+typedef struct {
+    const char *dest_path;
+    off_t image_offset;
+    off_t file_offset;
+    size_t length;
+    bool verify;
+} export_chunk_t;
+
+typedef struct {
+    const sfs_image_t *img;
+    export_chunk_t *chunks;
+    size_t num_chunks;
+    size_t chunk_capacity;
+    char **paths;
+    size_t num_paths;
+    size_t path_capacity;
+    size_t next_chunk;
+    int failures;
+} export_job_t;
+
+static bool use_copy_file_range = true;
+static bool use_sendfile = true;
+
+bool copy_range(const sfs_image_t *img, int dest, off_t offset, size_t length) {
+    while (length > 0) {
+        ssize_t copied = -1;
+        if (use_copy_file_range) {
+            SFS_COUNT_IO(false, offset, length);
+            copied = copy_file_range(img->fd, &offset, dest, NULL, length, 0);
+            if (copied == -1 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+                use_copy_file_range = false;
+            }
+        }
+        if (!use_copy_file_range && use_sendfile) {
+            SFS_COUNT_IO(false, offset, length);
+            copied = sendfile(dest, img->fd, &offset, length);
+            if (copied == -1 && (errno == ENOSYS || errno == EINVAL)) {
+                use_sendfile = false;
+            }
+        }
+        if (!use_copy_file_range && !use_sendfile) {
+            SFS_COUNT_IO(false, offset, length);
+            copied = write(dest, img->base + offset, length);
+            if (copied > 0) {
+                offset += copied;
+            }
+        }
+        if (copied <= 0) {
+            if (copied == -1 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        SFS_COUNT(bytes_written, copied);
+        length -= copied;
+    }
+    return true;
+}
+
+/*
+ * Used once copy_file_range() turns out to be unsupported: the rest of
+ * the file goes through the async copier instead of one synchronous
+ * sendfile() per extent.
+ */
+bool copy_extents(const sfs_image_t *img, int dest, const sfs_extent_t *extents, uint32_t num_extents, off_t file_offset, uint64_t remaining_size) {
+    sfs_copier_t copier;
+    sfs_copy_seg_t *segs = malloc(num_extents * sizeof(sfs_copy_seg_t));
+    size_t num_segs = 0;
+    if (segs == NULL || !sfs_copier_init(&copier)) {
+        free(segs);
+        return false;
+    }
+    for (uint32_t i = 0; i < num_extents && remaining_size > 0; i++) {
+        size_t length = (size_t)extents[i].length * img->super_block.block_size;
+        if (length > remaining_size) {
+            length = remaining_size;
+        }
+        segs[num_segs].src_offset = sfs_block_offset(img, extents[i].start);
+        segs[num_segs].dst_offset = file_offset;
+        segs[num_segs].length = length;
+        num_segs++;
+        file_offset += length;
+        remaining_size -= length;
+    }
+    bool ok = remaining_size == 0 && sfs_copy(&copier, img->fd, dest, segs, num_segs);
+    sfs_copier_free(&copier);
+    free(segs);
+    return ok;
+}
+
+bool copy_compressed(const sfs_image_t *img, const dir_entry_t *entry, const char *dest_filename) {
+    int dest_file = open(dest_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (dest_file == -1) {
+        perror("Error opening destination file.");
+        return false;
+    }
+    uint64_t phase SFS_PHASE_SCOPED = SFS_PHASE_BEGIN();
+    bool ok = sfs_get_compressed(img, entry, NULL, 0, dest_file);
+    SFS_PHASE_END(SFS_PHASE_COPY, phase);
+    close(dest_file);
+    if (!ok) {
+        fprintf(stderr, "%s: Error decompressing file.\n", dest_filename);
     }
+    return ok;
 }
 
-bool copy_file(FILE *file, uint32_t source_start_block, uint32_t source_size, const superblock_t *super_block, const char *dest_filename) {
-    long src_offset = (long)source_start_block * super_block->block_size;
-    if (fseek(file, src_offset, SEEK_SET) == -1) {
-        perror("Error seeking to source.");
+/* Checksummed files are read into memory so every block is verified before it is written. */
+bool copy_verified(const sfs_image_t *img, const dir_entry_t *entry, const char *dest_filename) {
+    sfs_extent_t *extents;
+    uint32_t bad_block;
+    uint32_t num_extents = sfs_chain_extents(img, ntohl(entry->starting_block), ntohl(entry->block_count), &extents);
+    if (extents == NULL) {
+        perror("Error reading FAT chain.");
         return false;
     }
-    FILE *dest_file = fopen(dest_filename, "wb");
-    if (dest_file == NULL) {
+    int dest_file = open(dest_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (dest_file == -1) {
         perror("Error opening destination file.");
+        free(extents);
         return false;
     }
-    char buffer[super_block->block_size];
-    uint32_t remaining_size = source_size;
-    while (remaining_size > 0) {
-        size_t read_size = (remaining_size < super_block->block_size) ? remaining_size : super_block->block_size;
-        if (fread(buffer, 1, read_size, file) != read_size) {
-            perror("Error reading source file.");
-            fclose(dest_file);
-            return false;
+    uint64_t phase SFS_PHASE_SCOPED = SFS_PHASE_BEGIN();
+    posix_fadvise(img->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    sfs_readahead(img, extents, num_extents, 0, SFS_READAHEAD_BYTES);
+    bool ok = sfs_write_verified(img, extents, num_extents, sfs_entry_size(entry), dest_file, &bad_block);
+    SFS_PHASE_END(SFS_PHASE_COPY, phase);
+    close(dest_file);
+    free(extents);
+    if (!ok && bad_block != SFS_FAT_EOF) {
+        fprintf(stderr, "Error reading source file: block %u fails its checksum.\n", bad_block);
+    } else if (!ok) {
+        perror("Error writing to destination file.");
+    }
+    return ok;
+}
+
+bool copy_file(const sfs_image_t *img, const dir_entry_t *entry, const char *dest_filename) {
+    if (sfs_entry_is_compressed(entry)) {
+        return copy_compressed(img, entry, dest_filename);
+    }
+    if (img->checksums != NULL && sfs_entry_is_checksummed(entry)) {
+        return copy_verified(img, entry, dest_filename);
+    }
+    uint32_t block_size = img->super_block.block_size;
+    uint64_t remaining_size = sfs_entry_size(entry);
+    sfs_extent_t *extents;
+    uint32_t num_extents = sfs_chain_extents(img, ntohl(entry->starting_block), ntohl(entry->block_count), &extents);
+    if (extents == NULL) {
+        perror("Error reading FAT chain.");
+        return false;
+    }
+    int dest_file = open(dest_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (dest_file == -1) {
+        perror("Error opening destination file.");
+        free(extents);
+        return false;
+    }
+    struct stat st;
+    bool positioned = fstat(dest_file, &st) == 0 && S_ISREG(st.st_mode);
+    uint64_t phase SFS_PHASE_SCOPED = SFS_PHASE_BEGIN();
+    posix_fadvise(img->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    uint32_t advised = sfs_readahead(img, extents, num_extents, 0, SFS_READAHEAD_BYTES);
+
+    for (uint32_t i = 0; i < num_extents && remaining_size > 0; i++) {
+        if (advised < num_extents && advised <= i + 1) {
+            advised = sfs_readahead(img, extents, num_extents, advised, SFS_READAHEAD_BYTES);
+        }
+        size_t length = (size_t)extents[i].length * block_size;
+        if (length > remaining_size) {
+            length = remaining_size;
+        }
+        if (!use_copy_file_range && positioned) {
+            if (!copy_extents(img, dest_file, extents + i, num_extents - i, sfs_entry_size(entry) - remaining_size, remaining_size)) {
+                perror("Error writing to destination file.");
+                SFS_PHASE_END(SFS_PHASE_COPY, phase);
+                close(dest_file);
+                free(extents);
+                return false;
+            }
+            remaining_size = 0;
+            break;
         }
-        if (fwrite(buffer, 1, read_size, dest_file) != read_size) {
+        if (!copy_range(img, dest_file, sfs_block_offset(img, extents[i].start), length)) {
             perror("Error writing to destination file.");
-            fclose(dest_file);
+            SFS_PHASE_END(SFS_PHASE_COPY, phase);
+            close(dest_file);
+            free(extents);
             return false;
         }
-        remaining_size -= read_size;
+        remaining_size -= length;
+    }
+    SFS_PHASE_END(SFS_PHASE_COPY, phase);
+    close(dest_file);
+    free(extents);
+    if (remaining_size > 0) {
+        fprintf(stderr, "Error reading source file: FAT chain is shorter than the file size.\n");
+        return false;
     }
-    fclose(dest_file);
     return true;
 }
 
-bool find_file_in_directory(FILE *file, const superblock_t *super_block, uint32_t start_block, uint32_t block_count, const char subdirs[10][32], int cur_subdir, int num_subdirs, const char *filename, uint32_t *src_start_block, uint32_t *src_size) {
-    dir_entry_t entry;
-    long offset = (long)start_block * super_block->block_size;
-    fseek(file, offset, SEEK_SET);
-    for (int i = 0; i < block_count * (super_block->block_size / sizeof(dir_entry_t)); ++i) {
-        if (fread(&entry, sizeof(dir_entry_t), 1, file) != 1) {
-            break;
+bool add_chunk(export_job_t *job, const export_chunk_t *chunk) {
+    if (job->num_chunks == job->chunk_capacity) {
+        size_t capacity = job->chunk_capacity ? job->chunk_capacity * 2 : 1024;
+        export_chunk_t *grown = realloc(job->chunks, capacity * sizeof(export_chunk_t));
+        if (grown == NULL) {
+            return false;
         }
-        if (entry.status == 0x00 || entry.status == 0xFF) {
-            continue;
+        job->chunks = grown;
+        job->chunk_capacity = capacity;
+    }
+    job->chunks[job->num_chunks++] = *chunk;
+    return true;
+}
+
+const char *keep_path(export_job_t *job, const char *path) {
+    if (job->num_paths == job->path_capacity) {
+        size_t capacity = job->path_capacity ? job->path_capacity * 2 : 1024;
+        char **grown = realloc(job->paths, capacity * sizeof(char *));
+        if (grown == NULL) {
+            return NULL;
+        }
+        job->paths = grown;
+        job->path_capacity = capacity;
+    }
+    job->paths[job->num_paths] = strdup(path);
+    return job->paths[job->num_paths++];
+}
+
+bool add_file_chunks(export_job_t *job, const dir_entry_t *entry, const char *host_path) {
+    const sfs_image_t *img = job->img;
+    uint32_t block_size = img->super_block.block_size;
+    off_t remaining_size = sfs_entry_size(entry);
+    off_t file_offset = 0;
+    sfs_extent_t *extents;
+    uint32_t num_extents = sfs_chain_extents(img, ntohl(entry->starting_block), ntohl(entry->block_count), &extents);
+    const char *dest_path = keep_path(job, host_path);
+    bool verify = img->checksums != NULL && sfs_entry_is_checksummed(entry);
+    /* Created and sized now but closed at once: the workers open it again, so a large tree does not hold a descriptor per file. */
+    int fd = open(host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (extents == NULL || dest_path == NULL || fd == -1) {
+        fprintf(stderr, "%s: Error opening destination file.\n", host_path);
+        free(extents);
+        if (fd != -1) {
+            close(fd);
         }
-        entry.filename[30] = '\0';
-        if (cur_subdir < num_subdirs && (entry.status & 0x02) == 0) {
-            if (strcmp(entry.filename, subdirs[cur_subdir]) == 0) {
-                return find_file_in_directory(file, super_block, ntohl(entry.starting_block), ntohl(entry.block_count), subdirs, cur_subdir + 1, num_subdirs, filename, src_start_block, src_size);
+        return false;
+    }
+    if (ftruncate(fd, remaining_size) == -1) {
+        perror("Error writing to destination file.");
+    }
+    close(fd);
+
+    for (uint32_t i = 0; i < num_extents && remaining_size > 0; i++) {
+        off_t image_offset = sfs_block_offset(img, extents[i].start);
+        off_t extent_left = (off_t)extents[i].length * block_size;
+        while (extent_left > 0 && remaining_size > 0) {
+            export_chunk_t chunk = {dest_path, image_offset, file_offset, EXPORT_CHUNK_SIZE, verify};
+            if ((off_t)chunk.length > extent_left) {
+                chunk.length = extent_left;
+            }
+            if ((off_t)chunk.length > remaining_size) {
+                chunk.length = remaining_size;
             }
-        } else if (cur_subdir + 1 == num_subdirs) {
-            if (strcmp(entry.filename, filename) == 0) {
-                *src_start_block = ntohl(entry.starting_block);
-                *src_size = ntohl(entry.size);
-                return true;
+            if (!add_chunk(job, &chunk)) {
+                free(extents);
+                return false;
             }
+            image_offset += chunk.length;
+            file_offset += chunk.length;
+            extent_left -= chunk.length;
+            remaining_size -= chunk.length;
         }
     }
-    return false;
+    free(extents);
+    if (remaining_size > 0) {
+        fprintf(stderr, "%s: FAT chain is shorter than the file size.\n", host_path);
+        return false;
+    }
+    return true;
 }
 
-void set_superblock_info(superblock_t *super_block) {
-    super_block->block_size = ntohs(super_block->block_size);
-    super_block->block_count = ntohl(super_block->block_count);
-    super_block->fat_start = ntohl(super_block->fat_start);
-    super_block->fat_blocks = ntohl(super_block->fat_blocks);
-    super_block->root_dir_start = ntohl(super_block->root_dir_start);
-    super_block->root_dir_blocks = ntohl(super_block->root_dir_blocks);
+bool collect_tree(export_job_t *job, sfs_dir_iter_t *dir, const char *host_dir, int depth) {
+    dir_entry_t *entry;
+    char name[32];
+    char host_path[4096];
+    bool ok = true;
+
+    if (mkdir(host_dir, 0755) == -1 && errno != EEXIST) {
+        perror("Error creating destination directory.");
+        return false;
+    }
+    sfs_dir_readahead(dir);
+    sfs_dir_prefetch_children(dir);
+    while ((entry = sfs_dir_next(dir)) != NULL) {
+        if (!sfs_entry_in_use(entry)) {
+            continue;
+        }
+        sfs_entry_name(entry, name);
+        if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+        snprintf(host_path, sizeof(host_path), "%s/%s", host_dir, name);
+        if (sfs_entry_is_dir(entry)) {
+            sfs_dir_iter_t child;
+            if (depth >= EXPORT_MAX_DEPTH) {
+                fprintf(stderr, "%s: Directory tree too deep.\n", host_path);
+                ok = false;
+                continue;
+            }
+            sfs_dir_open(job->img, entry, &child);
+            ok = collect_tree(job, &child, host_path, depth + 1) && ok;
+        } else if (sfs_entry_is_compressed(entry)) {
+            /* Decompressed on the spot; each file already spreads over the CPUs. */
+            ok = copy_compressed(job->img, entry, host_path) && ok;
+        } else {
+            ok = add_file_chunks(job, entry, host_path) && ok;
+        }
+    }
+    return ok;
 }
 
-int main(int argc, char *argv[]) {
-    superblock_t super_block;
-    FILE *file = fopen(argv[1], "rb");
-    if (file == NULL) {
-        fprintf(stderr, "Error opening file system image %s.\n", argv[1]);
-        exit(EXIT_FAILURE);
+/* A chunk of a checksummed file goes through memory so its blocks can be verified. */
+bool export_verified(const sfs_image_t *img, const export_chunk_t *chunk, int fd, uint8_t **buffer) {
+    uint32_t block_size = img->super_block.block_size;
+    uint32_t count = (chunk->length + block_size - 1) / block_size;
+    uint32_t bad_block;
+    if (*buffer == NULL && (*buffer = malloc(EXPORT_CHUNK_SIZE)) == NULL) {
+        return false;
     }
-    size_t read_status = fread(&super_block, sizeof(superblock_t), 1, file);
-    if (read_status != 1) {
-        fprintf(stderr, "Error reading superblock from file system.\n");
-        fclose(file);
-        exit(EXIT_FAILURE);
+    if (!sfs_read_verified(img, chunk->image_offset / block_size, count, *buffer, &bad_block)) {
+        if (bad_block != SFS_FAT_EOF) {
+            fprintf(stderr, "%s: block %u fails its checksum.\n", chunk->dest_path, bad_block);
+        }
+        return false;
+    }
+    SFS_COUNT_IO(true, chunk->file_offset, chunk->length);
+    return pwrite(fd, *buffer, chunk->length, chunk->file_offset) == (ssize_t)chunk->length;
+}
+
+void *export_worker(void *arg) {
+    export_job_t *job = arg;
+    sfs_copier_t copier;
+    uint8_t *buffer = NULL;
+    if (!sfs_copier_init(&copier)) {
+        __atomic_fetch_add(&job->failures, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    for (;;) {
+        size_t i = __atomic_fetch_add(&job->next_chunk, 1, __ATOMIC_RELAXED);
+        if (i >= job->num_chunks) {
+            break;
+        }
+        const export_chunk_t *chunk = &job->chunks[i];
+        int fd = open(chunk->dest_path, O_WRONLY);
+        sfs_copy_seg_t seg = {chunk->image_offset, chunk->file_offset, chunk->length};
+        bool ok = fd != -1 && (chunk->verify ? export_verified(job->img, chunk, fd, &buffer) : sfs_copy(&copier, job->img->fd, fd, &seg, 1));
+        if (!ok) {
+            fprintf(stderr, "%s: Error writing to destination file.\n", chunk->dest_path);
+            __atomic_fetch_add(&job->failures, 1, __ATOMIC_RELAXED);
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+    free(buffer);
+    sfs_copier_free(&copier);
+    return NULL;
+}
+
+bool export_tree(const sfs_image_t *img, const char *path, const char *host_dir) {
+    sfs_dir_iter_t dir;
+    export_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.img = img;
+
+    if (!sfs_open_dir(img, path, &dir)) {
+        fprintf(stderr, "Subdirectory not found.\n");
+        return false;
+    }
+    bool ok = collect_tree(&job, &dir, host_dir, 0);
+
+    uint64_t phase SFS_PHASE_SCOPED = SFS_PHASE_BEGIN();
+    posix_fadvise(img->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads > EXPORT_MAX_THREADS) {
+        num_threads = EXPORT_MAX_THREADS;
+    }
+    if ((size_t)num_threads > job.num_chunks) {
+        num_threads = job.num_chunks;
+    }
+    pthread_t threads[EXPORT_MAX_THREADS];
+    long started = 0;
+    for (long i = 1; i < num_threads; i++) {
+        if (pthread_create(&threads[started], NULL, export_worker, &job) == 0) {
+            started++;
+        }
+    }
+    export_worker(&job);
+    for (long i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    SFS_PHASE_END(SFS_PHASE_COPY, phase);
+
+    for (size_t i = 0; i < job.num_paths; i++) {
+        free(job.paths[i]);
+    }
+    free(job.paths);
+    free(job.chunks);
+    return ok && job.failures == 0;
+}
+
+bool remote_get(int sock, const char *path, const char *dest_filename) {
+    char request[1100];
+    char error[128];
+    uint64_t size;
+    snprintf(request, sizeof(request), "GET\t%s\n", path);
+    if (!sfs_client_request(sock, request, &size, error, sizeof(error))) {
+        fprintf(stderr, "%s\n", error);
+        return false;
+    }
+    int dest_file = open(dest_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (dest_file == -1) {
+        perror("Error opening destination file.");
+        return false;
     }
-    if (argc != 4) {
+    bool ok = sfs_client_receive(sock, dest_file, size);
+    close(dest_file);
+    if (!ok) {
+        fprintf(stderr, "Error copying the file.\n");
+    }
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    sfs_stats_args(&argc, argv);
+    bool recursive = argc == 5 && strcmp(argv[1], "-r") == 0;
+    if (argc != 4 && !recursive) {
         fprintf(stderr, "Usage: diskget <file system image> <path to file> <destination file>\n");
-        fclose(file);
+        fprintf(stderr, "       diskget -r <file system image> <directory> <destination directory>\n");
         exit(EXIT_FAILURE);
     }
 
-    char *file_after_subdir = argv[2];
-    char *lastSlash = strrchr(file_after_subdir, '/');
-    char *contents_chopped = lastSlash ? lastSlash + 1 : file_after_subdir;
-    char subdirs[10][32];
-    int num_subdirs;
-    uint32_t src_start_block = 0;
-    uint32_t src_size = 0;
+    if (recursive) {
+        sfs_image_t img;
+        if (!sfs_open(argv[2], false, &img)) {
+            exit(EXIT_FAILURE);
+        }
+        bool ok = export_tree(&img, argv[3], argv[4]);
+        sfs_close(&img);
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
-    find_subdirectories(argv[2], subdirs, &num_subdirs);
-    set_superblock_info(&super_block);
+    int sock = sfs_client_connect(argv[1]);
+    if (sock != -1) {
+        remote_get(sock, argv[2], argv[3]);
+        close(sock);
+        return EXIT_SUCCESS;
+    }
 
-    bool file_exists = find_file_in_directory(file, &super_block, super_block.root_dir_start, super_block.root_dir_blocks, subdirs, 0, num_subdirs, contents_chopped, &src_start_block, &src_size);
-    if (file_exists) {
-        const char *dest_filename = argv[3];
-        if (copy_file(file, src_start_block, src_size, &super_block, dest_filename)) {
-            fclose(file);
-            return EXIT_SUCCESS;
-        } else {
-            fprintf(stderr, "Error copying the file.\n");
-        }
-    } else {
+    sfs_image_t img;
+    if (!sfs_open(argv[1], false, &img)) {
+        exit(EXIT_FAILURE);
+    }
+
+    dir_entry_t *entry = sfs_lookup(&img, argv[2]);
+    if (entry == NULL || sfs_entry_is_dir(entry)) {
         fprintf(stderr, "File not found.\n");
-        fclose(file);
+        sfs_close(&img);
         return EXIT_SUCCESS;
     }
-    
-    fclose(file);
+
+    const char *dest_filename = argv[3];
+    if (!copy_file(&img, entry, dest_filename)) {
+        fprintf(stderr, "Error copying the file.\n");
+    }
+
+    sfs_close(&img);
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
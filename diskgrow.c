@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "sfs.h"
+
+bool remote_grow(int sock, uint64_t size, char *error, size_t error_size) {
+    char request[64];
+    uint64_t reply_size;
+    snprintf(request, sizeof(request), "GROW\t%llu\n", (unsigned long long)size);
+    return sfs_client_request(sock, request, &reply_size, error, error_size);
+}
+
+int main(int argc, char *argv[]) {
+    sfs_stats_args(&argc, argv);
+    if (argc != 3) {
+        fprintf(stderr, "Usage: diskgrow <file system image> <new size>\n");
+        return EXIT_FAILURE;
+    }
+    uint64_t size = sfs_parse_size(argv[2]);
+    if (size == 0) {
+        fprintf(stderr, "Invalid image size %s.\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    char error[128];
+    int sock = sfs_client_connect(argv[1]);
+    if (sock != -1) {
+        bool ok = remote_grow(sock, size, error, sizeof(error));
+        if (!ok) {
+            fprintf(stderr, "%s: %s\n", argv[1], error);
+        }
+        close(sock);
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    return sfs_grow(argv[1], size) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -2,125 +2,69 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
-#include <arpa/inet.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include "sfs.h"
 
-typedef struct __attribute__((packed)) {
-    char fs_id[8];
-    uint16_t block_size;
-    uint32_t block_count;
-    uint32_t fat_start;
-    uint32_t fat_blocks;
-    uint32_t root_dir_start;
-    uint32_t root_dir_blocks;
-} superblock_t;
+#define LIST_OUTPUT_BUFFER (1024 * 1024)
 
-typedef struct __attribute__((packed)) {
-    uint16_t year;
-    uint8_t month;
-    uint8_t day;
-    uint8_t hour;
-    uint8_t minute;
-    uint8_t second;
-} dir_entry_timedate_t;
-
-typedef struct __attribute__((packed)) {
-    uint8_t status;
-    uint32_t starting_block;
-    uint32_t block_count;
-    uint32_t size;
-    dir_entry_timedate_t create_time;
-    dir_entry_timedate_t modify_time;
-    uint8_t filename[31];
-    uint8_t unused[6];
-} dir_entry_t;
-
-void find_subdirectories(const char *path, char segments[10][32], int *num_segments) {
-    char *cur;
-    char temp_path[256];
-    strncpy(temp_path, path, sizeof(temp_path) - 1);
-    temp_path[sizeof(temp_path) - 1] = '\0';
-    *num_segments = 0;
-    cur = strtok(temp_path, "/");
-
-    while (cur != NULL && *num_segments < 10) {
-        strncpy(segments[*num_segments], cur, 31);
-        segments[*num_segments][31] = '\0';
-        (*num_segments)++;
-        cur = strtok(NULL, "/");
+/* Options go to sfsd as they were given, one per field after the path. */
+bool remote_list(int sock, const char *path, int num_options, char *options[]) {
+    char request[1200];
+    char error[128];
+    uint64_t size;
+    size_t length = snprintf(request, sizeof(request), "LIST\t%s", path);
+    for (int i = 0; i < num_options && length < sizeof(request); i++) {
+        length += snprintf(request + length, sizeof(request) - length, "\t%s", options[i]);
     }
-}
-
-bool list_directories(FILE *file, const superblock_t *super_block, uint32_t start_block, uint32_t block_count, const char subdirs[10][32], int cur_subdir, int num_subdirs) {
-    dir_entry_t entry;
-    bool result = false;
-    long offset = (long)start_block * super_block->block_size;
-
-    if (fseek(file, offset, SEEK_SET) == -1) {
-        perror("Error seeking to directory.");
+    if (length + 1 >= sizeof(request)) {
+        fprintf(stderr, "Request too long.\n");
         return false;
     }
-    for (int i = 0; i < block_count * (super_block->block_size / sizeof(dir_entry_t)); ++i) {
-        if (fread(&entry, sizeof(dir_entry_t), 1, file) != 1) {
-            perror("Error reading directory entry.");
-            break;
-        }
-        if (entry.status == 0x00 || entry.status == 0xFF) {
-            continue;
-        }
-        entry.filename[30] = '\0';
-        if (cur_subdir < num_subdirs && (entry.status & 0x02) == 0) {
-            if (strcmp(entry.filename, subdirs[cur_subdir]) == 0) {
-                return list_directories(file, super_block, ntohl(entry.starting_block), ntohl(entry.block_count), subdirs, cur_subdir + 1, num_subdirs);
-            }
-        } else if (cur_subdir == num_subdirs) {
-            printf("%c %10u %30s %04u/%02u/%02u %02u:%02u:%02u\n", (entry.status == 3) ? 'F' : 'D', ntohl(entry.size), entry.filename, ntohs(entry.modify_time.year), entry.modify_time.month, entry.modify_time.day, entry.modify_time.hour, entry.modify_time.minute, entry.modify_time.second);
-            result = true;
-        }
+    strcat(request, "\n");
+    if (!sfs_client_request(sock, request, &size, error, sizeof(error))) {
+        fprintf(stderr, "%s\n", error);
+        return false;
     }
-    return result;
-}
-
-void set_superblock_info(superblock_t *super_block) {
-    super_block->block_size = htons(super_block->block_size);
-    super_block->block_count = ntohl(super_block->block_count);
-    super_block->fat_start = ntohl(super_block->fat_start);
-    super_block->fat_blocks = ntohl(super_block->fat_blocks);
-    super_block->root_dir_start = ntohl(super_block->root_dir_start);
-    super_block->root_dir_blocks = ntohl(super_block->root_dir_blocks);
+    return sfs_client_receive(sock, STDOUT_FILENO, size);
 }
 
 int main(int argc, char *argv[]) {
-    superblock_t super_block;
-    FILE *file = fopen(argv[1], "rb");
-    if (file == NULL) {
-        fprintf(stderr, "Error opening file system image %s.\n", argv[1]);
-        return 1;
-    }
-    size_t read_status = fread(&super_block, sizeof(superblock_t), 1, file);
-    if (read_status != 1) {
-        fprintf(stderr, "Error reading superblock.\n");
-        fclose(file);
+    sfs_stats_args(&argc, argv);
+    sfs_list_opts_t opts;
+    int num_options = sfs_list_args(argc - 1, argv + 1, &opts);
+    char **options = argv + 1;
+    argc -= (num_options > 0) ? num_options : 0;
+    argv += (num_options > 0) ? num_options : 0;
+    if (num_options < 0 || argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: disklist [-R] [-j threads] [-n glob] [-s min:max] [-t YYYY/MM/DD[ hh:mm:ss]] <file system image> <optional: path>\n");
         return 1;
     }
-    if (argc < 2 || argc > 3) {
-        fprintf(stderr, "Usage: disklist <file system image> <optional: path>\n");
-        fclose(file);
-        return 1;
+    const char *path = (argc == 3) ? argv[2] : "/";
+
+    int sock = sfs_client_connect(argv[1]);
+    if (sock != -1) {
+        bool ok = remote_list(sock, path, num_options, options);
+        close(sock);
+        return ok ? 0 : 1;
     }
 
-    set_superblock_info(&super_block);
-    char subdirs[10][32];
-    int num_subdirs = 0;
-    if (argc == 3) {
-        find_subdirectories(argv[2], subdirs, &num_subdirs);
+    sfs_image_t img;
+    if (!sfs_open(argv[1], false, &img)) {
+        return 1;
     }
 
-    bool result = list_directories(file, &super_block, super_block.root_dir_start, super_block.root_dir_blocks, subdirs, 0, num_subdirs);
-    if (!result && num_subdirs > 0) {
+    sfs_dir_iter_t dir;
+    bool ok = true;
+    setvbuf(stdout, NULL, _IOFBF, LIST_OUTPUT_BUFFER);
+    if (!sfs_open_dir(&img, path, &dir)) {
         fprintf(stderr, "Subdirectory not found.\n");
+        ok = false;
+    } else {
+        ok = sfs_list_tree(stdout, &dir, path, &opts);
     }
+    fflush(stdout);
 
-    fclose(file);
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    sfs_close(&img);
+    return ok ? EXIT_SUCCESS : 1;
+}
@@ -1,184 +1,242 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
-#include <arpa/inet.h>
 #include <string.h>
 #include <stdbool.h>
-#include <time.h>
-
-typedef struct __attribute__((packed)) {
-    char fs_id[8];
-    uint16_t block_size;
-    uint32_t block_count;
-    uint32_t fat_start;
-    uint32_t fat_blocks;
-    uint32_t root_dir_start;
-    uint32_t root_dir_blocks;
-} superblock_t;
-
-typedef struct __attribute__((packed)) {
-    uint16_t year;
-    uint8_t month;
-    uint8_t day;
-    uint8_t hour;
-    uint8_t minute;
-    uint8_t second;
-} dir_entry_timedate_t;
-
-typedef struct __attribute__((packed)) {
-    uint8_t status;
-    uint32_t starting_block;
-    uint32_t block_count;
-    uint32_t size;
-    dir_entry_timedate_t create_time;
-    dir_entry_timedate_t modify_time;
-    char filename[31];
-    char unused[6];
-} dir_entry_t;
-
-void set_superblock_info(superblock_t *super_block) {
-    super_block->block_size = ntohs(super_block->block_size);
-    super_block->block_count = ntohl(super_block->block_count);
-    super_block->fat_start = ntohl(super_block->fat_start);
-    super_block->fat_blocks = ntohl(super_block->fat_blocks);
-    super_block->root_dir_start = ntohl(super_block->root_dir_start);
-    super_block->root_dir_blocks = ntohl(super_block->root_dir_blocks);
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "sfs.h"
+
+/*
+ * Where the files of one run go: a local put session, or an sfsd socket
+ * when SFSD_SOCKET points at a daemon serving this image.
+ */
+typedef struct {
+    sfs_put_session_t session;
+    int sock;
+    bool compress;
+} put_target_t;
+
+bool remote_put(int sock, int source, uint64_t size, const char *source_name, const char *dest_path, bool compress, char *error, size_t error_size) {
+    char request[1200];
+    uint64_t reply_size;
+    off_t offset = 0;
+    snprintf(request, sizeof(request), "PUT\t%llu\t%s\t%s%s\n", (unsigned long long)size, source_name, dest_path, compress ? "\tz" : "");
+    if (!sfs_write_all(sock, request, strlen(request))) {
+        snprintf(error, error_size, "Lost connection to sfsd.");
+        return false;
+    }
+    while ((uint64_t)offset < size) {
+        if (sendfile(sock, source, &offset, size - offset) <= 0) {
+            snprintf(error, error_size, "Lost connection to sfsd.");
+            return false;
+        }
+    }
+    return sfs_client_request(sock, "", &reply_size, error, error_size);
 }
 
-uint32_t find_free_block(FILE *file, const superblock_t *super_block) {
-    fseek(file, super_block->fat_start * super_block->block_size, SEEK_SET);
-    uint32_t fat;
-    for (uint32_t i = 0; i < super_block->fat_blocks * super_block->block_size / sizeof(uint32_t); i++) {
-        fread(&fat, sizeof(uint32_t), 1, file);
-        fat = ntohl(fat); 
-        if (fat == 0x00000000) { 
-            return i; 
+/* A stream has no size to announce; sfsd reads it until this side shuts down. */
+bool remote_put_stream(int sock, int source, const char *dest_path, char *error, size_t error_size) {
+    char request[1200];
+    uint64_t reply_size;
+    snprintf(request, sizeof(request), "PUT\t-\t-\t%s\n", dest_path);
+    char *buffer = malloc(SFS_COPY_CHUNK);
+    bool ok = buffer != NULL && sfs_write_all(sock, request, strlen(request));
+    while (ok) {
+        ssize_t got = read(source, buffer, SFS_COPY_CHUNK);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            ok = got == 0;
+            break;
         }
+        ok = sfs_write_all(sock, buffer, got);
     }
-    return 0xFFFFFFFF;
+    free(buffer);
+    if (!ok) {
+        snprintf(error, error_size, "Error sending the stream to sfsd.");
+        return false;
+    }
+    shutdown(sock, SHUT_WR);
+    return sfs_client_request(sock, "", &reply_size, error, error_size);
 }
 
-void prepare_new_directory_entry(dir_entry_t *entry, const char *filename, FILE *source, FILE *file, superblock_t *super_block) {
-    memset(entry, 0, sizeof(dir_entry_t));
-    entry->status = 0x03;
-    strncpy(entry->filename, filename, sizeof(entry->filename) - 1);
-    entry->filename[sizeof(entry->filename) - 1] = '\0';
-
-    fseek(source, 0, SEEK_END);
-    entry->size = htonl(ftell(source));
-    fseek(source, 0, SEEK_SET);
-
-    time_t temp_time;
-    struct tm *time_info;
-    time(&temp_time);
-    time_info = localtime(&temp_time);
-
-    entry->create_time.year = htons(time_info->tm_year + 1900);
-    entry->create_time.month = time_info->tm_mon + 1;
-    entry->create_time.day = time_info->tm_mday;
-    entry->create_time.hour = time_info->tm_hour;
-    entry->create_time.minute = time_info->tm_min;
-    entry->create_time.second = time_info->tm_sec;
-    entry->modify_time = entry->create_time;
-
-    uint32_t free_block = find_free_block(file, super_block);
-    if (free_block == 0xFFFFFFFF) {
-        //do nothing
+/*
+ * "-" as the source reads standard input. A redirected file is put like
+ * any other; a pipe is streamed into the image until it ends.
+ */
+bool put_stdin(put_target_t *target, const char *dest_path) {
+    struct stat st;
+    bool ok;
+    if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode) && lseek(STDIN_FILENO, 0, SEEK_CUR) == 0) {
+        if (target->sock != -1) {
+            ok = remote_put(target->sock, STDIN_FILENO, st.st_size, "-", dest_path, target->compress, target->session.error, sizeof(target->session.error));
+        } else {
+            ok = sfs_put_fd(&target->session, STDIN_FILENO, st.st_size, "", dest_path);
+        }
+    } else if (target->compress) {
+        snprintf(target->session.error, sizeof(target->session.error), "Compression needs the size in advance.");
+        ok = false;
+    } else if (target->sock != -1) {
+        ok = remote_put_stream(target->sock, STDIN_FILENO, dest_path, target->session.error, sizeof(target->session.error));
     } else {
-        entry->starting_block = htonl(free_block);
+        ok = sfs_put_fd(&target->session, STDIN_FILENO, SFS_SIZE_STREAM, "", dest_path);
     }
+    if (!ok) {
+        fprintf(stderr, "-: %s\n", target->session.error);
+    }
+    return ok;
 }
 
-bool update_fat(FILE *file, superblock_t *super_block, uint32_t start_block, uint32_t block_count) {
-    uint32_t current_block = start_block;
-    uint32_t next_block;
-
-    for (uint32_t i = 0; i < block_count; i++) {
-        fseek(file, (super_block->fat_start * super_block->block_size) + (current_block * sizeof(uint32_t)), SEEK_SET);
-        
-        if (i == block_count - 1) {
-            next_block = htonl(0xFFFFFFFF);
-        } else {
-            next_block = htonl(find_free_block(file, super_block));
-            if (next_block == htonl(0xFFFFFFFF)) {
-                return false;
-            }
+bool put_file(put_target_t *target, const char *source_path, const char *dest_path) {
+    const char *source_name = strrchr(source_path, '/') ? strrchr(source_path, '/') + 1 : source_path;
+    struct stat st;
+    int source = open(source_path, O_RDONLY);
+    SFS_COUNT(syscalls, 2);
+    if (source == -1 || fstat(source, &st) == -1 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "%s: File not found.\n", source_path);
+        if (source != -1) {
+            close(source);
         }
+        return false;
+    }
+    if ((uint64_t)st.st_size > SFS_MAX_FILE_SIZE) {
+        fprintf(stderr, "%s: File too large.\n", source_path);
+        close(source);
+        return false;
+    }
+    posix_fadvise(source, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-        fwrite(&next_block, sizeof(uint32_t), 1, file);
-        current_block = ntohl(next_block);
+    bool ok;
+    if (target->sock != -1) {
+        ok = remote_put(target->sock, source, st.st_size, source_name, dest_path, target->compress, target->session.error, sizeof(target->session.error));
+    } else {
+        ok = sfs_put_fd(&target->session, source, st.st_size, source_name, dest_path);
+    }
+    if (!ok) {
+        fprintf(stderr, "%s: %s\n", source_path, target->session.error);
     }
-    return true;
+    close(source);
+    return ok;
 }
 
-bool add_file_to_directory(FILE *file, superblock_t *super_block, const dir_entry_t *new_entry, const char *path) {
-    fseek(file, super_block->root_dir_start * super_block->block_size, SEEK_SET);
-    dir_entry_t entry;
-    for (uint32_t i = 0; i < super_block->root_dir_blocks * super_block->block_size / sizeof(dir_entry_t); i++) {
-        fread(&entry, sizeof(dir_entry_t), 1, file);
-        if (entry.status == 0x00 || entry.status == 0xFF) {
-            fseek(file, -((long)sizeof(dir_entry_t)), SEEK_CUR);
-            fwrite(new_entry, sizeof(dir_entry_t), 1, file);
-            return true;
+int put_manifest(put_target_t *target, const char *manifest_path) {
+    FILE *manifest = fopen(manifest_path, "r");
+    char line[1024];
+    char source[512];
+    char dest[512];
+    int failures = 0;
+    if (manifest == NULL) {
+        fprintf(stderr, "%s: File not found.\n", manifest_path);
+        return 1;
+    }
+    while (fgets(line, sizeof(line), manifest) != NULL) {
+        if (line[0] == '#' || sscanf(line, "%511s %511s", source, dest) != 2) {
+            continue;
+        }
+        if (!put_file(target, source, dest)) {
+            failures++;
         }
     }
-    return false;
+    fclose(manifest);
+    return failures;
 }
 
-bool copy_file_to_sfs(FILE *source, FILE *file, superblock_t *super_block, uint32_t start_block, uint32_t file_size) {
-    fseek(file, start_block * super_block->block_size, SEEK_SET);
-    char buffer[1024];
-    uint32_t bytes_copied = 0;
-    size_t bytes_to_copy;
-
-    while (bytes_copied < file_size) {
-        bytes_to_copy = sizeof(buffer);
-        if (file_size - bytes_copied < sizeof(buffer)) {
-            bytes_to_copy = file_size - bytes_copied;
+int put_directory(put_target_t *target, const char *source_dir, const char *dest_dir) {
+    DIR *dir = opendir(source_dir);
+    struct dirent *dirent;
+    char source[4096];
+    char dest[1024];
+    int failures = 0;
+    if (dir == NULL) {
+        fprintf(stderr, "%s: Directory not found.\n", source_dir);
+        return 1;
+    }
+    while ((dirent = readdir(dir)) != NULL) {
+        struct stat st;
+        snprintf(source, sizeof(source), "%s/%s", source_dir, dirent->d_name);
+        if (stat(source, &st) == -1 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        snprintf(dest, sizeof(dest), "%s/", dest_dir);
+        if (!put_file(target, source, dest)) {
+            failures++;
         }
-        fread(buffer, 1, bytes_to_copy, source);
-        fwrite(buffer, 1, bytes_to_copy, file);
-        bytes_copied += bytes_to_copy;
     }
-
-    return true;
+    closedir(dir);
+    return failures;
 }
 
 int main(int argc, char *argv[]) {
+    sfs_stats_args(&argc, argv);
+    bool compress = false;
+    bool checksum = false;
+    while (argc > 1 && (strcmp(argv[1], "-z") == 0 || strcmp(argv[1], "-c") == 0)) {
+        compress = compress || argv[1][1] == 'z';
+        checksum = checksum || argv[1][1] == 'c';
+        memmove(&argv[1], &argv[2], (argc - 1) * sizeof(char *));
+        argc--;
+    }
+    bool batch = argc == 4 && strcmp(argv[1], "--batch") == 0;
     if (argc != 4) {
-        perror("Usage: diskput <file system image> <source file> <destination path>\n");
+        fprintf(stderr, "Usage: diskput [-z] [-c] <file system image> <source file, directory or -> <destination path>\n");
+        fprintf(stderr, "       diskput [-z] [-c] --batch <file system image> <manifest>\n");
         return 0;
     }
-
-    FILE *file = fopen(argv[1], "r+b");
-    FILE *source = fopen(argv[2], "rb");
-    if (file == NULL || source == NULL) {
-        printf("File not found.\n");
+    const char *image_path = batch ? argv[2] : argv[1];
+
+    put_target_t target;
+    sfs_image_t img;
+    target.sock = sfs_client_connect(image_path);
+    target.compress = compress;
+    if (target.sock == -1) {
+        if (!sfs_open(image_path, true, &img)) {
+            exit(EXIT_FAILURE);
+        }
+        if (!sfs_put_begin(&img, &target.session)) {
+            sfs_close(&img);
+            exit(EXIT_FAILURE);
+        }
+        target.session.compress = compress;
+        if (checksum && !sfs_checksum_create(&target.session.alloc)) {
+            fprintf(stderr, "Not enough contiguous free space for block checksums.\n");
+            sfs_put_end(&target.session);
+            sfs_close(&img);
+            exit(EXIT_FAILURE);
+        }
+    } else if (checksum) {
+        fprintf(stderr, "Block checksums can only be enabled while sfsd is not serving the image.\n");
+        close(target.sock);
         exit(EXIT_FAILURE);
     }
 
-    superblock_t super_block;
-    if (fread(&super_block, sizeof(superblock_t), 1, file) != 1) {
-        perror("Error reading superblock.\n");
-        return 0;
+    struct stat st;
+    int failures;
+    if (batch) {
+        failures = put_manifest(&target, argv[3]);
+    } else if (stat(argv[2], &st) == 0 && S_ISDIR(st.st_mode)) {
+        failures = put_directory(&target, argv[2], argv[3]);
+    } else {
+        failures = (strcmp(argv[2], "-") == 0 ? put_stdin(&target, argv[3]) : put_file(&target, argv[2], argv[3])) ? 0 : 1;
     }
 
-    set_superblock_info(&super_block);
-
-    dir_entry_t entry;
-    prepare_new_directory_entry(&entry, argv[2], source, file, &super_block);
-
-    if (!add_file_to_directory(file, &super_block, &entry, argv[3])) {
-        perror("Failed to add file to directory.\n");
-        return 0;
+    if (target.sock != -1) {
+        close(target.sock);
+        return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
     }
 
-    if (!copy_file_to_sfs(source, file, &super_block, ntohl(entry.starting_block), ntohl(entry.size))) {
-        perror("Failed to copy file to SFS.\n");
-        return 0;
+    if (!sfs_flush(&img)) {
+        fprintf(stderr, "Failed to write file system metadata.\n");
+        failures++;
     }
 
-    fclose(file);
-    fclose(source);
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    sfs_put_end(&target.session);
+    sfs_close(&img);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
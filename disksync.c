@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "sfs.h"
+
+bool verbose = false;
+
+bool sync_file(sfs_put_session_t *session, const char *source_path, const char *dest_dir, const char *name, sfs_sync_stats_t *stats) {
+    struct stat st;
+    int source = open(source_path, O_RDONLY);
+    SFS_COUNT(syscalls, 2);
+    if (source == -1 || fstat(source, &st) == -1) {
+        fprintf(stderr, "%s: File not found.\n", source_path);
+        if (source != -1) {
+            close(source);
+        }
+        return false;
+    }
+    posix_fadvise(source, 0, 0, POSIX_FADV_SEQUENTIAL);
+    sfs_sync_stats_t before = *stats;
+    bool ok = sfs_sync_fd(session, source, st.st_size, st.st_mtime, dest_dir, name, stats);
+    if (!ok) {
+        fprintf(stderr, "%s: %s\n", source_path, session->error);
+    } else if (verbose && stats->files_added != before.files_added) {
+        printf("added   %s/%s\n", dest_dir, name);
+    } else if (verbose && stats->files_updated != before.files_updated) {
+        printf("updated %s/%s (%llu blocks written)\n", dest_dir, name, (unsigned long long)(stats->blocks_written - before.blocks_written));
+    }
+    close(source);
+    return ok;
+}
+
+/*
+ * Syncs every regular file and directory below source_dir into dest_dir,
+ * creating image directories as needed. Returns the number of failures.
+ */
+int sync_directory(sfs_put_session_t *session, const char *source_dir, const char *dest_dir, sfs_sync_stats_t *stats) {
+    DIR *dir = opendir(source_dir);
+    struct dirent *dirent;
+    char source[4096];
+    char dest[1024];
+    int failures = 0;
+    if (dir == NULL) {
+        fprintf(stderr, "%s: Directory not found.\n", source_dir);
+        return 1;
+    }
+    while ((dirent = readdir(dir)) != NULL) {
+        struct stat st;
+        if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+            continue;
+        }
+        snprintf(source, sizeof(source), "%s/%s", source_dir, dirent->d_name);
+        if (lstat(source, &st) == -1) {
+            continue;
+        }
+        if (S_ISREG(st.st_mode)) {
+            failures += !sync_file(session, source, dest_dir, dirent->d_name, stats);
+            continue;
+        }
+        if (!S_ISDIR(st.st_mode)) {
+            continue;
+        }
+        snprintf(dest, sizeof(dest), "%s/%s", dest_dir, dirent->d_name);
+        const dir_entry_t *existing = sfs_lookup(session->img, dest);
+        if (existing != NULL && !sfs_entry_is_dir(existing)) {
+            fprintf(stderr, "%s: A file of that name is in the way.\n", source);
+            failures++;
+            continue;
+        }
+        if (existing == NULL && sfs_make_dir(session, dest_dir, dirent->d_name) == NULL) {
+            fprintf(stderr, "%s: %s\n", source, session->error);
+            failures++;
+            continue;
+        }
+        if (existing == NULL && verbose) {
+            printf("added   %s/\n", dest);
+        }
+        failures += sync_directory(session, source, dest, stats);
+    }
+    closedir(dir);
+    return failures;
+}
+
+int main(int argc, char *argv[]) {
+    sfs_stats_args(&argc, argv);
+    if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+        verbose = true;
+        memmove(&argv[1], &argv[2], (argc - 1) * sizeof(char *));
+        argc--;
+    }
+    if (argc != 4) {
+        fprintf(stderr, "Usage: disksync [-v] <file system image> <source directory> <destination directory>\n");
+        return 0;
+    }
+
+    int sock = sfs_client_connect(argv[1]);
+    if (sock != -1) {
+        fprintf(stderr, "The image can only be synced while sfsd is not serving it.\n");
+        close(sock);
+        exit(EXIT_FAILURE);
+    }
+    sfs_image_t img;
+    sfs_put_session_t session;
+    if (!sfs_open(argv[1], true, &img)) {
+        exit(EXIT_FAILURE);
+    }
+    if (!sfs_put_begin(&img, &session)) {
+        sfs_close(&img);
+        exit(EXIT_FAILURE);
+    }
+
+    sfs_sync_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    char *dest_dir = argv[3];
+    size_t length = strlen(dest_dir);
+    while (length > 0 && dest_dir[length - 1] == '/') {
+        dest_dir[--length] = '\0';
+    }
+    int failures;
+    if (sfs_put_open_dir(&session, dest_dir) == NULL) {
+        fprintf(stderr, "%s: Directory not found.\n", argv[3]);
+        failures = 1;
+    } else {
+        failures = sync_directory(&session, argv[2], dest_dir, &stats);
+    }
+
+    if (!sfs_flush(&img)) {
+        fprintf(stderr, "Failed to write file system metadata.\n");
+        failures++;
+    }
+    printf("%u added, %u updated, %u unchanged; %llu blocks compared, %llu written\n", stats.files_added, stats.files_updated,
+           stats.files_unchanged, (unsigned long long)stats.blocks_compared, (unsigned long long)stats.blocks_written);
+
+    sfs_put_end(&session);
+    sfs_close(&img);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "sfs.h"
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void count_fat_scalar(const uint32_t *fat, size_t count, sfs_census_t *census) {
+    census->free_blocks = census->reserved_blocks = census->allocated_blocks = 0;
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t entry = ntohl(fat[i]);
+        if (entry == 0) {
+            census->free_blocks++;
+        } else if (entry == 1) {
+            census->reserved_blocks++;
+        } else {
+            census->allocated_blocks++;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    size_t count = (argc > 1) ? strtoull(argv[1], NULL, 10) : 64u << 20;
+    int rounds = (argc > 2) ? atoi(argv[2]) : 5;
+    uint32_t *fat = malloc(count * sizeof(uint32_t));
+    if (fat == NULL || rounds < 1) {
+        fprintf(stderr, "Usage: fatbench [entries] [rounds]\n");
+        return 1;
+    }
+    srand(42);
+    for (size_t i = 0; i < count; i++) {
+        int r = rand() % 10;
+        fat[i] = htonl(r < 4 ? SFS_FAT_FREE : r == 4 ? SFS_FAT_RESERVED : r == 5 ? SFS_FAT_EOF : (uint32_t)rand());
+    }
+
+    sfs_census_t old_census, new_census;
+    double start = now();
+    for (int i = 0; i < rounds; i++) {
+        count_fat_scalar(fat, count, &old_census);
+    }
+    double old_time = (now() - start) / rounds;
+    start = now();
+    for (int i = 0; i < rounds; i++) {
+        sfs_fat_census(fat, count, &new_census);
+    }
+    double new_time = (now() - start) / rounds;
+
+    double mb = count * sizeof(uint32_t) / 1e6;
+    printf("FAT entries: %zu (%.1f MB), kernel: %s\n", count, mb, sfs_census_kernel());
+    printf("scalar loop: %8.2f ms %10.1f MB/s\n", old_time * 1e3, mb / old_time);
+    printf("census:      %8.2f ms %10.1f MB/s (%.1fx)\n", new_time * 1e3, mb / new_time, old_time / new_time);
+    if (old_census.free_blocks != new_census.free_blocks || old_census.reserved_blocks != new_census.reserved_blocks || old_census.allocated_blocks != new_census.allocated_blocks) {
+        fprintf(stderr, "Mismatch: %u/%u/%u vs %u/%u/%u\n", old_census.free_blocks, old_census.reserved_blocks, old_census.allocated_blocks, new_census.free_blocks, new_census.reserved_blocks, new_census.allocated_blocks);
+        return 1;
+    }
+    free(fat);
+    return 0;
+}
@@ -0,0 +1,565 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sfs.h"
+
+void set_superblock_info(superblock_t *super_block) {
+    super_block->block_size = ntohs(super_block->block_size);
+    super_block->block_count = ntohl(super_block->block_count);
+    super_block->fat_start = ntohl(super_block->fat_start);
+    super_block->fat_blocks = ntohl(super_block->fat_blocks);
+    super_block->root_dir_start = ntohl(super_block->root_dir_start);
+    super_block->root_dir_blocks = ntohl(super_block->root_dir_blocks);
+}
+
+static bool read_super_block(sfs_image_t *img) {
+    const superblock_t *sb = &img->super_block;
+    memcpy(&img->super_block, img->base, sizeof(superblock_t));
+    set_superblock_info(&img->super_block);
+    return sb->block_size >= sizeof(dir_entry_t) && (off_t)sb->block_count * sb->block_size <= (off_t)img->size && (uint64_t)sb->fat_start + sb->fat_blocks <= sb->block_count && (uint64_t)sb->root_dir_start + sb->root_dir_blocks <= sb->block_count;
+}
+
+bool sfs_open(const char *path, bool writable, sfs_image_t *img) {
+    struct stat st;
+    uint64_t phase SFS_PHASE_SCOPED = SFS_PHASE_BEGIN();
+    memset(img, 0, sizeof(sfs_image_t));
+    img->writable = writable;
+    img->fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (img->fd == -1) {
+        fprintf(stderr, "Error opening file system image %s.\n", path);
+        return false;
+    }
+    if (fstat(img->fd, &st) == -1 || (size_t)st.st_size < sizeof(superblock_t)) {
+        fprintf(stderr, "Error reading superblock.\n");
+        close(img->fd);
+        return false;
+    }
+    img->size = st.st_size;
+    int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    int flags = writable ? MAP_PRIVATE | MAP_NORESERVE : MAP_SHARED;
+    img->base = mmap(NULL, img->size, prot, flags, img->fd, 0);
+    if (img->base == MAP_FAILED) {
+        perror("Error mapping file system image.");
+        close(img->fd);
+        return false;
+    }
+    SFS_COUNT(syscalls, 3);
+
+    if (!read_super_block(img) || !sfs_journal_open(img) || !read_super_block(img)) {
+        fprintf(stderr, "Error: %s is not a valid file system image.\n", path);
+        munmap(img->base, img->size);
+        close(img->fd);
+        return false;
+    }
+    const superblock_t *sb = &img->super_block;
+
+    img->fat = (uint32_t *)sfs_block(img, sb->fat_start);
+    img->fat_entries = (size_t)sb->fat_blocks * sb->block_size / sizeof(uint32_t);
+    img->checksums = sfs_checksum_area(img);
+    SFS_PHASE_END(SFS_PHASE_SUPERBLOCK, phase);
+    if (writable) {
+        img->dirty = calloc((sb->block_count + 63) / 64, sizeof(uint64_t));
+        if (img->dirty == NULL) {
+            perror("Error allocating memory for image.");
+            sfs_close(img);
+            return false;
+        }
+        phase = SFS_PHASE_BEGIN();
+        img->summary_known = sfs_read_summary(img, &img->summary);
+        SFS_PHASE_END(SFS_PHASE_FAT, phase);
+    }
+    return true;
+}
+
+sfs_ext_t *sfs_ext(const sfs_image_t *img) {
+    if (img->super_block.block_size < SFS_EXT_OFFSET + sizeof(sfs_ext_t)) {
+        return NULL;
+    }
+    return (sfs_ext_t *)(img->base + SFS_EXT_OFFSET);
+}
+
+/* The check value of a summary; super_block is in host byte order. */
+uint32_t sfs_summary_check(const superblock_t *super_block, const sfs_census_t *census) {
+    uint32_t values[6] = {census->free_blocks, census->reserved_blocks, census->allocated_blocks, super_block->block_count, super_block->fat_start, super_block->fat_blocks};
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(values); i++) {
+        hash = (hash ^ ((const uint8_t *)values)[i]) * 16777619u;
+    }
+    return hash;
+}
+
+bool sfs_read_summary(const sfs_image_t *img, sfs_census_t *census) {
+    const sfs_ext_t *ext = sfs_ext(img);
+    if (ext == NULL || ntohl(ext->magic) != SFS_EXT_MAGIC || ntohl(ext->summary_state) != SFS_SUMMARY_VALID) {
+        return false;
+    }
+    census->free_blocks = ntohl(ext->free_blocks);
+    census->reserved_blocks = ntohl(ext->reserved_blocks);
+    census->allocated_blocks = ntohl(ext->allocated_blocks);
+    if ((uint64_t)census->free_blocks + census->reserved_blocks + census->allocated_blocks != img->fat_entries) {
+        return false;
+    }
+    return ntohl(ext->summary_check) == sfs_summary_check(&img->super_block, census);
+}
+
+static void fill_summary(sfs_image_t *img, sfs_ext_t *ext, uint32_t state) {
+    if (state == SFS_SUMMARY_VALID) {
+        if (!img->summary_known) {
+            sfs_fat_census(img->fat, img->fat_entries, &img->summary);
+            img->summary_known = true;
+        }
+        ext->free_blocks = htonl(img->summary.free_blocks);
+        ext->reserved_blocks = htonl(img->summary.reserved_blocks);
+        ext->allocated_blocks = htonl(img->summary.allocated_blocks);
+        ext->summary_check = htonl(sfs_summary_check(&img->super_block, &img->summary));
+    }
+    ext->magic = htonl(SFS_EXT_MAGIC);
+    ext->summary_state = htonl(state);
+}
+
+static bool write_summary(sfs_image_t *img, uint32_t state) {
+    sfs_ext_t *ext = sfs_ext(img);
+    if (ext == NULL) {
+        return true;
+    }
+    fill_summary(img, ext, state);
+    SFS_COUNT_IO(true, 0, img->super_block.block_size);
+    if (pwrite(img->fd, img->base, img->super_block.block_size, 0) != img->super_block.block_size) {
+        perror("Error writing superblock.");
+        return false;
+    }
+    img->dirty[0] &= ~(uint64_t)1;
+    return true;
+}
+
+static bool flush_dirty(sfs_image_t *img) {
+    uint32_t block_count = img->super_block.block_count;
+    uint32_t block = 1;
+    if (!img->summary_dirty) {
+        bool any_dirty = false;
+        for (uint32_t w = 0; w < (block_count + 63) / 64 && !any_dirty; w++) {
+            any_dirty = img->dirty[w] != 0;
+        }
+        if (!any_dirty) {
+            return true;
+        }
+        if (!write_summary(img, SFS_SUMMARY_DIRTY)) {
+            return false;
+        }
+        img->summary_dirty = true;
+    }
+    while (block < block_count) {
+        uint64_t bits = img->dirty[block / 64] >> (block % 64);
+        if (bits == 0) {
+            block = (block / 64 + 1) * 64;
+            continue;
+        }
+        block += __builtin_ctzll(bits);
+        uint32_t end = block;
+        while (end < block_count && (img->dirty[end / 64] >> (end % 64) & 1)) {
+            img->dirty[end / 64] &= ~((uint64_t)1 << (end % 64));
+            end++;
+        }
+        size_t length = (size_t)(end - block) * img->super_block.block_size;
+        SFS_COUNT_IO(true, sfs_block_offset(img, block), length);
+        if (pwrite(img->fd, sfs_block(img, block), length, sfs_block_offset(img, block)) != (ssize_t)length) {
+            perror("Error writing metadata.");
+            return false;
+        }
+        block = end;
+    }
+    if (!write_summary(img, SFS_SUMMARY_VALID)) {
+        return false;
+    }
+    img->summary_dirty = false;
+    return true;
+}
+
+/*
+ * Takes a copy of every dirty metadata block, plus block 0 with a fresh
+ * summary, for sfs_flush_commit(), so callers can commit outside whatever
+ * lock guards the mapping. Images without a journal, and changes too large
+ * for it, are written in place here instead and leave txn empty.
+ */
+bool sfs_flush_begin(sfs_image_t *img, sfs_txn_t *txn) {
+    uint32_t block_size = img->super_block.block_size;
+    uint32_t words = (img->super_block.block_count + 63) / 64;
+    memset(txn, 0, sizeof(sfs_txn_t));
+    if (!img->writable) {
+        return true;
+    }
+    if (img->journal_blocks == 0) {
+        return flush_dirty(img);
+    }
+    uint32_t count = 0;
+    for (uint32_t w = 0; w < words; w++) {
+        count += __builtin_popcountll(img->dirty[w]);
+    }
+    if (count == 0) {
+        return true;
+    }
+    count += (img->dirty[0] & 1) == 0;
+    if (!sfs_journal_fits(img, count)) {
+        return sfs_journal_checkpoint(img, true) && flush_dirty(img);
+    }
+    txn->blocks = malloc(count * sizeof(uint32_t));
+    txn->data = malloc((size_t)count * block_size);
+    if (txn->blocks == NULL || txn->data == NULL) {
+        perror("Error allocating journal buffer.");
+        free(txn->blocks);
+        free(txn->data);
+        txn->blocks = NULL;
+        txn->data = NULL;
+        return false;
+    }
+    fill_summary(img, sfs_ext(img), SFS_SUMMARY_VALID);
+    img->dirty[0] |= 1;
+    for (uint32_t w = 0; w < words; w++) {
+        while (img->dirty[w] != 0) {
+            uint32_t block = w * 64 + __builtin_ctzll(img->dirty[w]);
+            img->dirty[w] &= img->dirty[w] - 1;
+            txn->blocks[txn->count] = block;
+            memcpy(txn->data + (size_t)txn->count * block_size, sfs_block(img, block), block_size);
+            txn->count++;
+        }
+    }
+    return true;
+}
+
+/*
+ * Logs the captured blocks, which is the commit, then writes them in
+ * place without waiting: the journal covers them until its next
+ * checkpoint. Commits must happen in the order the captures were taken.
+ */
+bool sfs_flush_commit(sfs_image_t *img, sfs_txn_t *txn) {
+    uint32_t block_size = img->super_block.block_size;
+    bool ok = txn->count == 0 || sfs_journal_write(img, txn);
+    for (uint32_t i = 0; ok && i < txn->count; i++) {
+        SFS_COUNT_IO(true, sfs_block_offset(img, txn->blocks[i]), block_size);
+        if (pwrite(img->fd, txn->data + (size_t)i * block_size, block_size, sfs_block_offset(img, txn->blocks[i])) != block_size) {
+            perror("Error writing metadata.");
+            ok = false;
+        }
+    }
+    free(txn->blocks);
+    free(txn->data);
+    memset(txn, 0, sizeof(sfs_txn_t));
+    return ok;
+}
+
+bool sfs_flush(sfs_image_t *img) {
+    sfs_txn_t txn;
+    if (!img->writable) {
+        return true;
+    }
+    uint64_t phase SFS_PHASE_SCOPED = SFS_PHASE_BEGIN();
+    bool ok = sfs_flush_begin(img, &txn) && sfs_flush_commit(img, &txn);
+    SFS_PHASE_END(SFS_PHASE_FLUSH, phase);
+    return ok;
+}
+
+void sfs_close(sfs_image_t *img) {
+    if (img->writable && img->base != NULL) {
+        sfs_journal_checkpoint(img, false);
+    }
+    if (img->base != NULL && img->base != MAP_FAILED) {
+        munmap(img->base, img->size);
+    }
+    free(img->dirty);
+    close(img->fd);
+    SFS_COUNT(syscalls, 2);
+    img->base = NULL;
+    img->dirty = NULL;
+}
+
+uint8_t *sfs_block(const sfs_image_t *img, uint32_t block) {
+    return img->base + sfs_block_offset(img, block);
+}
+
+off_t sfs_block_offset(const sfs_image_t *img, uint32_t block) {
+    return (off_t)block * img->super_block.block_size;
+}
+
+void sfs_mark_dirty(sfs_image_t *img, const void *address, size_t length) {
+    if (!img->writable || length == 0) {
+        return;
+    }
+    size_t offset = (const uint8_t *)address - img->base;
+    uint32_t first = offset / img->super_block.block_size;
+    uint32_t last = (offset + length - 1) / img->super_block.block_size;
+    for (uint32_t block = first; block <= last; block++) {
+        img->dirty[block / 64] |= (uint64_t)1 << (block % 64);
+    }
+}
+
+uint32_t sfs_fat_get(const sfs_image_t *img, uint32_t block) {
+    return ntohl(img->fat[block]);
+}
+
+static uint32_t *summary_counter(sfs_census_t *census, uint32_t value) {
+    if (value == SFS_FAT_FREE) {
+        return &census->free_blocks;
+    }
+    if (value == SFS_FAT_RESERVED) {
+        return &census->reserved_blocks;
+    }
+    return &census->allocated_blocks;
+}
+
+void sfs_fat_set(sfs_image_t *img, uint32_t block, uint32_t value) {
+    if (img->summary_known) {
+        (*summary_counter(&img->summary, sfs_fat_get(img, block)))--;
+        (*summary_counter(&img->summary, value))++;
+    }
+    img->fat[block] = htonl(value);
+    sfs_mark_dirty(img, &img->fat[block], sizeof(uint32_t));
+}
+
+uint32_t sfs_chain_extents(const sfs_image_t *img, uint32_t start_block, uint32_t block_count, sfs_extent_t **extents) {
+    uint32_t capacity = 8;
+    uint32_t count = 0;
+    uint32_t block = start_block;
+    uint32_t walked = 0;
+    *extents = malloc(capacity * sizeof(sfs_extent_t));
+    if (*extents == NULL) {
+        return 0;
+    }
+    uint64_t phase SFS_PHASE_SCOPED = SFS_PHASE_BEGIN();
+    while (block_count > 0 && block < img->super_block.block_count) {
+        if (count > 0 && (*extents)[count - 1].start + (*extents)[count - 1].length == block) {
+            (*extents)[count - 1].length++;
+        } else {
+            if (count == capacity) {
+                capacity *= 2;
+                sfs_extent_t *grown = realloc(*extents, capacity * sizeof(sfs_extent_t));
+                if (grown == NULL) {
+                    break;
+                }
+                *extents = grown;
+            }
+            (*extents)[count].start = block;
+            (*extents)[count].length = 1;
+            count++;
+        }
+        block_count--;
+        walked++;
+        block = sfs_fat_get(img, block);
+    }
+    SFS_COUNT(blocks_visited, walked);
+    SFS_PHASE_END(SFS_PHASE_FAT, phase);
+    return count;
+}
+
+/*
+ * The mapping and the page cache behind it already keep recently used
+ * blocks, and sfs_flush() writes dirty metadata back. What the kernel
+ * cannot guess is where a FAT chain goes next, so these helpers walk the
+ * chain ahead of the reader and ask for the next extents with
+ * POSIX_FADV_WILLNEED, letting scattered blocks load in parallel.
+ *
+ * sfs_readahead() advises extents from index `from` until about `bytes`
+ * are covered, and returns the index of the first extent not advised.
+ */
+uint32_t sfs_readahead(const sfs_image_t *img, const sfs_extent_t *extents, uint32_t num_extents, uint32_t from, uint64_t bytes) {
+    uint64_t advised = 0;
+    while (from < num_extents && advised < bytes) {
+        off_t length = (off_t)extents[from].length * img->super_block.block_size;
+        posix_fadvise(img->fd, sfs_block_offset(img, extents[from].start), length, POSIX_FADV_WILLNEED);
+        SFS_COUNT(syscalls, 1);
+        advised += length;
+        from++;
+    }
+    return from;
+}
+
+void sfs_chain_readahead(const sfs_image_t *img, uint32_t start_block, uint32_t block_count, uint32_t max_blocks) {
+    uint32_t block = start_block;
+    uint32_t run_start = block;
+    uint32_t run_length = 0;
+    if (block_count > max_blocks) {
+        block_count = max_blocks;
+    }
+    while (block_count > 0 && block < img->super_block.block_count) {
+        if (run_length > 0 && run_start + run_length != block) {
+            posix_fadvise(img->fd, sfs_block_offset(img, run_start), (off_t)run_length * img->super_block.block_size, POSIX_FADV_WILLNEED);
+            SFS_COUNT(syscalls, 1);
+            run_start = block;
+            run_length = 0;
+        }
+        run_length++;
+        block_count--;
+        block = sfs_fat_get(img, block);
+    }
+    if (run_length > 0) {
+        posix_fadvise(img->fd, sfs_block_offset(img, run_start), (off_t)run_length * img->super_block.block_size, POSIX_FADV_WILLNEED);
+        SFS_COUNT(syscalls, 1);
+    }
+}
+
+bool sfs_entry_in_use(const dir_entry_t *entry) {
+    return entry->status != 0x00 && entry->status != 0xFF;
+}
+
+bool sfs_entry_is_dir(const dir_entry_t *entry) {
+    return (entry->status & 0x02) == 0;
+}
+
+/* True for the "." and ".." links, which walks must not follow; hidden names are ordinary entries. */
+bool sfs_entry_is_dot(const dir_entry_t *entry) {
+    const char *name = entry->filename;
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+uint64_t sfs_entry_size(const dir_entry_t *entry) {
+    return (uint64_t)entry->unused[1] << 32 | ntohl(entry->size);
+}
+
+void sfs_entry_set_size(dir_entry_t *entry, uint64_t size) {
+    entry->size = htonl((uint32_t)size);
+    entry->unused[1] = size >> 32;
+}
+
+void sfs_entry_name(const dir_entry_t *entry, char name[32]) {
+    memcpy(name, entry->filename, 30);
+    name[30] = '\0';
+}
+
+void sfs_dir_open_root(const sfs_image_t *img, sfs_dir_iter_t *it) {
+    it->img = img;
+    it->owner = NULL;
+    it->start_block = img->super_block.root_dir_start;
+    it->num_blocks = img->super_block.root_dir_blocks;
+    it->contiguous = true;
+    sfs_dir_rewind(it);
+}
+
+void sfs_dir_open(const sfs_image_t *img, const dir_entry_t *dir, sfs_dir_iter_t *it) {
+    it->img = img;
+    it->owner = (dir_entry_t *)dir;
+    it->start_block = ntohl(dir->starting_block);
+    it->num_blocks = ntohl(dir->block_count);
+    it->contiguous = false;
+    sfs_dir_rewind(it);
+}
+
+void sfs_dir_rewind(sfs_dir_iter_t *it) {
+    it->block = it->start_block;
+    it->blocks_left = it->num_blocks;
+    it->last_block = SFS_FAT_EOF;
+    it->slot = 0;
+}
+
+dir_entry_t *sfs_dir_next(sfs_dir_iter_t *it) {
+    const sfs_image_t *img = it->img;
+    uint32_t per_block = img->super_block.block_size / sizeof(dir_entry_t);
+    if (it->slot == per_block) {
+        it->last_block = it->block;
+        it->blocks_left--;
+        it->block = it->contiguous ? it->block + 1 : sfs_fat_get(img, it->block);
+        it->slot = 0;
+    }
+    if (it->blocks_left == 0 || it->block >= img->super_block.block_count) {
+        return NULL;
+    }
+    if (it->slot == 0) {
+        SFS_COUNT(blocks_visited, 1);
+    }
+    return (dir_entry_t *)(sfs_block(img, it->block) + sizeof(dir_entry_t) * it->slot++);
+}
+
+/* Single-block directories are left to the page fault that reads them anyway. */
+void sfs_dir_readahead(const sfs_dir_iter_t *dir) {
+    const sfs_image_t *img = dir->img;
+    if (dir->num_blocks < 2) {
+        return;
+    }
+    if (dir->contiguous) {
+        posix_fadvise(img->fd, sfs_block_offset(img, dir->start_block), (off_t)dir->num_blocks * img->super_block.block_size, POSIX_FADV_WILLNEED);
+        SFS_COUNT(syscalls, 1);
+    } else {
+        sfs_chain_readahead(img, dir->start_block, dir->num_blocks, SFS_READAHEAD_BYTES / img->super_block.block_size);
+    }
+}
+
+/*
+ * Before a recursive walk descends, ask for the first blocks of every
+ * subdirectory at once instead of faulting them in one by one.
+ */
+void sfs_dir_prefetch_children(const sfs_dir_iter_t *dir) {
+    sfs_dir_iter_t it = *dir;
+    dir_entry_t *entry;
+    sfs_dir_rewind(&it);
+    while ((entry = sfs_dir_next(&it)) != NULL) {
+        if (sfs_entry_in_use(entry) && sfs_entry_is_dir(entry) && !sfs_entry_is_dot(entry)) {
+            sfs_chain_readahead(dir->img, ntohl(entry->starting_block), ntohl(entry->block_count), SFS_READAHEAD_CHILD_BLOCKS);
+        }
+    }
+}
+
+dir_entry_t *sfs_find_entry(sfs_dir_iter_t *dir, const char *name) {
+    dir_entry_t *entry;
+    char entry_name[32];
+    const sfs_dir_index_t *index = sfs_dir_index(dir);
+    if (index != NULL) {
+        return sfs_index_lookup(dir, index, name);
+    }
+    while ((entry = sfs_dir_next(dir)) != NULL) {
+        if (!sfs_entry_in_use(entry)) {
+            continue;
+        }
+        sfs_entry_name(entry, entry_name);
+        if (strcmp(entry_name, name) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+bool sfs_open_dir(const sfs_image_t *img, const char *path, sfs_dir_iter_t *it) {
+    char *temp_path = strdup(path);
+    char *saveptr;
+    bool found = temp_path != NULL;
+    uint64_t phase SFS_PHASE_SCOPED = SFS_PHASE_BEGIN();
+    sfs_dir_open_root(img, it);
+    for (char *cur = found ? strtok_r(temp_path, "/", &saveptr) : NULL; cur != NULL; cur = strtok_r(NULL, "/", &saveptr)) {
+        dir_entry_t *entry = sfs_find_entry(it, cur);
+        if (entry == NULL || !sfs_entry_is_dir(entry)) {
+            found = false;
+            break;
+        }
+        sfs_dir_open(img, entry, it);
+    }
+    free(temp_path);
+    SFS_PHASE_END(SFS_PHASE_PATH, phase);
+    return found;
+}
+
+dir_entry_t *sfs_lookup(const sfs_image_t *img, const char *path) {
+    char *temp_path = strdup(path);
+    dir_entry_t *entry = NULL;
+    sfs_dir_iter_t it;
+    if (temp_path == NULL) {
+        return NULL;
+    }
+    uint64_t phase SFS_PHASE_SCOPED = SFS_PHASE_BEGIN();
+    size_t length = strlen(temp_path);
+    while (length > 0 && temp_path[length - 1] == '/') {
+        temp_path[--length] = '\0';
+    }
+    char *slash = strrchr(temp_path, '/');
+    char *name = slash ? slash + 1 : temp_path;
+    if (slash != NULL) {
+        *slash = '\0';
+    }
+    if (*name != '\0' && sfs_open_dir(img, slash ? temp_path : "", &it)) {
+        entry = sfs_find_entry(&it, name);
+    }
+    free(temp_path);
+    SFS_PHASE_END(SFS_PHASE_PATH, phase);
+    return entry;
+}
@@ -0,0 +1,495 @@
+#ifndef SFS_H
+#define SFS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define SFS_FAT_FREE 0x00000000
+#define SFS_FAT_RESERVED 0x00000001
+#define SFS_FAT_EOF 0xFFFFFFFF
+
+#define SFS_STATUS_FILE 0x03
+#define SFS_STATUS_DIRECTORY 0x05
+
+#define SFS_FLAG_INDEXED 0x01
+#define SFS_FLAG_COMPRESSED 0x02
+#define SFS_FLAG_CHECKSUMMED 0x04
+
+/* unused[1] of an entry holds bits 32-39 of the size: files up to 1 TB. */
+#define SFS_MAX_FILE_SIZE ((1ULL << 40) - 1)
+/* The size sfs_put_fd() takes for a source read to its end, such as a pipe. */
+#define SFS_SIZE_STREAM UINT64_MAX
+
+typedef struct __attribute__((packed)) {
+    char fs_id[8];
+    uint16_t block_size;
+    uint32_t block_count;
+    uint32_t fat_start;
+    uint32_t fat_blocks;
+    uint32_t root_dir_start;
+    uint32_t root_dir_blocks;
+} superblock_t;
+
+typedef struct __attribute__((packed)) {
+    uint16_t year;
+    uint8_t month;
+    uint8_t day;
+    uint8_t hour;
+    uint8_t minute;
+    uint8_t second;
+} dir_entry_timedate_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t status;
+    uint32_t starting_block;
+    uint32_t block_count;
+    uint32_t size;
+    dir_entry_timedate_t create_time;
+    dir_entry_timedate_t modify_time;
+    char filename[31];
+    uint8_t unused[6];
+} dir_entry_t;
+
+typedef struct {
+    uint32_t free_blocks;
+    uint32_t reserved_blocks;
+    uint32_t allocated_blocks;
+} sfs_census_t;
+
+/*
+ * Tools that write keep the FAT totals in a record after the superblock so
+ * diskinfo does not have to scan the FAT. The record is marked dirty before
+ * any other metadata is written and only marked valid again, with a fresh
+ * check value, once everything else has reached the file.
+ */
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint32_t summary_state;
+    uint32_t free_blocks;
+    uint32_t reserved_blocks;
+    uint32_t allocated_blocks;
+    uint32_t summary_check;
+    uint32_t root_index_block;
+    uint32_t journal_start;
+    uint32_t journal_blocks;
+    uint32_t checksum_start;
+    uint32_t checksum_blocks;
+} sfs_ext_t;
+
+#define SFS_EXT_OFFSET 64
+#define SFS_EXT_MAGIC 0x53465358
+#define SFS_SUMMARY_VALID 0x00000001
+#define SFS_SUMMARY_DIRTY 0x00000002
+
+/*
+ * Optional hash index of a directory, kept in its own contiguous block run.
+ * A subdirectory points at it from the unused bytes of its entry (flag in
+ * unused[0], block in unused[2..5]); the root directory from the record
+ * after the superblock. The header is followed by the directory's block
+ * list, the bucket heads and one chain link per slot, all big-endian and
+ * storing slot + 1 so that zero means empty. An index whose header does not
+ * match the directory's first block and length is ignored.
+ */
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint32_t dir_start;
+    uint32_t dir_blocks;
+    uint32_t block_capacity;
+    uint32_t num_buckets;
+    uint32_t free_hint;
+} sfs_dir_index_t;
+
+#define SFS_INDEX_MAGIC 0x53465349
+#define SFS_INDEX_MIN_SLOTS 256
+
+/*
+ * Metadata journal, a reserved block run named by the record after the
+ * superblock. Its first block holds the sequence the current log starts
+ * at; transactions follow from the second block, each a header and the
+ * numbers of the blocks it carries, padded to a block, then a copy of
+ * every block. A transaction counts once its checksum matches, so one
+ * fdatasync() commits it. Replay applies transactions in sequence order
+ * and stops at the first that does not follow.
+ */
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint32_t sequence;
+} sfs_journal_header_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t count;
+    uint32_t checksum;
+} sfs_txn_header_t;
+
+#define SFS_JOURNAL_MAGIC 0x5346534A
+#define SFS_TXN_MAGIC 0x53465354
+#define SFS_JOURNAL_MIN_BLOCKS 64
+#define SFS_JOURNAL_MAX_BYTES (4 * 1024 * 1024)
+
+/*
+ * Optional block checksums: a reserved run named by the record after the
+ * superblock holds the big-endian CRC32C of every block, indexed like the
+ * FAT. Only blocks of files flagged SFS_FLAG_CHECKSUMMED, which were
+ * written while the run existed, are kept current; directory and index
+ * blocks are metadata and left to the journal.
+ */
+
+/*
+ * A compressed file keeps its logical size in the entry and flags
+ * SFS_FLAG_COMPRESSED in unused[0]. Its chain holds this header, then
+ * num_chunks + 1 big-endian stream offsets, then every chunk of
+ * SFS_CHUNK_SIZE bytes compressed on its own, so any chunk can be read
+ * without the others. A chunk that did not shrink is stored as is, which
+ * its length gives away.
+ */
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint32_t chunk_size;
+    uint32_t num_chunks;
+} sfs_chunk_header_t;
+
+#define SFS_CHUNK_MAGIC 0x5346535A
+#define SFS_CHUNK_SIZE (64 * 1024)
+
+/*
+ * An open image. The whole file is mapped once; the superblock is kept in
+ * host byte order, everything else is read in place. Writable images are
+ * mapped privately: metadata changes made through the mapping are tracked
+ * per block and only reach the file when sfs_flush() writes them back.
+ */
+typedef struct {
+    int fd;
+    bool writable;
+    uint8_t *base;
+    size_t size;
+    superblock_t super_block;
+    uint32_t *fat;
+    uint32_t fat_entries;
+    uint64_t *dirty;
+    sfs_census_t summary;
+    bool summary_known;
+    bool summary_dirty;
+    uint32_t journal_start;
+    uint32_t journal_blocks;
+    uint32_t journal_head;
+    uint32_t journal_sequence;
+    uint32_t *checksums;
+} sfs_image_t;
+
+/* The layout of a new image for sfs_format(). */
+typedef struct {
+    uint32_t block_size;
+    uint32_t block_count;
+    uint32_t root_dir_blocks;
+    bool preallocate;
+} sfs_format_t;
+
+/* Metadata blocks captured by sfs_flush_begin(), waiting to be committed. */
+typedef struct {
+    uint32_t *blocks;
+    uint8_t *data;
+    uint32_t count;
+} sfs_txn_t;
+
+typedef struct {
+    const sfs_image_t *img;
+    dir_entry_t *owner;
+    uint32_t start_block;
+    uint32_t num_blocks;
+    uint32_t block;
+    uint32_t last_block;
+    uint32_t blocks_left;
+    uint32_t slot;
+    bool contiguous;
+} sfs_dir_iter_t;
+
+typedef struct {
+    uint32_t start;
+    uint32_t length;
+} sfs_extent_t;
+
+/*
+ * Free blocks of an image, one bit each. While readers hold pins, blocks
+ * freed go to held_map instead and only become free again once the last
+ * pin is dropped; see sfs_allocator_pin().
+ */
+typedef struct {
+    sfs_image_t *img;
+    uint64_t *free_map;
+    uint64_t *held_map;
+    uint32_t entries;
+    uint32_t free_count;
+    uint32_t held_count;
+    uint32_t pins;
+    uint32_t cursor;
+} sfs_allocator_t;
+
+typedef struct {
+    char path[1024];
+    sfs_dir_iter_t dir;
+} sfs_dest_dir_t;
+
+#define SFS_READAHEAD_BYTES (8 * 1024 * 1024)
+#define SFS_READAHEAD_CHILD_BLOCKS 16
+
+#define SFS_COPY_DEPTH 8
+#define SFS_COPY_CHUNK (512 * 1024)
+
+typedef struct {
+    off_t src_offset;
+    off_t dst_offset;
+    size_t length;
+} sfs_copy_seg_t;
+
+/*
+ * Positioned copy engine: an io_uring keeping up to SFS_COPY_DEPTH reads
+ * and writes in flight from registered buffers, or a two-buffer
+ * pread/pwrite pipeline when io_uring is unavailable (or SFS_NO_IO_URING
+ * is set). One copier serves one thread.
+ */
+typedef struct {
+    struct sfs_ring *ring;
+    uint8_t *buffers;
+} sfs_copier_t;
+
+/* State shared by every file written into an image in one run. */
+typedef struct {
+    sfs_image_t *img;
+    sfs_allocator_t alloc;
+    sfs_dest_dir_t *dirs;
+    int num_dirs;
+    char *buffer;
+    sfs_copier_t copier;
+    uint64_t bytes_read;
+    bool compress;
+    char error[128];
+} sfs_put_session_t;
+
+/*
+ * A put split in three, so a server can read the data without holding the
+ * image: sfs_put_reserve() allocates the chain, sfs_put_receive() fills it
+ * through a worker session, and sfs_put_publish() links the entry in or
+ * sfs_put_cancel() gives the chain back.
+ */
+typedef struct {
+    dir_entry_t entry;
+    char dir_path[1024];
+} sfs_put_slot_t;
+
+/* Running totals of a sync, kept by sfs_sync_fd(). */
+typedef struct {
+    uint32_t files_added;
+    uint32_t files_updated;
+    uint32_t files_unchanged;
+    uint64_t blocks_compared;
+    uint64_t blocks_written;
+} sfs_sync_stats_t;
+
+#define SFS_LIST_MAX_THREADS 32
+#define SFS_LIST_MAX_DEPTH 64
+
+/*
+ * How disklist walks and filters. The filters apply to every entry
+ * printed; a recursive listing still descends into directories they
+ * leave out. since is a modify time packed as YYYYMMDDhhmmss.
+ */
+typedef struct {
+    bool recursive;
+    uint32_t threads;
+    const char *name;
+    uint64_t min_size;
+    uint64_t max_size;
+    uint64_t since;
+} sfs_list_opts_t;
+
+#define SFSD_SOCKET_ENV "SFSD_SOCKET"
+
+typedef enum {
+    SFS_PHASE_SUPERBLOCK,
+    SFS_PHASE_FAT,
+    SFS_PHASE_PATH,
+    SFS_PHASE_ALLOC,
+    SFS_PHASE_COPY,
+    SFS_PHASE_FLUSH,
+    SFS_NUM_PHASES
+} sfs_phase_t;
+
+enum { SFS_STATS_OFF, SFS_STATS_HUMAN, SFS_STATS_JSON };
+
+typedef struct {
+    uint64_t syscalls;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t seeks;
+    uint64_t blocks_visited;
+    uint64_t phase_ns[SFS_NUM_PHASES];
+} sfs_stats_t;
+
+/*
+ * Counters behind --stats. Every hook is a single predicted-not-taken
+ * branch on sfs_stats_mode, so a run without --stats does no counting.
+ */
+extern int sfs_stats_mode;
+extern sfs_stats_t sfs_stats;
+
+#define SFS_STATS_ON() __builtin_expect(sfs_stats_mode != SFS_STATS_OFF, 0)
+#define SFS_COUNT(field, n) do { if (SFS_STATS_ON()) __atomic_fetch_add(&sfs_stats.field, (uint64_t)(n), __ATOMIC_RELAXED); } while (0)
+#define SFS_COUNT_IO(write, offset, bytes) do { if (SFS_STATS_ON()) sfs_stats_io((write), (offset), (bytes)); } while (0)
+#define SFS_PHASE_BEGIN() (SFS_STATS_ON() ? sfs_phase_begin() : 0)
+#define SFS_PHASE_END(phase, start) do { if ((start) != 0) sfs_phase_end((phase), (start)); } while (0)
+/* Closes a phase left open by an early return when its variable goes out of scope. */
+#define SFS_PHASE_SCOPED __attribute__((cleanup(sfs_phase_leave)))
+
+void set_superblock_info(superblock_t *super_block);
+
+bool sfs_open(const char *path, bool writable, sfs_image_t *img);
+bool sfs_flush(sfs_image_t *img);
+bool sfs_flush_begin(sfs_image_t *img, sfs_txn_t *txn);
+bool sfs_flush_commit(sfs_image_t *img, sfs_txn_t *txn);
+void sfs_close(sfs_image_t *img);
+
+uint64_t sfs_parse_size(const char *text);
+bool sfs_format(const char *path, const sfs_format_t *format);
+bool sfs_grow(const char *path, uint64_t size);
+
+sfs_ext_t *sfs_ext(const sfs_image_t *img);
+uint32_t sfs_summary_check(const superblock_t *super_block, const sfs_census_t *census);
+bool sfs_read_summary(const sfs_image_t *img, sfs_census_t *census);
+
+bool sfs_journal_open(sfs_image_t *img);
+bool sfs_journal_create(sfs_allocator_t *alloc);
+bool sfs_journal_fits(const sfs_image_t *img, uint32_t count);
+bool sfs_journal_write(sfs_image_t *img, const sfs_txn_t *txn);
+bool sfs_journal_checkpoint(sfs_image_t *img, bool durable);
+
+uint8_t *sfs_block(const sfs_image_t *img, uint32_t block);
+off_t sfs_block_offset(const sfs_image_t *img, uint32_t block);
+void sfs_mark_dirty(sfs_image_t *img, const void *address, size_t length);
+
+uint32_t sfs_fat_get(const sfs_image_t *img, uint32_t block);
+void sfs_fat_set(sfs_image_t *img, uint32_t block, uint32_t value);
+
+uint32_t sfs_chain_extents(const sfs_image_t *img, uint32_t start_block, uint32_t block_count, sfs_extent_t **extents);
+
+uint32_t sfs_readahead(const sfs_image_t *img, const sfs_extent_t *extents, uint32_t num_extents, uint32_t from, uint64_t bytes);
+void sfs_chain_readahead(const sfs_image_t *img, uint32_t start_block, uint32_t block_count, uint32_t max_blocks);
+bool sfs_entry_in_use(const dir_entry_t *entry);
+bool sfs_entry_is_dir(const dir_entry_t *entry);
+bool sfs_entry_is_dot(const dir_entry_t *entry);
+uint64_t sfs_entry_size(const dir_entry_t *entry);
+void sfs_entry_set_size(dir_entry_t *entry, uint64_t size);
+void sfs_entry_name(const dir_entry_t *entry, char name[32]);
+
+void sfs_dir_open_root(const sfs_image_t *img, sfs_dir_iter_t *it);
+void sfs_dir_open(const sfs_image_t *img, const dir_entry_t *dir, sfs_dir_iter_t *it);
+void sfs_dir_rewind(sfs_dir_iter_t *it);
+dir_entry_t *sfs_dir_next(sfs_dir_iter_t *it);
+void sfs_dir_readahead(const sfs_dir_iter_t *dir);
+void sfs_dir_prefetch_children(const sfs_dir_iter_t *dir);
+
+dir_entry_t *sfs_find_entry(sfs_dir_iter_t *dir, const char *name);
+bool sfs_open_dir(const sfs_image_t *img, const char *path, sfs_dir_iter_t *it);
+dir_entry_t *sfs_lookup(const sfs_image_t *img, const char *path);
+
+bool sfs_allocator_init(sfs_image_t *img, sfs_allocator_t *alloc);
+void sfs_allocator_free(sfs_allocator_t *alloc);
+void sfs_allocator_pin(sfs_allocator_t *alloc);
+bool sfs_allocator_unpin(sfs_allocator_t *alloc);
+void sfs_allocator_release(sfs_allocator_t *alloc);
+uint32_t sfs_allocate_extent(sfs_allocator_t *alloc, uint32_t max_blocks, uint32_t *start);
+uint32_t sfs_allocate_chain(sfs_allocator_t *alloc, uint32_t block_count);
+uint32_t sfs_find_contiguous(const sfs_allocator_t *alloc, uint32_t block_count, uint32_t limit);
+void sfs_claim_contiguous(sfs_allocator_t *alloc, uint32_t start, uint32_t block_count);
+uint32_t sfs_allocate_contiguous(sfs_allocator_t *alloc, uint32_t block_count);
+void sfs_free_chain(sfs_allocator_t *alloc, uint32_t start_block);
+
+sfs_dir_index_t *sfs_dir_index(const sfs_dir_iter_t *dir);
+uint32_t sfs_index_block(const sfs_dir_iter_t *dir);
+uint32_t sfs_index_length(const sfs_image_t *img, const sfs_dir_index_t *index);
+void sfs_index_detach(sfs_image_t *img, const sfs_dir_iter_t *dir);
+dir_entry_t *sfs_index_lookup(const sfs_dir_iter_t *dir, const sfs_dir_index_t *index, const char *name);
+bool sfs_index_build(sfs_allocator_t *alloc, sfs_dir_iter_t *dir, uint32_t min_slots);
+void sfs_index_relocate(sfs_image_t *img, const sfs_dir_iter_t *dir, uint32_t new_start);
+dir_entry_t *sfs_dir_insert(sfs_allocator_t *alloc, sfs_dir_iter_t *dir, const dir_entry_t *entry);
+void sfs_dir_remove(sfs_image_t *img, sfs_dir_iter_t *dir, dir_entry_t *entry);
+
+bool sfs_put_begin(sfs_image_t *img, sfs_put_session_t *session);
+void sfs_put_end(sfs_put_session_t *session);
+bool sfs_put_worker_begin(sfs_image_t *img, sfs_put_session_t *session);
+bool sfs_put_chain(sfs_put_session_t *session, int source, uint64_t size, const char *name, dir_entry_t *entry);
+bool sfs_put_reserve(sfs_put_session_t *session, uint64_t size, const char *source_name, const char *dest_path, sfs_put_slot_t *slot);
+bool sfs_put_receive(sfs_put_session_t *worker, int source, sfs_put_slot_t *slot);
+bool sfs_put_publish(sfs_put_session_t *session, sfs_put_slot_t *slot);
+void sfs_put_cancel(sfs_put_session_t *session, sfs_put_slot_t *slot);
+bool sfs_put_fd(sfs_put_session_t *session, int source, uint64_t size, const char *source_name, const char *dest_path);
+sfs_dir_iter_t *sfs_put_open_dir(sfs_put_session_t *session, const char *path);
+void sfs_set_entry_time(dir_entry_timedate_t *timedate, time_t when);
+bool sfs_move_path(sfs_put_session_t *session, const char *source_path, const char *dest_path);
+bool sfs_copy_path(sfs_put_session_t *session, const char *source_path, const char *dest_path);
+dir_entry_t *sfs_make_dir(sfs_put_session_t *session, const char *dir_path, const char *name);
+bool sfs_sync_fd(sfs_put_session_t *session, int source, uint64_t size, time_t mtime, const char *dir_path, const char *name, sfs_sync_stats_t *stats);
+
+bool sfs_copier_init(sfs_copier_t *copier);
+void sfs_copier_free(sfs_copier_t *copier);
+bool sfs_copy(sfs_copier_t *copier, int src, int dst, const sfs_copy_seg_t *segs, size_t count);
+bool sfs_copy_within(sfs_copier_t *copier, int fd, const sfs_copy_seg_t *segs, size_t count);
+const char *sfs_copier_engine(const sfs_copier_t *copier);
+
+const char *sfs_crc32c_kernel(void);
+void sfs_crc32c_blocks(const void *data, uint32_t count, uint32_t block_size, uint32_t *crcs);
+bool sfs_entry_is_checksummed(const dir_entry_t *entry);
+uint32_t *sfs_checksum_area(const sfs_image_t *img);
+bool sfs_checksum_create(sfs_allocator_t *alloc);
+void sfs_checksum_set(sfs_image_t *img, uint32_t block, const void *data, uint32_t count);
+void sfs_checksum_copy(sfs_image_t *img, uint32_t from, uint32_t to, uint32_t count);
+bool sfs_checksum_fill(const sfs_image_t *img, uint32_t start_block, uint32_t block_count);
+bool sfs_checksum_mark(sfs_image_t *img, uint32_t start_block, uint32_t block_count);
+bool sfs_checksum_chain(sfs_image_t *img, uint32_t start_block, uint32_t block_count);
+uint32_t sfs_checksum_verify(const sfs_image_t *img, uint32_t block, const void *data, uint32_t count);
+bool sfs_read_verified(const sfs_image_t *img, uint32_t block, uint32_t count, void *buffer, uint32_t *bad_block);
+bool sfs_write_verified(const sfs_image_t *img, const sfs_extent_t *extents, uint32_t num_extents, uint64_t size, int dest, uint32_t *bad_block);
+
+bool sfs_entry_is_compressed(const dir_entry_t *entry);
+uint64_t sfs_stored_size(const sfs_image_t *img, const dir_entry_t *entry);
+bool sfs_compress_reserve(sfs_put_session_t *session, uint64_t size, dir_entry_t *entry);
+bool sfs_compress_write(sfs_put_session_t *session, int source, dir_entry_t *entry);
+void sfs_compress_trim(sfs_allocator_t *alloc, const dir_entry_t *entry);
+bool sfs_get_compressed(const sfs_image_t *img, const dir_entry_t *entry, const sfs_extent_t *extents, uint32_t num_extents, int dest);
+
+void sfs_print_super_block(FILE *out, const superblock_t *super_block);
+void sfs_print_fat_info(FILE *out, const sfs_census_t *census);
+void sfs_print_info(FILE *out, const sfs_image_t *img);
+void sfs_print_entry(FILE *out, const sfs_image_t *img, const dir_entry_t *entry);
+
+int sfs_list_args(int argc, char *argv[], sfs_list_opts_t *opts);
+bool sfs_list_tree(FILE *out, const sfs_dir_iter_t *dir, const char *path, const sfs_list_opts_t *opts);
+
+bool sfs_write_all(int fd, const void *buffer, size_t length);
+bool sfs_read_line(int sock, char *line, size_t size);
+int sfs_client_connect(const char *image_path);
+bool sfs_client_request(int sock, const char *request, uint64_t *size, char *error, size_t error_size);
+bool sfs_client_receive(int sock, int out, uint64_t size);
+
+void sfs_fat_census(const uint32_t *fat, size_t count, sfs_census_t *census);
+const char *sfs_census_kernel(void);
+
+void sfs_stats_args(int *argc, char *argv[]);
+void sfs_stats_io(bool write, off_t offset, uint64_t bytes);
+uint64_t sfs_phase_begin(void);
+void sfs_phase_end(sfs_phase_t phase, uint64_t start);
+void sfs_phase_abandon(uint64_t start);
+
+static inline void sfs_phase_leave(const uint64_t *start) {
+    if (*start != 0) {
+        sfs_phase_abandon(*start);
+    }
+}
+void sfs_stats_report(FILE *out);
+
+#endif
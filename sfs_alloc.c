@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sfs.h"
+
+bool sfs_allocator_init(sfs_image_t *img, sfs_allocator_t *alloc) {
+    memset(alloc, 0, sizeof(sfs_allocator_t));
+    alloc->img = img;
+    alloc->entries = img->fat_entries;
+    if (alloc->entries > img->super_block.block_count) {
+        alloc->entries = img->super_block.block_count;
+    }
+    alloc->free_map = calloc((alloc->entries + 63) / 64, sizeof(uint64_t));
+    if (alloc->free_map == NULL) {
+        perror("Error allocating memory for FAT.");
+        return false;
+    }
+    uint64_t phase SFS_PHASE_SCOPED = SFS_PHASE_BEGIN();
+    for (uint32_t i = 0; i < alloc->entries; i++) {
+        if (img->fat[i] == SFS_FAT_FREE) {
+            alloc->free_map[i / 64] |= (uint64_t)1 << (i % 64);
+            alloc->free_count++;
+        }
+    }
+    SFS_PHASE_END(SFS_PHASE_FAT, phase);
+    return true;
+}
+
+void sfs_allocator_free(sfs_allocator_t *alloc) {
+    free(alloc->free_map);
+    free(alloc->held_map);
+    alloc->free_map = NULL;
+    alloc->held_map = NULL;
+}
+
+/*
+ * Keeps freed blocks from being handed out again, so a reader that took a
+ * chain's extents can go on reading them without the image lock after
+ * the chain is freed. Pins may be taken and dropped by readers sharing
+ * the image; everything else still needs the allocator to itself.
+ */
+void sfs_allocator_pin(sfs_allocator_t *alloc) {
+    __atomic_add_fetch(&alloc->pins, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Drops a pin; true when it was the last one and freed blocks await sfs_allocator_release(). */
+bool sfs_allocator_unpin(sfs_allocator_t *alloc) {
+    return __atomic_sub_fetch(&alloc->pins, 1, __ATOMIC_SEQ_CST) == 0 && __atomic_load_n(&alloc->held_count, __ATOMIC_SEQ_CST) > 0;
+}
+
+/* Frees the blocks held back while the allocator was pinned, unless it still is. */
+void sfs_allocator_release(sfs_allocator_t *alloc) {
+    if (alloc->held_map == NULL || __atomic_load_n(&alloc->pins, __ATOMIC_SEQ_CST) > 0) {
+        return;
+    }
+    for (uint32_t w = 0; w < (alloc->entries + 63) / 64; w++) {
+        alloc->free_map[w] |= alloc->held_map[w];
+        alloc->held_map[w] = 0;
+    }
+    alloc->free_count += alloc->held_count;
+    __atomic_store_n(&alloc->held_count, 0, __ATOMIC_SEQ_CST);
+}
+
+static uint32_t next_free_block(const sfs_allocator_t *alloc, uint32_t from) {
+    uint32_t words = (alloc->entries + 63) / 64;
+    for (uint32_t w = from / 64; w < words; w++) {
+        uint64_t bits = alloc->free_map[w];
+        if (w == from / 64) {
+            bits &= ~(uint64_t)0 << (from % 64);
+        }
+        if (bits != 0) {
+            return w * 64 + __builtin_ctzll(bits);
+        }
+    }
+    return SFS_FAT_EOF;
+}
+
+uint32_t sfs_allocate_extent(sfs_allocator_t *alloc, uint32_t max_blocks, uint32_t *start) {
+    uint32_t block = next_free_block(alloc, alloc->cursor);
+    if (block == SFS_FAT_EOF) {
+        block = next_free_block(alloc, 0);
+    }
+    if (block == SFS_FAT_EOF) {
+        return 0;
+    }
+    uint32_t length = 0;
+    while (length < max_blocks && block + length < alloc->entries && (alloc->free_map[(block + length) / 64] >> ((block + length) % 64) & 1)) {
+        alloc->free_map[(block + length) / 64] &= ~((uint64_t)1 << ((block + length) % 64));
+        length++;
+    }
+    alloc->free_count -= length;
+    alloc->cursor = block + length;
+    *start = block;
+    return length;
+}
+
+uint32_t sfs_allocate_chain(sfs_allocator_t *alloc, uint32_t block_count) {
+    uint32_t first = SFS_FAT_EOF;
+    uint32_t prev = SFS_FAT_EOF;
+    uint32_t remaining = block_count;
+    if (block_count > alloc->free_count) {
+        return SFS_FAT_EOF;
+    }
+    uint64_t phase SFS_PHASE_SCOPED = SFS_PHASE_BEGIN();
+    while (remaining > 0) {
+        uint32_t start;
+        uint32_t length = sfs_allocate_extent(alloc, remaining, &start);
+        if (prev == SFS_FAT_EOF) {
+            first = start;
+        } else {
+            sfs_fat_set(alloc->img, prev, start);
+        }
+        for (uint32_t i = 0; i + 1 < length; i++) {
+            sfs_fat_set(alloc->img, start + i, start + i + 1);
+        }
+        prev = start + length - 1;
+        remaining -= length;
+    }
+    if (prev != SFS_FAT_EOF) {
+        sfs_fat_set(alloc->img, prev, SFS_FAT_EOF);
+    }
+    SFS_PHASE_END(SFS_PHASE_ALLOC, phase);
+    return first;
+}
+
+/* First-fit search for block_count free blocks that end at or before limit. */
+uint32_t sfs_find_contiguous(const sfs_allocator_t *alloc, uint32_t block_count, uint32_t limit) {
+    uint32_t block = next_free_block(alloc, 0);
+    while (block != SFS_FAT_EOF && block_count > 0 && (uint64_t)block + block_count <= limit) {
+        uint32_t length = 0;
+        while (length < block_count && block + length < alloc->entries && (alloc->free_map[(block + length) / 64] >> ((block + length) % 64) & 1)) {
+            length++;
+        }
+        if (length == block_count) {
+            return block;
+        }
+        block = next_free_block(alloc, block + length);
+    }
+    return SFS_FAT_EOF;
+}
+
+/* Takes a run found by sfs_find_contiguous() and chains it in the FAT. */
+void sfs_claim_contiguous(sfs_allocator_t *alloc, uint32_t start, uint32_t block_count) {
+    for (uint32_t i = 0; i < block_count; i++) {
+        alloc->free_map[(start + i) / 64] &= ~((uint64_t)1 << ((start + i) % 64));
+        sfs_fat_set(alloc->img, start + i, (i + 1 < block_count) ? start + i + 1 : SFS_FAT_EOF);
+    }
+    alloc->free_count -= block_count;
+}
+
+uint32_t sfs_allocate_contiguous(sfs_allocator_t *alloc, uint32_t block_count) {
+    uint64_t phase SFS_PHASE_SCOPED = SFS_PHASE_BEGIN();
+    uint32_t block = sfs_find_contiguous(alloc, block_count, alloc->entries);
+    if (block != SFS_FAT_EOF) {
+        sfs_claim_contiguous(alloc, block, block_count);
+    }
+    SFS_PHASE_END(SFS_PHASE_ALLOC, phase);
+    return block;
+}
+
+/*
+ * Marks a chain free in the FAT. While the allocator is pinned its blocks
+ * are held back rather than made free; if the map to hold them cannot be
+ * allocated they stay out of the allocator until the image is reopened.
+ */
+void sfs_free_chain(sfs_allocator_t *alloc, uint32_t start_block) {
+    uint32_t block = start_block;
+    uint32_t limit = alloc->entries;
+    bool hold = __atomic_load_n(&alloc->pins, __ATOMIC_SEQ_CST) > 0;
+    if (hold && alloc->held_map == NULL) {
+        alloc->held_map = calloc((alloc->entries + 63) / 64, sizeof(uint64_t));
+    }
+    while (block < alloc->entries && limit-- > 0) {
+        uint32_t next = sfs_fat_get(alloc->img, block);
+        if (next == SFS_FAT_FREE || next == SFS_FAT_RESERVED) {
+            break;
+        }
+        sfs_fat_set(alloc->img, block, SFS_FAT_FREE);
+        if (!hold) {
+            alloc->free_map[block / 64] |= (uint64_t)1 << (block % 64);
+            alloc->free_count++;
+        } else if (alloc->held_map != NULL) {
+            alloc->held_map[block / 64] |= (uint64_t)1 << (block % 64);
+            __atomic_add_fetch(&alloc->held_count, 1, __ATOMIC_SEQ_CST);
+        }
+        block = next;
+    }
+}
@@ -0,0 +1,180 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "sfs.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SFS_CENSUS_X86 1
+#endif
+
+/* Entries per thread below which splitting the FAT is not worth a thread. */
+#define CENSUS_THREAD_MIN (4u << 20)
+#define CENSUS_MAX_THREADS 16
+
+typedef void (*census_kernel_t)(const uint32_t *fat, size_t count, uint64_t *free_blocks, uint64_t *reserved_blocks);
+
+/*
+ * The FAT is stored big-endian. Free (0) and reserved (1) are compared
+ * against their on-disk byte order, so no lane ever needs swapping.
+ */
+static void census_scalar(const uint32_t *fat, size_t count, uint64_t *free_blocks, uint64_t *reserved_blocks) {
+    uint32_t reserved = htonl(SFS_FAT_RESERVED);
+    uint64_t f = 0, r = 0;
+    for (size_t i = 0; i < count; i++) {
+        f += fat[i] == SFS_FAT_FREE;
+        r += fat[i] == reserved;
+    }
+    *free_blocks = f;
+    *reserved_blocks = r;
+}
+
+#ifdef SFS_CENSUS_X86
+__attribute__((target("sse4.1")))
+static void census_sse4(const uint32_t *fat, size_t count, uint64_t *free_blocks, uint64_t *reserved_blocks) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i reserved = _mm_set1_epi32(htonl(SFS_FAT_RESERVED));
+    uint64_t f = 0, r = 0;
+    size_t i = 0;
+    while (i + 4 <= count) {
+        __m128i free_acc = _mm_setzero_si128();
+        __m128i reserved_acc = _mm_setzero_si128();
+        size_t end = i + ((count - i) / 4) * 4;
+        if (end - i > (size_t)4 << 30) {
+            end = i + ((size_t)4 << 30);
+        }
+        for (; i < end; i += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(fat + i));
+            free_acc = _mm_sub_epi32(free_acc, _mm_cmpeq_epi32(v, zero));
+            reserved_acc = _mm_sub_epi32(reserved_acc, _mm_cmpeq_epi32(v, reserved));
+        }
+        uint32_t lanes[4];
+        _mm_storeu_si128((__m128i *)lanes, free_acc);
+        f += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        _mm_storeu_si128((__m128i *)lanes, reserved_acc);
+        r += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    uint64_t tail_free, tail_reserved;
+    census_scalar(fat + i, count - i, &tail_free, &tail_reserved);
+    *free_blocks = f + tail_free;
+    *reserved_blocks = r + tail_reserved;
+}
+
+__attribute__((target("avx2")))
+static void census_avx2(const uint32_t *fat, size_t count, uint64_t *free_blocks, uint64_t *reserved_blocks) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i reserved = _mm256_set1_epi32(htonl(SFS_FAT_RESERVED));
+    uint64_t f = 0, r = 0;
+    size_t i = 0;
+    while (i + 8 <= count) {
+        __m256i free_acc = _mm256_setzero_si256();
+        __m256i reserved_acc = _mm256_setzero_si256();
+        size_t end = i + ((count - i) / 8) * 8;
+        if (end - i > (size_t)8 << 30) {
+            end = i + ((size_t)8 << 30);
+        }
+        for (; i < end; i += 8) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(fat + i));
+            free_acc = _mm256_sub_epi32(free_acc, _mm256_cmpeq_epi32(v, zero));
+            reserved_acc = _mm256_sub_epi32(reserved_acc, _mm256_cmpeq_epi32(v, reserved));
+        }
+        uint32_t lanes[8];
+        _mm256_storeu_si256((__m256i *)lanes, free_acc);
+        for (int k = 0; k < 8; k++) {
+            f += lanes[k];
+        }
+        _mm256_storeu_si256((__m256i *)lanes, reserved_acc);
+        for (int k = 0; k < 8; k++) {
+            r += lanes[k];
+        }
+    }
+    uint64_t tail_free, tail_reserved;
+    census_scalar(fat + i, count - i, &tail_free, &tail_reserved);
+    *free_blocks = f + tail_free;
+    *reserved_blocks = r + tail_reserved;
+}
+#endif
+
+static census_kernel_t select_kernel(const char **name) {
+#ifdef SFS_CENSUS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return census_avx2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        *name = "sse4.1";
+        return census_sse4;
+    }
+#endif
+    *name = "scalar";
+    return census_scalar;
+}
+
+const char *sfs_census_kernel(void) {
+    const char *name;
+    select_kernel(&name);
+    return name;
+}
+
+typedef struct {
+    census_kernel_t kernel;
+    const uint32_t *fat;
+    size_t count;
+    uint64_t free_blocks;
+    uint64_t reserved_blocks;
+} census_job_t;
+
+static void *census_worker(void *arg) {
+    census_job_t *job = arg;
+    job->kernel(job->fat, job->count, &job->free_blocks, &job->reserved_blocks);
+    return NULL;
+}
+
+void sfs_fat_census(const uint32_t *fat, size_t count, sfs_census_t *census) {
+    const char *name;
+    census_kernel_t kernel = select_kernel(&name);
+    census_job_t jobs[CENSUS_MAX_THREADS];
+    pthread_t threads[CENSUS_MAX_THREADS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t num_jobs = count / CENSUS_THREAD_MIN;
+    if (num_jobs > (size_t)cpus) {
+        num_jobs = cpus;
+    }
+    if (num_jobs > CENSUS_MAX_THREADS) {
+        num_jobs = CENSUS_MAX_THREADS;
+    }
+    if (num_jobs < 1) {
+        num_jobs = 1;
+    }
+
+    size_t per_job = (count / num_jobs + 7) & ~(size_t)7;
+    size_t started = 0;
+    for (size_t i = 0; i < num_jobs; i++) {
+        jobs[i].kernel = kernel;
+        jobs[i].fat = fat + i * per_job;
+        jobs[i].count = (i == num_jobs - 1) ? count - i * per_job : per_job;
+        if (i > 0 && pthread_create(&threads[i], NULL, census_worker, &jobs[i]) == 0) {
+            started |= (size_t)1 << i;
+        }
+    }
+    census_worker(&jobs[0]);
+
+    uint64_t free_blocks = 0, reserved_blocks = 0;
+    for (size_t i = 0; i < num_jobs; i++) {
+        if (i > 0) {
+            if (started & ((size_t)1 << i)) {
+                pthread_join(threads[i], NULL);
+            } else {
+                census_worker(&jobs[i]);
+            }
+        }
+        free_blocks += jobs[i].free_blocks;
+        reserved_blocks += jobs[i].reserved_blocks;
+    }
+    census->free_blocks = free_blocks;
+    census->reserved_blocks = reserved_blocks;
+    census->allocated_blocks = count - free_blocks - reserved_blocks;
+}
@@ -0,0 +1,325 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "sfs.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define SFS_CRC_X86 1
+#endif
+
+#define CRC32C_POLY 0x82F63B78u
+#define CRC_LANES 4
+#define CHECKSUM_BUFFER_SIZE (1024 * 1024)
+
+typedef void (*crc_kernel_t)(const uint8_t *data, uint32_t count, uint32_t block_size, uint32_t *crcs);
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void build_crc_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+        }
+        crc_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^ crc_table[0][crc_table[t - 1][i] & 0xFF];
+        }
+    }
+}
+
+/* Slicing-by-8: eight table lookups per 8 bytes. */
+static uint32_t crc_scalar(uint32_t crc, const uint8_t *data, size_t length) {
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        word ^= crc;
+        crc = crc_table[7][word & 0xFF] ^ crc_table[6][(word >> 8) & 0xFF] ^ crc_table[5][(word >> 16) & 0xFF] ^ crc_table[4][(word >> 24) & 0xFF] ^ crc_table[3][(word >> 32) & 0xFF] ^ crc_table[2][(word >> 40) & 0xFF] ^ crc_table[1][(word >> 48) & 0xFF] ^ crc_table[0][word >> 56];
+        data += 8;
+        length -= 8;
+    }
+    while (length-- > 0) {
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
+
+static void blocks_scalar(const uint8_t *data, uint32_t count, uint32_t block_size, uint32_t *crcs) {
+    for (uint32_t i = 0; i < count; i++) {
+        crcs[i] = ~crc_scalar(~0u, data + (size_t)i * block_size, block_size);
+    }
+}
+
+#ifdef SFS_CRC_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const uint8_t *data, size_t length) {
+    uint64_t wide = crc;
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        wide = _mm_crc32_u64(wide, word);
+        data += 8;
+        length -= 8;
+    }
+    crc = wide;
+    while (length-- > 0) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+
+/*
+ * The crc32 instruction has a latency of three cycles but issues every
+ * cycle, so one block at a time leaves it mostly idle. Blocks are
+ * independent, so four of them are run through it interleaved.
+ */
+__attribute__((target("sse4.2")))
+static void blocks_sse42(const uint8_t *data, uint32_t count, uint32_t block_size, uint32_t *crcs) {
+    uint32_t i = 0;
+    if (block_size % 8 == 0) {
+        for (; i + CRC_LANES <= count; i += CRC_LANES) {
+            const uint8_t *lane = data + (size_t)i * block_size;
+            uint64_t c0 = ~0u, c1 = ~0u, c2 = ~0u, c3 = ~0u;
+            for (uint32_t offset = 0; offset < block_size; offset += 8) {
+                uint64_t w0, w1, w2, w3;
+                memcpy(&w0, lane + offset, 8);
+                memcpy(&w1, lane + block_size + offset, 8);
+                memcpy(&w2, lane + 2 * (size_t)block_size + offset, 8);
+                memcpy(&w3, lane + 3 * (size_t)block_size + offset, 8);
+                c0 = _mm_crc32_u64(c0, w0);
+                c1 = _mm_crc32_u64(c1, w1);
+                c2 = _mm_crc32_u64(c2, w2);
+                c3 = _mm_crc32_u64(c3, w3);
+            }
+            crcs[i] = ~(uint32_t)c0;
+            crcs[i + 1] = ~(uint32_t)c1;
+            crcs[i + 2] = ~(uint32_t)c2;
+            crcs[i + 3] = ~(uint32_t)c3;
+        }
+    }
+    for (; i < count; i++) {
+        crcs[i] = ~crc_sse42(~0u, data + (size_t)i * block_size, block_size);
+    }
+}
+#endif
+
+static crc_kernel_t select_kernel(const char **name) {
+#ifdef SFS_CRC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        *name = "sse4.2";
+        return blocks_sse42;
+    }
+#endif
+    pthread_once(&crc_table_once, build_crc_table);
+    *name = "scalar";
+    return blocks_scalar;
+}
+
+const char *sfs_crc32c_kernel(void) {
+    const char *name;
+    select_kernel(&name);
+    return name;
+}
+
+/* CRC32C of count consecutive blocks, one value per block. */
+void sfs_crc32c_blocks(const void *data, uint32_t count, uint32_t block_size, uint32_t *crcs) {
+    const char *name;
+    select_kernel(&name)(data, count, block_size, crcs);
+}
+
+bool sfs_entry_is_checksummed(const dir_entry_t *entry) {
+    return !sfs_entry_is_dir(entry) && (entry->unused[0] & SFS_FLAG_CHECKSUMMED) != 0;
+}
+
+static uint32_t area_blocks(const sfs_image_t *img) {
+    uint32_t block_size = img->super_block.block_size;
+    return ((uint64_t)img->super_block.block_count * sizeof(uint32_t) + block_size - 1) / block_size;
+}
+
+/* The checksum words in the mapping, or NULL when the image has none. */
+uint32_t *sfs_checksum_area(const sfs_image_t *img) {
+    const sfs_ext_t *ext = sfs_ext(img);
+    if (ext == NULL || ntohl(ext->magic) != SFS_EXT_MAGIC) {
+        return NULL;
+    }
+    uint32_t start = ntohl(ext->checksum_start);
+    uint32_t blocks = ntohl(ext->checksum_blocks);
+    if (start == 0 || blocks < area_blocks(img) || (uint64_t)start + blocks > img->super_block.block_count) {
+        return NULL;
+    }
+    return (uint32_t *)sfs_block(img, start);
+}
+
+/*
+ * Reserves the checksum run, one word per block of the image, and makes it
+ * known with one flush. Files already in the image stay unchecked.
+ */
+bool sfs_checksum_create(sfs_allocator_t *alloc) {
+    sfs_image_t *img = alloc->img;
+    sfs_ext_t *ext = sfs_ext(img);
+    uint32_t block_size = img->super_block.block_size;
+    uint32_t blocks = area_blocks(img);
+    if (img->checksums != NULL) {
+        return true;
+    }
+    if (ext == NULL || !img->writable) {
+        return false;
+    }
+    uint32_t start = sfs_find_contiguous(alloc, blocks, alloc->entries);
+    if (start == SFS_FAT_EOF) {
+        return false;
+    }
+    sfs_claim_contiguous(alloc, start, blocks);
+    for (uint32_t i = 0; i < blocks; i++) {
+        sfs_fat_set(img, start + i, SFS_FAT_RESERVED);
+    }
+    memset(sfs_block(img, start), 0, (size_t)blocks * block_size);
+    sfs_mark_dirty(img, sfs_block(img, start), (size_t)blocks * block_size);
+    ext->magic = htonl(SFS_EXT_MAGIC);
+    ext->checksum_start = htonl(start);
+    ext->checksum_blocks = htonl(blocks);
+    sfs_mark_dirty(img, ext, sizeof(sfs_ext_t));
+    if (!sfs_flush(img) || fdatasync(img->fd) == -1) {
+        return false;
+    }
+    img->checksums = sfs_checksum_area(img);
+    return true;
+}
+
+/* Records the checksums of count blocks from block on, whose contents are at data. */
+void sfs_checksum_set(sfs_image_t *img, uint32_t block, const void *data, uint32_t count) {
+    uint32_t *words = img->checksums + block;
+    sfs_crc32c_blocks(data, count, img->super_block.block_size, words);
+    for (uint32_t i = 0; i < count; i++) {
+        words[i] = htonl(words[i]);
+    }
+    sfs_mark_dirty(img, words, (size_t)count * sizeof(uint32_t));
+}
+
+/* Gives blocks moved elsewhere unchanged the checksums they had. */
+void sfs_checksum_copy(sfs_image_t *img, uint32_t from, uint32_t to, uint32_t count) {
+    memmove(img->checksums + to, img->checksums + from, (size_t)count * sizeof(uint32_t));
+    sfs_mark_dirty(img, img->checksums + to, (size_t)count * sizeof(uint32_t));
+}
+
+/*
+ * Checksums a chain just written by reading it back from the file: the
+ * data went out with positioned writes and never passed through the
+ * mapping. Only the words are written, so a caller that must not touch
+ * the mapping's dirty state yet marks them later with
+ * sfs_checksum_mark().
+ */
+bool sfs_checksum_fill(const sfs_image_t *img, uint32_t start_block, uint32_t block_count) {
+    uint32_t block_size = img->super_block.block_size;
+    uint32_t per_read = CHECKSUM_BUFFER_SIZE / block_size;
+    sfs_extent_t *extents;
+    uint32_t num_extents = sfs_chain_extents(img, start_block, block_count, &extents);
+    uint8_t *buffer = malloc(CHECKSUM_BUFFER_SIZE);
+    bool ok = extents != NULL && buffer != NULL;
+    for (uint32_t i = 0; ok && i < num_extents; i++) {
+        for (uint32_t done = 0; ok && done < extents[i].length; done += per_read) {
+            uint32_t count = (extents[i].length - done < per_read) ? extents[i].length - done : per_read;
+            uint32_t block = extents[i].start + done;
+            size_t length = (size_t)count * block_size;
+            SFS_COUNT_IO(false, sfs_block_offset(img, block), length);
+            ok = pread(img->fd, buffer, length, sfs_block_offset(img, block)) == (ssize_t)length;
+            if (ok) {
+                uint32_t *words = img->checksums + block;
+                sfs_crc32c_blocks(buffer, count, block_size, words);
+                for (uint32_t j = 0; j < count; j++) {
+                    words[j] = htonl(words[j]);
+                }
+            }
+        }
+    }
+    free(extents);
+    free(buffer);
+    return ok;
+}
+
+/* Marks the checksum words of a chain filled in by sfs_checksum_fill() dirty. */
+bool sfs_checksum_mark(sfs_image_t *img, uint32_t start_block, uint32_t block_count) {
+    sfs_extent_t *extents;
+    uint32_t num_extents = sfs_chain_extents(img, start_block, block_count, &extents);
+    bool ok = extents != NULL;
+    for (uint32_t i = 0; i < num_extents; i++) {
+        sfs_mark_dirty(img, img->checksums + extents[i].start, (size_t)extents[i].length * sizeof(uint32_t));
+    }
+    free(extents);
+    return ok;
+}
+
+bool sfs_checksum_chain(sfs_image_t *img, uint32_t start_block, uint32_t block_count) {
+    return sfs_checksum_fill(img, start_block, block_count) && sfs_checksum_mark(img, start_block, block_count);
+}
+
+/* Returns how many of the count blocks at data match their checksums before the first that does not. */
+uint32_t sfs_checksum_verify(const sfs_image_t *img, uint32_t block, const void *data, uint32_t count) {
+    uint32_t crcs[256];
+    for (uint32_t done = 0; done < count; done += 256) {
+        uint32_t batch = (count - done < 256) ? count - done : 256;
+        sfs_crc32c_blocks((const uint8_t *)data + (size_t)done * img->super_block.block_size, batch, img->super_block.block_size, crcs);
+        for (uint32_t i = 0; i < batch; i++) {
+            if (crcs[i] != ntohl(img->checksums[block + done + i])) {
+                return done + i;
+            }
+        }
+    }
+    return count;
+}
+
+/*
+ * Reads count blocks from block on into buffer and verifies them. On a
+ * mismatch errno is EIO and *bad_block names the block.
+ */
+bool sfs_read_verified(const sfs_image_t *img, uint32_t block, uint32_t count, void *buffer, uint32_t *bad_block) {
+    size_t length = (size_t)count * img->super_block.block_size;
+    *bad_block = SFS_FAT_EOF;
+    SFS_COUNT_IO(false, sfs_block_offset(img, block), length);
+    if (pread(img->fd, buffer, length, sfs_block_offset(img, block)) != (ssize_t)length) {
+        return false;
+    }
+    uint32_t good = sfs_checksum_verify(img, block, buffer, count);
+    if (good < count) {
+        *bad_block = block + good;
+        errno = EIO;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Streams the first size bytes of a chain to dest, verifying every block
+ * before it is written. dest may be a pipe or socket.
+ */
+bool sfs_write_verified(const sfs_image_t *img, const sfs_extent_t *extents, uint32_t num_extents, uint64_t size, int dest, uint32_t *bad_block) {
+    uint32_t block_size = img->super_block.block_size;
+    uint32_t per_read = CHECKSUM_BUFFER_SIZE / block_size;
+    uint8_t *buffer = malloc(CHECKSUM_BUFFER_SIZE);
+    bool ok = buffer != NULL;
+    *bad_block = SFS_FAT_EOF;
+    for (uint32_t i = 0; ok && i < num_extents && size > 0; i++) {
+        for (uint32_t done = 0; ok && done < extents[i].length && size > 0; done += per_read) {
+            uint32_t count = (extents[i].length - done < per_read) ? extents[i].length - done : per_read;
+            size_t length = (size_t)count * block_size;
+            if (length > size) {
+                length = size;
+                count = (length + block_size - 1) / block_size;
+            }
+            ok = sfs_read_verified(img, extents[i].start + done, count, buffer, bad_block) && sfs_write_all(dest, buffer, length);
+            SFS_COUNT(bytes_written, ok ? length : 0);
+            size -= ok ? length : 0;
+        }
+    }
+    free(buffer);
+    return ok && size == 0;
+}
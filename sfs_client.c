@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "sfs.h"
+
+bool sfs_write_all(int fd, const void *buffer, size_t length) {
+    const char *cur = buffer;
+    while (length > 0) {
+        ssize_t written = write(fd, cur, length);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        cur += written;
+        length -= written;
+    }
+    return true;
+}
+
+/*
+ * Reads one '\n'-terminated line from a stream socket without consuming
+ * any of the payload that may follow it: the line is peeked first and then
+ * read to exactly its length.
+ */
+bool sfs_read_line(int sock, char *line, size_t size) {
+    size_t used = 0;
+    while (used < size - 1) {
+        ssize_t got = recv(sock, line + used, size - 1 - used, MSG_PEEK);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        char *newline = memchr(line + used, '\n', got);
+        size_t take = newline ? (size_t)(newline - (line + used)) + 1 : (size_t)got;
+        if (recv(sock, line + used, take, MSG_WAITALL) != (ssize_t)take) {
+            return false;
+        }
+        used += take;
+        if (newline != NULL) {
+            line[used - 1] = '\0';
+            return true;
+        }
+    }
+    return false;
+}
+
+int sfs_client_connect(const char *image_path) {
+    const char *socket_path = getenv(SFSD_SOCKET_ENV);
+    struct sockaddr_un addr;
+    struct stat st;
+    char line[128];
+    uint64_t size;
+
+    if (socket_path == NULL || *socket_path == '\0' || stat(image_path, &st) == -1 || strlen(socket_path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    snprintf(line, sizeof(line), "SFS\t%lu\t%lu\n", (unsigned long)st.st_dev, (unsigned long)st.st_ino);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 || !sfs_client_request(sock, line, &size, NULL, 0)) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+bool sfs_client_request(int sock, const char *request, uint64_t *size, char *error, size_t error_size) {
+    char line[256];
+    if (!sfs_write_all(sock, request, strlen(request)) || !sfs_read_line(sock, line, sizeof(line))) {
+        if (error != NULL) {
+            snprintf(error, error_size, "Lost connection to sfsd.");
+        }
+        return false;
+    }
+    if (strncmp(line, "OK ", 3) == 0) {
+        *size = strtoull(line + 3, NULL, 10);
+        return true;
+    }
+    if (error != NULL) {
+        snprintf(error, error_size, "%s", strncmp(line, "ERR ", 4) == 0 ? line + 4 : line);
+    }
+    return false;
+}
+
+bool sfs_client_receive(int sock, int out, uint64_t size) {
+    char buffer[64 * 1024];
+    while (size > 0) {
+        ssize_t got = read(sock, buffer, size < sizeof(buffer) ? size : sizeof(buffer));
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0 || !sfs_write_all(out, buffer, got)) {
+            return false;
+        }
+        SFS_COUNT(syscalls, 2);
+        SFS_COUNT(bytes_read, got);
+        SFS_COUNT(bytes_written, got);
+        size -= got;
+    }
+    return true;
+}
@@ -0,0 +1,675 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "sfs.h"
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_SEARCH_LIMIT 12
+#define LZ_MAX_OFFSET 65535
+#define Z_MAX_THREADS 16
+#define Z_CHUNKS_PER_THREAD 4
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t lz_hash(uint32_t value) {
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *put_length(uint8_t *op, size_t length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = length;
+    return op;
+}
+
+static bool get_length(const uint8_t **ip, const uint8_t *end, size_t *length) {
+    uint8_t byte;
+    do {
+        if (*ip == end) {
+            return false;
+        }
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+/*
+ * LZ4-style block coder: each sequence is a token holding the literal and
+ * match lengths, the literals, a 16-bit little-endian offset and any
+ * length overflow bytes; the last sequence is literals only. Positions
+ * that keep missing are skipped faster, so incompressible data costs
+ * little. Returns 0 when the output would not fit in capacity.
+ */
+static size_t lz_compress(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity) {
+    uint32_t table[1 << LZ_HASH_BITS] = {0};
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *end = src + length;
+    uint8_t *op = dst;
+    uint8_t *op_end = dst + capacity;
+    uint32_t misses = 0;
+
+    if (length > LZ_MATCH_SEARCH_LIMIT) {
+        const uint8_t *search_limit = end - LZ_MATCH_SEARCH_LIMIT;
+        const uint8_t *match_limit = end - LZ_LAST_LITERALS;
+        while (ip < search_limit) {
+            uint32_t hash = lz_hash(read32(ip));
+            const uint8_t *ref = src + table[hash];
+            table[hash] = ip - src;
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != read32(ip)) {
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *match_end = ip + LZ_MIN_MATCH;
+            while (match_end < match_limit && *match_end == ref[match_end - ip]) {
+                match_end++;
+            }
+            size_t literals = ip - anchor;
+            size_t match = match_end - ip - LZ_MIN_MATCH;
+            if ((size_t)(op_end - op) < 1 + literals / 255 + 1 + literals + 2 + match / 255 + 1) {
+                return 0;
+            }
+            uint8_t *token = op++;
+            *token = (literals >= 15 ? 15 : literals) << 4 | (match >= 15 ? 15 : match);
+            if (literals >= 15) {
+                op = put_length(op, literals - 15);
+            }
+            memcpy(op, anchor, literals);
+            op += literals;
+            *op++ = (ip - ref) & 0xFF;
+            *op++ = (ip - ref) >> 8;
+            if (match >= 15) {
+                op = put_length(op, match - 15);
+            }
+            ip = anchor = match_end;
+        }
+    }
+
+    size_t literals = end - anchor;
+    if ((size_t)(op_end - op) < 1 + literals / 255 + 1 + literals) {
+        return 0;
+    }
+    *op++ = (literals >= 15 ? 15 : literals) << 4;
+    if (literals >= 15) {
+        op = put_length(op, literals - 15);
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+    return op - dst;
+}
+
+/* Decodes exactly expected bytes, rejecting anything that reads or writes out of bounds. */
+static bool lz_decompress(const uint8_t *src, size_t length, uint8_t *dst, size_t expected) {
+    const uint8_t *ip = src;
+    const uint8_t *end = src + length;
+    uint8_t *op = dst;
+    uint8_t *op_end = dst + expected;
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !get_length(&ip, end, &literals)) {
+            return false;
+        }
+        if (literals > (size_t)(end - ip) || literals > (size_t)(op_end - op)) {
+            return false;
+        }
+        memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == end) {
+            break;
+        }
+        if (end - ip < 2) {
+            return false;
+        }
+        size_t offset = ip[0] | ip[1] << 8;
+        size_t match = token & 15;
+        ip += 2;
+        if (match == 15 && !get_length(&ip, end, &match)) {
+            return false;
+        }
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - dst) || match > (size_t)(op_end - op)) {
+            return false;
+        }
+        /* An overlapping match repeats its last offset bytes. */
+        while (match > 0) {
+            size_t run = (match < offset) ? match : offset;
+            memcpy(op, op - offset, run);
+            op += run;
+            match -= run;
+        }
+    }
+    return op == op_end;
+}
+
+/*
+ * The stored bytes of a compressed file seen as one stream. The chain is
+ * split into extents once; ends[i] is where extent i stops in the stream.
+ */
+typedef struct {
+    const sfs_image_t *img;
+    sfs_extent_t *extents;
+    uint64_t *ends;
+    uint32_t num_extents;
+    bool verify;
+} stream_t;
+
+/* Takes over extents, which must come from malloc(). */
+static bool stream_init(stream_t *stream, const sfs_image_t *img, sfs_extent_t *extents, uint32_t num_extents) {
+    uint64_t position = 0;
+    stream->img = img;
+    stream->ends = NULL;
+    stream->verify = false;
+    stream->extents = extents;
+    stream->num_extents = num_extents;
+    if (stream->extents != NULL) {
+        stream->ends = malloc((stream->num_extents + 1) * sizeof(uint64_t));
+    }
+    if (stream->ends == NULL) {
+        free(stream->extents);
+        stream->extents = NULL;
+        return false;
+    }
+    for (uint32_t i = 0; i < stream->num_extents; i++) {
+        position += (uint64_t)stream->extents[i].length * img->super_block.block_size;
+        stream->ends[i] = position;
+    }
+    return true;
+}
+
+static bool stream_open(stream_t *stream, const sfs_image_t *img, uint32_t start_block, uint32_t block_count) {
+    sfs_extent_t *extents;
+    uint32_t num_extents = sfs_chain_extents(img, start_block, block_count, &extents);
+    return stream_init(stream, img, extents, num_extents);
+}
+
+static void stream_close(stream_t *stream) {
+    free(stream->extents);
+    free(stream->ends);
+}
+
+static uint64_t stream_length(const stream_t *stream) {
+    return stream->num_extents ? stream->ends[stream->num_extents - 1] : 0;
+}
+
+/* Calls back once per piece of [offset, offset + length) that is contiguous in the image. */
+static bool stream_pieces(const stream_t *stream, uint64_t offset, size_t length, bool (*piece)(const stream_t *, off_t, uint8_t *, size_t), uint8_t *buffer) {
+    if (length == 0) {
+        return true;
+    }
+    if (offset + length > stream_length(stream)) {
+        return false;
+    }
+    uint32_t low = 0;
+    uint32_t high = stream->num_extents - 1;
+    while (low < high) {
+        uint32_t middle = (low + high) / 2;
+        if (stream->ends[middle] > offset) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    for (uint32_t i = low; length > 0; i++) {
+        uint64_t extent_start = stream->ends[i] - (uint64_t)stream->extents[i].length * stream->img->super_block.block_size;
+        size_t run = (stream->ends[i] - offset < length) ? stream->ends[i] - offset : length;
+        if (!piece(stream, sfs_block_offset(stream->img, stream->extents[i].start) + (offset - extent_start), buffer, run)) {
+            return false;
+        }
+        buffer += run;
+        offset += run;
+        length -= run;
+    }
+    return true;
+}
+
+/*
+ * Data is read from the file, not the mapping: a private mapping may still
+ * hold an old copy of a block that was metadata before it was reused. A
+ * verified stream reads the whole blocks around the piece and checks them.
+ */
+static bool read_piece(const stream_t *stream, off_t image_offset, uint8_t *buffer, size_t length) {
+    if (!stream->verify) {
+        SFS_COUNT_IO(false, image_offset, length);
+        return pread(stream->img->fd, buffer, length, image_offset) == (ssize_t)length;
+    }
+    uint32_t block_size = stream->img->super_block.block_size;
+    uint32_t block = image_offset / block_size;
+    uint32_t skip = image_offset % block_size;
+    uint32_t count = (skip + length + block_size - 1) / block_size;
+    uint32_t bad_block;
+    uint8_t *blocks = malloc((size_t)count * block_size);
+    bool ok = blocks != NULL && sfs_read_verified(stream->img, block, count, blocks, &bad_block);
+    if (ok) {
+        memcpy(buffer, blocks + skip, length);
+    }
+    free(blocks);
+    return ok;
+}
+
+static bool write_piece(const stream_t *stream, off_t image_offset, uint8_t *buffer, size_t length) {
+    SFS_COUNT_IO(true, image_offset, length);
+    return pwrite(stream->img->fd, buffer, length, image_offset) == (ssize_t)length;
+}
+
+static bool stream_read(const stream_t *stream, uint64_t offset, void *buffer, size_t length) {
+    return stream_pieces(stream, offset, length, read_piece, buffer);
+}
+
+static bool stream_write(const stream_t *stream, uint64_t offset, const void *buffer, size_t length) {
+    return stream_pieces(stream, offset, length, write_piece, (uint8_t *)buffer);
+}
+
+static uint64_t table_bytes(uint32_t num_chunks) {
+    return sizeof(sfs_chunk_header_t) + ((uint64_t)num_chunks + 1) * sizeof(uint32_t);
+}
+
+static uint32_t chunk_count(uint32_t size) {
+    return (size + (uint64_t)SFS_CHUNK_SIZE - 1) / SFS_CHUNK_SIZE;
+}
+
+/*
+ * One chunk in flight. Compressing fills packed from raw; decompressing
+ * reads packed_length stored bytes at offset and fills raw. A chunk whose
+ * packed length equals its raw length is stored as is.
+ */
+typedef struct {
+    uint8_t *raw;
+    uint8_t *packed;
+    uint32_t raw_length;
+    uint32_t packed_length;
+    uint64_t offset;
+} chunk_slot_t;
+
+typedef struct chunk_batch chunk_batch_t;
+
+typedef struct {
+    chunk_batch_t *batch;
+    int first;
+    bool ok;
+} chunk_worker_t;
+
+/* A batch of chunks coded by a few threads while the caller does I/O. */
+struct chunk_batch {
+    const stream_t *stream;
+    chunk_slot_t *slots;
+    int capacity;
+    int count;
+    uint32_t first_chunk;
+    bool decompress;
+    int num_threads;
+    pthread_t threads[Z_MAX_THREADS];
+    chunk_worker_t workers[Z_MAX_THREADS];
+    bool started[Z_MAX_THREADS];
+};
+
+static void *chunk_worker(void *arg) {
+    chunk_worker_t *worker = arg;
+    chunk_batch_t *batch = worker->batch;
+    for (int i = worker->first; worker->ok && i < batch->count; i += batch->num_threads) {
+        chunk_slot_t *slot = &batch->slots[i];
+        if (!batch->decompress) {
+            slot->packed_length = lz_compress(slot->raw, slot->raw_length, slot->packed, slot->raw_length - 1);
+            if (slot->packed_length == 0) {
+                slot->packed_length = slot->raw_length;
+            }
+        } else if (slot->packed_length == slot->raw_length) {
+            worker->ok = stream_read(batch->stream, slot->offset, slot->raw, slot->raw_length);
+        } else {
+            worker->ok = stream_read(batch->stream, slot->offset, slot->packed, slot->packed_length) && lz_decompress(slot->packed, slot->packed_length, slot->raw, slot->raw_length);
+        }
+    }
+    return NULL;
+}
+
+static int thread_count(void) {
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads > Z_MAX_THREADS) {
+        num_threads = Z_MAX_THREADS;
+    }
+    return (num_threads < 1) ? 1 : num_threads;
+}
+
+static void start_batch(chunk_batch_t *batch) {
+    batch->num_threads = (batch->count < thread_count()) ? batch->count : thread_count();
+    for (int t = 0; t < batch->num_threads; t++) {
+        batch->workers[t] = (chunk_worker_t){batch, t, true};
+        batch->started[t] = pthread_create(&batch->threads[t], NULL, chunk_worker, &batch->workers[t]) == 0;
+        if (!batch->started[t]) {
+            chunk_worker(&batch->workers[t]);
+        }
+    }
+}
+
+static bool finish_batch(chunk_batch_t *batch) {
+    bool ok = true;
+    for (int t = 0; t < batch->num_threads; t++) {
+        if (batch->started[t]) {
+            pthread_join(batch->threads[t], NULL);
+        }
+        ok = ok && batch->workers[t].ok;
+    }
+    return ok;
+}
+
+/* Two batches with their own buffers, so one is coded while the other does I/O. */
+static bool init_batches(chunk_batch_t batches[2], const stream_t *stream, uint32_t num_chunks, bool decompress) {
+    uint32_t capacity = (uint32_t)thread_count() * Z_CHUNKS_PER_THREAD;
+    if (capacity > num_chunks) {
+        capacity = num_chunks;
+    }
+    memset(batches, 0, 2 * sizeof(chunk_batch_t));
+    for (int b = 0; b < 2; b++) {
+        batches[b].stream = stream;
+        batches[b].decompress = decompress;
+        batches[b].slots = calloc(capacity, sizeof(chunk_slot_t));
+        uint8_t *buffers = malloc((size_t)capacity * 2 * SFS_CHUNK_SIZE);
+        if (batches[b].slots == NULL || buffers == NULL) {
+            free(buffers);
+            return false;
+        }
+        batches[b].capacity = capacity;
+        for (uint32_t i = 0; i < capacity; i++) {
+            batches[b].slots[i].raw = buffers + (size_t)i * 2 * SFS_CHUNK_SIZE;
+            batches[b].slots[i].packed = batches[b].slots[i].raw + SFS_CHUNK_SIZE;
+        }
+    }
+    return true;
+}
+
+static void free_batches(chunk_batch_t batches[2]) {
+    for (int b = 0; b < 2; b++) {
+        if (batches[b].capacity > 0) {
+            free(batches[b].slots[0].raw);
+        }
+        free(batches[b].slots);
+    }
+}
+
+bool sfs_entry_is_compressed(const dir_entry_t *entry) {
+    return !sfs_entry_is_dir(entry) && (entry->unused[0] & SFS_FLAG_COMPRESSED) != 0;
+}
+
+/*
+ * Reads and checks the chunk table of a compressed file: offsets come back
+ * in host order, num_chunks + 1 of them, each chunk no longer than its
+ * data and the last offset inside the chain.
+ */
+static uint32_t *read_table(const stream_t *stream, uint32_t size) {
+    uint32_t num_chunks = chunk_count(size);
+    uint64_t header_bytes = table_bytes(num_chunks);
+    sfs_chunk_header_t header;
+    if (!stream_read(stream, 0, &header, sizeof(header)) || ntohl(header.magic) != SFS_CHUNK_MAGIC || ntohl(header.chunk_size) != SFS_CHUNK_SIZE || ntohl(header.num_chunks) != num_chunks) {
+        return NULL;
+    }
+    uint32_t *offsets = malloc(((size_t)num_chunks + 1) * sizeof(uint32_t));
+    if (offsets == NULL || !stream_read(stream, sizeof(header), offsets, ((size_t)num_chunks + 1) * sizeof(uint32_t))) {
+        free(offsets);
+        return NULL;
+    }
+    bool ok = ntohl(offsets[0]) == header_bytes;
+    for (uint32_t i = 0; i <= num_chunks; i++) {
+        offsets[i] = ntohl(offsets[i]);
+        if (i > 0) {
+            uint32_t raw_length = (i < num_chunks) ? SFS_CHUNK_SIZE : size - (uint32_t)(i - 1) * SFS_CHUNK_SIZE;
+            ok = ok && offsets[i] > offsets[i - 1] && offsets[i] - offsets[i - 1] <= raw_length;
+        }
+    }
+    if (!ok || offsets[num_chunks] > stream_length(stream)) {
+        free(offsets);
+        return NULL;
+    }
+    return offsets;
+}
+
+/* Bytes a file takes in its chain: the size, or for a compressed file the end of its last chunk; 0 if its table is damaged. */
+uint64_t sfs_stored_size(const sfs_image_t *img, const dir_entry_t *entry) {
+    uint64_t size = sfs_entry_size(entry);
+    if (!sfs_entry_is_compressed(entry)) {
+        return size;
+    }
+    if (size > UINT32_MAX) {
+        return 0;
+    }
+    uint32_t block_size = img->super_block.block_size;
+    uint64_t header_bytes = table_bytes(chunk_count(size));
+    uint32_t blocks = (header_bytes + block_size - 1) / block_size;
+    if (blocks > ntohl(entry->block_count)) {
+        return 0;
+    }
+    stream_t stream;
+    sfs_chunk_header_t header;
+    uint32_t stored = 0;
+    if (!stream_open(&stream, img, ntohl(entry->starting_block), blocks)) {
+        return 0;
+    }
+    if (!stream_read(&stream, 0, &header, sizeof(header)) || ntohl(header.magic) != SFS_CHUNK_MAGIC || !stream_read(&stream, header_bytes - sizeof(stored), &stored, sizeof(stored))) {
+        stored = 0;
+    }
+    stream_close(&stream);
+    return ntohl(stored);
+}
+
+static bool read_source(sfs_put_session_t *session, int source, uint8_t *buffer, size_t length) {
+    size_t filled = 0;
+    while (filled < length) {
+        ssize_t got = read(source, buffer + filled, length - filled);
+        SFS_COUNT_IO(false, session->bytes_read, got > 0 ? got : 0);
+        if (got <= 0) {
+            snprintf(session->error, sizeof(session->error), "Error reading source file.");
+            return false;
+        }
+        filled += got;
+        session->bytes_read += got;
+    }
+    return true;
+}
+
+static bool write_batch(const chunk_batch_t *batch, uint32_t *offsets, uint64_t *position) {
+    for (int i = 0; i < batch->count; i++) {
+        const chunk_slot_t *slot = &batch->slots[i];
+        const uint8_t *data = (slot->packed_length < slot->raw_length) ? slot->packed : slot->raw;
+        offsets[batch->first_chunk + i] = htonl(*position);
+        if (!stream_write(batch->stream, *position, data, slot->packed_length)) {
+            return false;
+        }
+        *position += slot->packed_length;
+    }
+    return true;
+}
+
+/*
+ * Allocates the chain a compressed file of size bytes needs at worst,
+ * where every chunk is stored as is, and fills in the entry's chain, size
+ * and flag for it.
+ */
+bool sfs_compress_reserve(sfs_put_session_t *session, uint64_t size, dir_entry_t *entry) {
+    uint32_t block_size = session->img->super_block.block_size;
+    uint64_t header_bytes = table_bytes(size > UINT32_MAX ? 0 : chunk_count(size));
+    if (size > UINT32_MAX || header_bytes + size > UINT32_MAX) {
+        snprintf(session->error, sizeof(session->error), "File too large to compress.");
+        return false;
+    }
+    uint32_t block_count = (header_bytes + size + block_size - 1) / block_size;
+    uint32_t start_block = sfs_allocate_chain(&session->alloc, block_count);
+    if (start_block == SFS_FAT_EOF) {
+        snprintf(session->error, sizeof(session->error), "Not enough free space in the file system.");
+        return false;
+    }
+    entry->starting_block = htonl(start_block);
+    entry->block_count = htonl(block_count);
+    sfs_entry_set_size(entry, size);
+    entry->unused[0] |= SFS_FLAG_COMPRESSED;
+    return true;
+}
+
+/*
+ * Compresses the entry's size in bytes read from source into the chain
+ * sfs_compress_reserve() gave it. Chunks are read in batches; while one
+ * batch is being compressed the previous one is written, and the chunk
+ * table goes in front once every chunk has landed. Only the image file
+ * and the chain's FAT entries are touched, and the entry's block count
+ * drops to the blocks used; sfs_compress_trim() gives back the rest.
+ */
+bool sfs_compress_write(sfs_put_session_t *session, int source, dir_entry_t *entry) {
+    sfs_image_t *img = session->img;
+    uint32_t block_size = img->super_block.block_size;
+    uint32_t size = ntohl(entry->size);
+    uint32_t num_chunks = chunk_count(size);
+    uint64_t header_bytes = table_bytes(num_chunks);
+
+    stream_t stream;
+    chunk_batch_t batches[2];
+    sfs_chunk_header_t *header = calloc(1, header_bytes);
+    uint32_t *offsets = (uint32_t *)(header + 1);
+    bool streamed = stream_open(&stream, img, ntohl(entry->starting_block), ntohl(entry->block_count));
+    bool ok = streamed && header != NULL && init_batches(batches, &stream, num_chunks, false);
+    if (!ok) {
+        snprintf(session->error, sizeof(session->error), "Error allocating compression buffers.");
+    }
+    chunk_batch_t *current = &batches[0];
+    chunk_batch_t *previous = NULL;
+    uint64_t position = header_bytes;
+    uint32_t next_chunk = 0;
+    while (ok && (next_chunk < num_chunks || previous != NULL)) {
+        current->first_chunk = next_chunk;
+        current->count = 0;
+        while (ok && next_chunk < num_chunks && current->count < current->capacity) {
+            chunk_slot_t *slot = &current->slots[current->count++];
+            slot->raw_length = (next_chunk < num_chunks - 1) ? SFS_CHUNK_SIZE : size - next_chunk * SFS_CHUNK_SIZE;
+            ok = read_source(session, source, slot->raw, slot->raw_length);
+            next_chunk++;
+        }
+        bool started = ok && current->count > 0;
+        if (started) {
+            start_batch(current);
+        }
+        if (ok && previous != NULL && !write_batch(previous, offsets, &position)) {
+            snprintf(session->error, sizeof(session->error), "Error writing to file system.");
+            ok = false;
+        }
+        previous = NULL;
+        if (started) {
+            finish_batch(current);
+            previous = current;
+            current = (current == &batches[0]) ? &batches[1] : &batches[0];
+        }
+    }
+    if (ok) {
+        header->magic = htonl(SFS_CHUNK_MAGIC);
+        header->chunk_size = htonl(SFS_CHUNK_SIZE);
+        header->num_chunks = htonl(num_chunks);
+        offsets[num_chunks] = htonl(position);
+        ok = stream_write(&stream, 0, header, header_bytes);
+        if (!ok) {
+            snprintf(session->error, sizeof(session->error), "Error writing to file system.");
+        }
+    }
+    if (ok) {
+        entry->block_count = htonl((position + block_size - 1) / block_size);
+    }
+    if (streamed) {
+        free_batches(batches);
+        stream_close(&stream);
+    }
+    free(header);
+    return ok;
+}
+
+/* Gives back the blocks of a reserved chain past the entry's block count. */
+void sfs_compress_trim(sfs_allocator_t *alloc, const dir_entry_t *entry) {
+    uint32_t kept = ntohl(entry->block_count);
+    uint32_t last = ntohl(entry->starting_block);
+    for (uint32_t i = 1; i < kept && last < alloc->img->super_block.block_count; i++) {
+        last = sfs_fat_get(alloc->img, last);
+    }
+    if (kept == 0 || last >= alloc->img->super_block.block_count) {
+        return;
+    }
+    uint32_t next = sfs_fat_get(alloc->img, last);
+    if (next != SFS_FAT_EOF) {
+        sfs_fat_set(alloc->img, last, SFS_FAT_EOF);
+        sfs_free_chain(alloc, next);
+    }
+}
+
+/*
+ * Writes the logical contents of a compressed file to dest, which may be a
+ * pipe or socket. Chunks are read and decompressed in parallel, one batch
+ * ahead of the batch being written out in order. With extents given the
+ * FAT is not read, so a caller that took them earlier need not hold the
+ * image meanwhile; otherwise they come from the entry's chain.
+ */
+bool sfs_get_compressed(const sfs_image_t *img, const dir_entry_t *entry, const sfs_extent_t *extents, uint32_t num_extents, int dest) {
+    uint32_t size = ntohl(entry->size);
+    uint32_t num_chunks = chunk_count(size);
+    stream_t stream;
+    chunk_batch_t batches[2];
+    if (sfs_entry_size(entry) > UINT32_MAX) {
+        return false;
+    }
+    sfs_extent_t *copy = (extents != NULL) ? malloc((num_extents + 1) * sizeof(sfs_extent_t)) : NULL;
+    if (copy != NULL) {
+        memcpy(copy, extents, num_extents * sizeof(sfs_extent_t));
+    }
+    bool opened = (extents != NULL) ? stream_init(&stream, img, copy, num_extents) : stream_open(&stream, img, ntohl(entry->starting_block), ntohl(entry->block_count));
+    if (!opened) {
+        return false;
+    }
+    stream.verify = img->checksums != NULL && sfs_entry_is_checksummed(entry);
+    uint32_t *offsets = read_table(&stream, size);
+    bool ok = offsets != NULL && init_batches(batches, &stream, num_chunks, true);
+    chunk_batch_t *current = &batches[0];
+    chunk_batch_t *previous = NULL;
+    uint32_t next_chunk = 0;
+    while (ok && (next_chunk < num_chunks || previous != NULL)) {
+        current->first_chunk = next_chunk;
+        current->count = 0;
+        while (next_chunk < num_chunks && current->count < current->capacity) {
+            chunk_slot_t *slot = &current->slots[current->count++];
+            slot->raw_length = (next_chunk < num_chunks - 1) ? SFS_CHUNK_SIZE : size - next_chunk * SFS_CHUNK_SIZE;
+            slot->packed_length = offsets[next_chunk + 1] - offsets[next_chunk];
+            slot->offset = offsets[next_chunk];
+            next_chunk++;
+        }
+        bool started = current->count > 0;
+        if (started) {
+            start_batch(current);
+        }
+        for (int i = 0; previous != NULL && ok && i < previous->count; i++) {
+            ok = sfs_write_all(dest, previous->slots[i].raw, previous->slots[i].raw_length);
+            SFS_COUNT(bytes_written, previous->slots[i].raw_length);
+        }
+        previous = NULL;
+        if (started) {
+            ok = finish_batch(current) && ok;
+            previous = current;
+            current = (current == &batches[0]) ? &batches[1] : &batches[0];
+        }
+    }
+    if (offsets != NULL) {
+        free_batches(batches);
+    }
+    free(offsets);
+    stream_close(&stream);
+    return ok;
+}
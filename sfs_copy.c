@@ -0,0 +1,443 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "sfs.h"
+
+/* io_uring through raw syscalls, so no liburing is needed. */
+struct sfs_ring {
+    int fd;
+    bool fixed;
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+/* One buffer's worth of a segment, read into the buffer and then written out. */
+typedef struct {
+    off_t src_offset;
+    off_t dst_offset;
+    size_t length;
+    size_t done;
+    bool writing;
+    struct iovec iov;
+} copy_piece_t;
+
+typedef struct {
+    const sfs_copy_seg_t *segs;
+    size_t count;
+    size_t seg;
+    size_t offset;
+} piece_cursor_t;
+
+static bool next_piece(piece_cursor_t *cursor, copy_piece_t *piece) {
+    while (cursor->seg < cursor->count && cursor->offset == cursor->segs[cursor->seg].length) {
+        cursor->seg++;
+        cursor->offset = 0;
+    }
+    if (cursor->seg == cursor->count) {
+        return false;
+    }
+    const sfs_copy_seg_t *seg = &cursor->segs[cursor->seg];
+    memset(piece, 0, sizeof(copy_piece_t));
+    piece->src_offset = seg->src_offset + cursor->offset;
+    piece->dst_offset = seg->dst_offset + cursor->offset;
+    piece->length = seg->length - cursor->offset;
+    if (piece->length > SFS_COPY_CHUNK) {
+        piece->length = SFS_COPY_CHUNK;
+    }
+    cursor->offset += piece->length;
+    return true;
+}
+
+static void ring_free(struct sfs_ring *ring) {
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+    if (ring->sq_ptr != NULL) {
+        munmap(ring->sq_ptr, ring->sq_size);
+    }
+    close(ring->fd);
+    free(ring);
+}
+
+static void *ring_map(int fd, size_t size, off_t offset) {
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return (ptr == MAP_FAILED) ? NULL : ptr;
+}
+
+static struct sfs_ring *ring_init(uint8_t *buffers) {
+    struct io_uring_params params;
+    struct sfs_ring *ring = calloc(1, sizeof(struct sfs_ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, SFS_COPY_DEPTH, &params);
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size) {
+            ring->sq_size = ring->cq_size;
+        }
+        ring->cq_size = ring->sq_size;
+    }
+    ring->sq_ptr = ring_map(ring->fd, ring->sq_size, IORING_OFF_SQ_RING);
+    ring->cq_ptr = (params.features & IORING_FEAT_SINGLE_MMAP) ? ring->sq_ptr : ring_map(ring->fd, ring->cq_size, IORING_OFF_CQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = ring_map(ring->fd, ring->sqes_size, IORING_OFF_SQES);
+    if (ring->sq_ptr == NULL || ring->cq_ptr == NULL || ring->sqes == NULL) {
+        ring_free(ring);
+        return NULL;
+    }
+
+    uint8_t *sq = ring->sq_ptr;
+    uint8_t *cq = ring->cq_ptr;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    /* Registration pins the buffers; past RLIMIT_MEMLOCK plain readv/writev still works. */
+    struct iovec iovs[SFS_COPY_DEPTH];
+    for (int i = 0; i < SFS_COPY_DEPTH; i++) {
+        iovs[i].iov_base = buffers + (size_t)i * SFS_COPY_CHUNK;
+        iovs[i].iov_len = SFS_COPY_CHUNK;
+    }
+    ring->fixed = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iovs, SFS_COPY_DEPTH) == 0;
+    return ring;
+}
+
+static void ring_queue(struct sfs_ring *ring, int fd, copy_piece_t *piece, uint8_t *buffer, unsigned slot) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    size_t offset = piece->done;
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->fd = fd;
+    sqe->off = (piece->writing ? piece->dst_offset : piece->src_offset) + offset;
+    sqe->user_data = slot;
+    if (ring->fixed) {
+        sqe->opcode = piece->writing ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->addr = (uintptr_t)(buffer + offset);
+        sqe->len = piece->length - offset;
+        sqe->buf_index = slot;
+    } else {
+        piece->iov.iov_base = buffer + offset;
+        piece->iov.iov_len = piece->length - offset;
+        sqe->opcode = piece->writing ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->addr = (uintptr_t)&piece->iov;
+        sqe->len = 1;
+    }
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Every buffer slot carries one piece from read to write. A slot is
+ * refilled as soon as its write completes, so reads of later pieces
+ * overlap writes of earlier ones. After an error no new pieces start,
+ * but the loop still drains what is in flight before the buffers are
+ * given back.
+ */
+static bool ring_copy(sfs_copier_t *copier, int src, int dst, const sfs_copy_seg_t *segs, size_t count) {
+    struct sfs_ring *ring = copier->ring;
+    copy_piece_t pieces[SFS_COPY_DEPTH];
+    bool busy[SFS_COPY_DEPTH] = { false };
+    piece_cursor_t cursor = { segs, count, 0, 0 };
+    int active = 0;
+    int error = 0;
+
+    for (;;) {
+        for (unsigned slot = 0; slot < SFS_COPY_DEPTH && error == 0; slot++) {
+            if (!busy[slot] && next_piece(&cursor, &pieces[slot])) {
+                busy[slot] = true;
+                active++;
+                ring_queue(ring, src, &pieces[slot], copier->buffers + (size_t)slot * SFS_COPY_CHUNK, slot);
+            }
+        }
+        if (active == 0) {
+            break;
+        }
+        unsigned pending = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        SFS_COUNT(syscalls, 1);
+        if (syscall(__NR_io_uring_enter, ring->fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            /* Nothing can be reaped; the buffers may still be in use, so they are leaked with the ring. */
+            copier->buffers = NULL;
+            return false;
+        }
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            unsigned slot = cqe->user_data;
+            copy_piece_t *piece = &pieces[slot];
+            if (cqe->res <= 0) {
+                error = (cqe->res < 0) ? -cqe->res : EIO;
+                busy[slot] = false;
+                active--;
+                continue;
+            }
+            piece->done += cqe->res;
+            if (piece->writing) {
+                SFS_COUNT(bytes_written, cqe->res);
+            } else {
+                SFS_COUNT(bytes_read, cqe->res);
+            }
+            if (piece->done == piece->length && piece->writing) {
+                busy[slot] = false;
+                active--;
+                continue;
+            }
+            if (piece->done == piece->length) {
+                piece->writing = true;
+                piece->done = 0;
+            }
+            ring_queue(ring, piece->writing ? dst : src, piece, copier->buffers + (size_t)slot * SFS_COPY_CHUNK, slot);
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    errno = error;
+    return error == 0;
+}
+
+/*
+ * The fallback pipeline: the calling thread reads pieces into two
+ * buffers in turn while a writer thread empties them, so each read
+ * overlaps the previous piece's write.
+ */
+typedef struct {
+    int dst;
+    uint8_t *buffers[2];
+    copy_piece_t pieces[2];
+    bool full[2];
+    bool finished;
+    int error;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} pipeline_t;
+
+static bool write_piece(int dst, const uint8_t *buffer, const copy_piece_t *piece) {
+    size_t done = 0;
+    while (done < piece->length) {
+        ssize_t written = pwrite(dst, buffer + done, piece->length - done, piece->dst_offset + done);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        SFS_COUNT_IO(true, piece->dst_offset + done, written);
+        done += written;
+    }
+    return true;
+}
+
+static bool read_piece(int src, uint8_t *buffer, const copy_piece_t *piece) {
+    size_t done = 0;
+    while (done < piece->length) {
+        ssize_t got = pread(src, buffer + done, piece->length - done, piece->src_offset + done);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            if (got == 0) {
+                errno = EIO;
+            }
+            return false;
+        }
+        SFS_COUNT_IO(false, piece->src_offset + done, got);
+        done += got;
+    }
+    return true;
+}
+
+static void *pipeline_writer(void *arg) {
+    pipeline_t *pipeline = arg;
+    for (int turn = 0;; turn ^= 1) {
+        pthread_mutex_lock(&pipeline->lock);
+        while (!pipeline->full[turn] && !pipeline->finished && pipeline->error == 0) {
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+        }
+        bool stop = !pipeline->full[turn];
+        pthread_mutex_unlock(&pipeline->lock);
+        if (stop) {
+            return NULL;
+        }
+        bool ok = write_piece(pipeline->dst, pipeline->buffers[turn], &pipeline->pieces[turn]);
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->full[turn] = false;
+        if (!ok && pipeline->error == 0) {
+            pipeline->error = errno ? errno : EIO;
+        }
+        pthread_cond_broadcast(&pipeline->changed);
+        pthread_mutex_unlock(&pipeline->lock);
+    }
+}
+
+static bool pipeline_copy(sfs_copier_t *copier, int src, int dst, const sfs_copy_seg_t *segs, size_t count) {
+    pipeline_t pipeline;
+    piece_cursor_t cursor = { segs, count, 0, 0 };
+    pthread_t writer;
+    copy_piece_t piece;
+
+    memset(&pipeline, 0, sizeof(pipeline));
+    pipeline.dst = dst;
+    pipeline.buffers[0] = copier->buffers;
+    pipeline.buffers[1] = copier->buffers + SFS_COPY_CHUNK;
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.changed, NULL);
+    if (pthread_create(&writer, NULL, pipeline_writer, &pipeline) != 0) {
+        while (next_piece(&cursor, &piece)) {
+            if (!read_piece(src, copier->buffers, &piece) || !write_piece(dst, copier->buffers, &piece)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    for (int turn = 0; next_piece(&cursor, &piece); turn ^= 1) {
+        pthread_mutex_lock(&pipeline.lock);
+        while (pipeline.full[turn] && pipeline.error == 0) {
+            pthread_cond_wait(&pipeline.changed, &pipeline.lock);
+        }
+        bool stop = pipeline.error != 0;
+        pthread_mutex_unlock(&pipeline.lock);
+        if (stop) {
+            break;
+        }
+        bool ok = read_piece(src, pipeline.buffers[turn], &piece);
+        pthread_mutex_lock(&pipeline.lock);
+        if (ok) {
+            pipeline.pieces[turn] = piece;
+            pipeline.full[turn] = true;
+        } else if (pipeline.error == 0) {
+            pipeline.error = errno ? errno : EIO;
+        }
+        pthread_cond_broadcast(&pipeline.changed);
+        pthread_mutex_unlock(&pipeline.lock);
+        if (!ok) {
+            break;
+        }
+    }
+    pthread_mutex_lock(&pipeline.lock);
+    pipeline.finished = true;
+    pthread_cond_broadcast(&pipeline.changed);
+    pthread_mutex_unlock(&pipeline.lock);
+    pthread_join(writer, NULL);
+    pthread_mutex_destroy(&pipeline.lock);
+    pthread_cond_destroy(&pipeline.changed);
+    errno = pipeline.error;
+    return pipeline.error == 0;
+}
+
+bool sfs_copier_init(sfs_copier_t *copier) {
+    copier->ring = NULL;
+    copier->buffers = aligned_alloc(4096, (size_t)SFS_COPY_DEPTH * SFS_COPY_CHUNK);
+    if (copier->buffers == NULL) {
+        perror("Error allocating copy buffers.");
+        return false;
+    }
+    if (getenv("SFS_NO_IO_URING") == NULL) {
+        copier->ring = ring_init(copier->buffers);
+    }
+    return true;
+}
+
+void sfs_copier_free(sfs_copier_t *copier) {
+    if (copier->ring != NULL) {
+        ring_free(copier->ring);
+    }
+    free(copier->buffers);
+    copier->ring = NULL;
+    copier->buffers = NULL;
+}
+
+/*
+ * Copies each segment from src to dst at the given offsets. Both
+ * descriptors must be seekable. On failure errno holds the cause.
+ */
+bool sfs_copy(sfs_copier_t *copier, int src, int dst, const sfs_copy_seg_t *segs, size_t count) {
+    if (copier->buffers == NULL) {
+        errno = ENOMEM;
+        return false;
+    }
+    if (copier->ring != NULL) {
+        return ring_copy(copier, src, dst, segs, count);
+    }
+    return pipeline_copy(copier, src, dst, segs, count);
+}
+
+/*
+ * Copies segments between two places in one file with copy_file_range(),
+ * so the data never passes through user space and file systems that can
+ * share extents may not copy it at all. Where the call is unsupported the
+ * rest goes through sfs_copy().
+ */
+bool sfs_copy_within(sfs_copier_t *copier, int fd, const sfs_copy_seg_t *segs, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        loff_t src_offset = segs[i].src_offset;
+        loff_t dst_offset = segs[i].dst_offset;
+        size_t length = segs[i].length;
+        while (length > 0) {
+            ssize_t copied = copy_file_range(fd, &src_offset, fd, &dst_offset, length, 0);
+            SFS_COUNT(syscalls, 1);
+            if (copied == -1 && errno == EINTR) {
+                continue;
+            }
+            if (copied == -1 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+                sfs_copy_seg_t rest = {src_offset, dst_offset, length};
+                return sfs_copy(copier, fd, fd, &rest, 1) && (i + 1 == count || sfs_copy(copier, fd, fd, segs + i + 1, count - i - 1));
+            }
+            if (copied <= 0) {
+                if (copied == 0) {
+                    errno = EIO;
+                }
+                return false;
+            }
+            SFS_COUNT_IO(false, src_offset - copied, copied);
+            SFS_COUNT_IO(true, dst_offset - copied, copied);
+            length -= copied;
+        }
+    }
+    return true;
+}
+
+const char *sfs_copier_engine(const sfs_copier_t *copier) {
+    if (copier->ring == NULL) {
+        return "pread/pwrite";
+    }
+    return copier->ring->fixed ? "io_uring (registered buffers)" : "io_uring";
+}
@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "sfs.h"
+
+static uint32_t slots_per_block(const sfs_image_t *img) {
+    return img->super_block.block_size / sizeof(dir_entry_t);
+}
+
+static uint32_t *index_blocks(const sfs_dir_index_t *index) {
+    return (uint32_t *)(index + 1);
+}
+
+static uint32_t *index_buckets(const sfs_dir_index_t *index) {
+    return index_blocks(index) + ntohl(index->block_capacity);
+}
+
+static uint32_t *index_next(const sfs_dir_index_t *index) {
+    return index_buckets(index) + ntohl(index->num_buckets);
+}
+
+static uint32_t name_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 30 && name[i] != '\0'; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+uint32_t sfs_index_block(const sfs_dir_iter_t *dir) {
+    if (dir->owner != NULL) {
+        uint32_t block;
+        if ((dir->owner->unused[0] & SFS_FLAG_INDEXED) == 0) {
+            return 0;
+        }
+        memcpy(&block, &dir->owner->unused[2], sizeof(block));
+        return ntohl(block);
+    }
+    const sfs_ext_t *ext = sfs_ext(dir->img);
+    if (ext == NULL || ntohl(ext->magic) != SFS_EXT_MAGIC) {
+        return 0;
+    }
+    return ntohl(ext->root_index_block);
+}
+
+static void set_index_block(sfs_image_t *img, const sfs_dir_iter_t *dir, uint32_t block) {
+    uint32_t stored = htonl(block);
+    if (dir->owner != NULL) {
+        dir->owner->unused[0] = block ? (dir->owner->unused[0] | SFS_FLAG_INDEXED) : (dir->owner->unused[0] & ~SFS_FLAG_INDEXED);
+        memcpy(&dir->owner->unused[2], &stored, sizeof(stored));
+        sfs_mark_dirty(img, dir->owner, sizeof(dir_entry_t));
+        return;
+    }
+    sfs_ext_t *ext = sfs_ext(img);
+    if (ext != NULL) {
+        ext->magic = htonl(SFS_EXT_MAGIC);
+        ext->root_index_block = stored;
+        sfs_mark_dirty(img, ext, sizeof(sfs_ext_t));
+    }
+}
+
+sfs_dir_index_t *sfs_dir_index(const sfs_dir_iter_t *dir) {
+    const sfs_image_t *img = dir->img;
+    uint32_t block = sfs_index_block(dir);
+    if (block == 0 || block >= img->super_block.block_count) {
+        return NULL;
+    }
+    sfs_dir_index_t *index = (sfs_dir_index_t *)sfs_block(img, block);
+    uint32_t capacity = ntohl(index->block_capacity);
+    uint32_t num_buckets = ntohl(index->num_buckets);
+    if (ntohl(index->magic) != SFS_INDEX_MAGIC || ntohl(index->dir_start) != dir->start_block || ntohl(index->dir_blocks) != dir->num_blocks || dir->num_blocks > capacity || num_buckets == 0 || (num_buckets & (num_buckets - 1)) != 0) {
+        return NULL;
+    }
+    uint64_t words = (uint64_t)capacity + num_buckets + (uint64_t)capacity * slots_per_block(img);
+    if ((uint64_t)sfs_block_offset(img, block) + sizeof(sfs_dir_index_t) + words * sizeof(uint32_t) > img->size) {
+        return NULL;
+    }
+    return index;
+}
+
+/* Blocks in the run an index occupies, from its header. */
+uint32_t sfs_index_length(const sfs_image_t *img, const sfs_dir_index_t *index) {
+    uint32_t capacity = ntohl(index->block_capacity);
+    uint64_t bytes = sizeof(sfs_dir_index_t) + sizeof(uint32_t) * ((uint64_t)capacity + ntohl(index->num_buckets) + (uint64_t)capacity * slots_per_block(img));
+    return (bytes + img->super_block.block_size - 1) / img->super_block.block_size;
+}
+
+/* Forgets a directory's index; its blocks are left for the caller. */
+void sfs_index_detach(sfs_image_t *img, const sfs_dir_iter_t *dir) {
+    set_index_block(img, dir, 0);
+}
+
+static dir_entry_t *slot_entry(const sfs_dir_iter_t *dir, const sfs_dir_index_t *index, uint32_t slot) {
+    uint32_t per_block = slots_per_block(dir->img);
+    uint32_t block = ntohl(index_blocks(index)[slot / per_block]);
+    if (block >= dir->img->super_block.block_count) {
+        return NULL;
+    }
+    return (dir_entry_t *)(sfs_block(dir->img, block) + (slot % per_block) * sizeof(dir_entry_t));
+}
+
+dir_entry_t *sfs_index_lookup(const sfs_dir_iter_t *dir, const sfs_dir_index_t *index, const char *name) {
+    uint32_t capacity = ntohl(index->block_capacity) * slots_per_block(dir->img);
+    uint32_t link = ntohl(index_buckets(index)[name_hash(name) & (ntohl(index->num_buckets) - 1)]);
+    char entry_name[32];
+    for (uint32_t steps = 0; link != 0 && link <= capacity && steps < capacity; steps++) {
+        dir_entry_t *entry = slot_entry(dir, index, link - 1);
+        if (entry != NULL && sfs_entry_in_use(entry)) {
+            sfs_entry_name(entry, entry_name);
+            if (strcmp(entry_name, name) == 0) {
+                return entry;
+            }
+        }
+        link = ntohl(index_next(index)[link - 1]);
+    }
+    return NULL;
+}
+
+static void index_insert(sfs_image_t *img, sfs_dir_index_t *index, uint32_t slot, const dir_entry_t *entry) {
+    char name[32];
+    sfs_entry_name(entry, name);
+    uint32_t *bucket = &index_buckets(index)[name_hash(name) & (ntohl(index->num_buckets) - 1)];
+    uint32_t *next = &index_next(index)[slot];
+    *next = *bucket;
+    *bucket = htonl(slot + 1);
+    sfs_mark_dirty(img, bucket, sizeof(uint32_t));
+    sfs_mark_dirty(img, next, sizeof(uint32_t));
+}
+
+/*
+ * (Re)builds the index of a directory in a fresh contiguous run, leaving
+ * room for the directory to double before the next rebuild. The previous
+ * index, if it was valid, is released afterwards.
+ */
+bool sfs_index_build(sfs_allocator_t *alloc, sfs_dir_iter_t *dir, uint32_t min_slots) {
+    sfs_image_t *img = alloc->img;
+    uint32_t per_block = slots_per_block(img);
+    uint32_t block_size = img->super_block.block_size;
+    uint32_t capacity = dir->num_blocks * 2;
+    if ((uint64_t)capacity * per_block < min_slots) {
+        capacity = (min_slots + per_block - 1) / per_block;
+    }
+    uint32_t num_buckets = 1;
+    while (num_buckets < capacity * per_block) {
+        num_buckets <<= 1;
+    }
+    size_t bytes = sizeof(sfs_dir_index_t) + sizeof(uint32_t) * ((size_t)capacity + num_buckets + (size_t)capacity * per_block);
+    uint32_t num_index_blocks = (bytes + block_size - 1) / block_size;
+    uint32_t old_block = (sfs_dir_index(dir) != NULL) ? sfs_index_block(dir) : 0;
+
+    uint32_t start = sfs_allocate_contiguous(alloc, num_index_blocks);
+    if (start == SFS_FAT_EOF) {
+        return false;
+    }
+    sfs_dir_index_t *index = (sfs_dir_index_t *)sfs_block(img, start);
+    memset(index, 0, (size_t)num_index_blocks * block_size);
+    sfs_mark_dirty(img, index, (size_t)num_index_blocks * block_size);
+    index->magic = htonl(SFS_INDEX_MAGIC);
+    index->dir_start = htonl(dir->start_block);
+    index->dir_blocks = htonl(dir->num_blocks);
+    index->block_capacity = htonl(capacity);
+    index->num_buckets = htonl(num_buckets);
+
+    uint32_t block = dir->start_block;
+    for (uint32_t i = 0; i < dir->num_blocks; i++) {
+        if (block >= img->super_block.block_count) {
+            sfs_free_chain(alloc, start);
+            return false;
+        }
+        index_blocks(index)[i] = htonl(block);
+        block = dir->owner ? sfs_fat_get(img, block) : block + 1;
+    }
+
+    uint32_t free_hint = dir->num_blocks * per_block;
+    for (uint32_t slot = 0; slot < dir->num_blocks * per_block; slot++) {
+        dir_entry_t *entry = slot_entry(dir, index, slot);
+        if (sfs_entry_in_use(entry)) {
+            index_insert(img, index, slot, entry);
+        } else if (slot < free_hint) {
+            free_hint = slot;
+        }
+    }
+    index->free_hint = htonl(free_hint);
+
+    set_index_block(img, dir, start);
+    if (old_block != 0) {
+        sfs_free_chain(alloc, old_block);
+    }
+    return true;
+}
+
+/*
+ * Points a directory's index at the contiguous run starting at new_start
+ * that the directory's blocks were copied to. dir still describes the old
+ * location, which is what the index is checked against.
+ */
+void sfs_index_relocate(sfs_image_t *img, const sfs_dir_iter_t *dir, uint32_t new_start) {
+    sfs_dir_index_t *index = sfs_dir_index(dir);
+    if (index == NULL) {
+        return;
+    }
+    index->dir_start = htonl(new_start);
+    for (uint32_t i = 0; i < dir->num_blocks; i++) {
+        index_blocks(index)[i] = htonl(new_start + i);
+    }
+    sfs_mark_dirty(img, index, sizeof(sfs_dir_index_t) + dir->num_blocks * sizeof(uint32_t));
+}
+
+static uint32_t grow_directory(sfs_allocator_t *alloc, sfs_dir_iter_t *dir, uint32_t last_block) {
+    sfs_image_t *img = alloc->img;
+    if (dir->owner == NULL || last_block == SFS_FAT_EOF) {
+        return SFS_FAT_EOF;
+    }
+    uint32_t block = sfs_allocate_chain(alloc, 1);
+    if (block == SFS_FAT_EOF) {
+        return SFS_FAT_EOF;
+    }
+    uint32_t block_size = img->super_block.block_size;
+    memset(sfs_block(img, block), 0, block_size);
+    sfs_mark_dirty(img, sfs_block(img, block), block_size);
+    sfs_fat_set(img, last_block, block);
+    dir->num_blocks++;
+    dir->owner->block_count = htonl(dir->num_blocks);
+    sfs_entry_set_size(dir->owner, (uint64_t)dir->num_blocks * block_size);
+    sfs_mark_dirty(img, dir->owner, sizeof(dir_entry_t));
+    return block;
+}
+
+/*
+ * Stores a copy of entry in the first free slot of the directory and
+ * returns the slot. Indexed directories find the slot from the index's
+ * free hint; others continue the iterator from where the previous insert
+ * left it. Full subdirectories grow by one block; the root cannot grow.
+ * A directory reaching SFS_INDEX_MIN_SLOTS slots gets an index.
+ */
+dir_entry_t *sfs_dir_insert(sfs_allocator_t *alloc, sfs_dir_iter_t *dir, const dir_entry_t *entry) {
+    sfs_image_t *img = alloc->img;
+    uint32_t per_block = slots_per_block(img);
+    sfs_dir_index_t *index = sfs_dir_index(dir);
+    dir_entry_t *slot_ptr = NULL;
+    uint32_t slot = 0;
+
+    if (index != NULL) {
+        uint32_t num_slots = dir->num_blocks * per_block;
+        for (slot = ntohl(index->free_hint); slot < num_slots; slot++) {
+            slot_ptr = slot_entry(dir, index, slot);
+            if (slot_ptr != NULL && !sfs_entry_in_use(slot_ptr)) {
+                break;
+            }
+        }
+        if (slot >= num_slots) {
+            uint32_t block = grow_directory(alloc, dir, ntohl(index_blocks(index)[dir->num_blocks - 1]));
+            if (block == SFS_FAT_EOF) {
+                return NULL;
+            }
+            slot = num_slots;
+            slot_ptr = (dir_entry_t *)sfs_block(img, block);
+            if (dir->num_blocks <= ntohl(index->block_capacity)) {
+                index_blocks(index)[dir->num_blocks - 1] = htonl(block);
+                index->dir_blocks = htonl(dir->num_blocks);
+                sfs_mark_dirty(img, &index_blocks(index)[dir->num_blocks - 1], sizeof(uint32_t));
+            } else {
+                /* The grown directory no longer matches the old index, so the rebuild would not find it to free it. */
+                uint32_t old_block = sfs_index_block(dir);
+                sfs_index_detach(img, dir);
+                index = sfs_index_build(alloc, dir, 0) ? sfs_dir_index(dir) : NULL;
+                sfs_free_chain(alloc, old_block);
+            }
+        }
+    } else {
+        while ((slot_ptr = sfs_dir_next(dir)) != NULL && sfs_entry_in_use(slot_ptr)) {
+        }
+        if (slot_ptr == NULL) {
+            uint32_t block = grow_directory(alloc, dir, dir->last_block);
+            if (block == SFS_FAT_EOF) {
+                return NULL;
+            }
+            dir->block = block;
+            dir->blocks_left = 1;
+            dir->slot = 0;
+            slot_ptr = sfs_dir_next(dir);
+        }
+    }
+
+    memcpy(slot_ptr, entry, sizeof(dir_entry_t));
+    sfs_mark_dirty(img, slot_ptr, sizeof(dir_entry_t));
+    if (index != NULL) {
+        index_insert(img, index, slot, slot_ptr);
+        index->free_hint = htonl(slot + 1);
+        sfs_mark_dirty(img, index, sizeof(sfs_dir_index_t));
+    } else if (dir->num_blocks * per_block >= SFS_INDEX_MIN_SLOTS) {
+        sfs_index_build(alloc, dir, 0);
+    }
+    return slot_ptr;
+}
+
+void sfs_dir_remove(sfs_image_t *img, sfs_dir_iter_t *dir, dir_entry_t *entry) {
+    sfs_dir_index_t *index = sfs_dir_index(dir);
+    if (index != NULL) {
+        char name[32];
+        uint32_t capacity = ntohl(index->block_capacity) * slots_per_block(img);
+        sfs_entry_name(entry, name);
+        uint32_t *link = &index_buckets(index)[name_hash(name) & (ntohl(index->num_buckets) - 1)];
+        for (uint32_t steps = 0; *link != 0 && ntohl(*link) <= capacity && steps < capacity; steps++) {
+            uint32_t slot = ntohl(*link) - 1;
+            if (slot_entry(dir, index, slot) == entry) {
+                *link = index_next(index)[slot];
+                sfs_mark_dirty(img, link, sizeof(uint32_t));
+                if (slot < ntohl(index->free_hint)) {
+                    index->free_hint = htonl(slot);
+                    sfs_mark_dirty(img, index, sizeof(sfs_dir_index_t));
+                }
+                break;
+            }
+            link = &index_next(index)[slot];
+        }
+    }
+    memset(entry, 0, sizeof(dir_entry_t));
+    sfs_mark_dirty(img, entry, sizeof(dir_entry_t));
+}
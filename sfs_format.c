@@ -0,0 +1,390 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "sfs.h"
+
+#define FILL_ENTRIES (64 * 1024)
+#define GROW_MAX_RUNS 8
+
+/* count FAT entries from first on, all set to value. */
+typedef struct {
+    uint32_t first;
+    uint32_t count;
+    uint32_t value;
+} fat_run_t;
+
+/*
+ * The layout sfs_grow() works towards. Blocks the new metadata needs are
+ * taken in order from the space being added, which the old superblock
+ * does not reach, and the FAT entries that change are kept as runs until
+ * it is their turn to be written.
+ */
+typedef struct {
+    sfs_image_t *img;
+    uint32_t block_count;
+    uint32_t fat_start;
+    uint32_t fat_blocks;
+    uint32_t root_dir_start;
+    uint32_t checksum_start;
+    uint32_t checksum_blocks;
+    uint32_t next_block;
+    sfs_census_t census;
+    fat_run_t runs[GROW_MAX_RUNS];
+    int num_runs;
+} grow_t;
+
+static uint32_t fat_blocks_for(uint32_t block_size, uint64_t block_count) {
+    return (block_count * sizeof(uint32_t) + block_size - 1) / block_size;
+}
+
+/* Parses a size in bytes with an optional K, M, G or T suffix. Returns 0 if it is malformed. */
+uint64_t sfs_parse_size(const char *text) {
+    const char *units = "KMGT";
+    char *end;
+    if (!isdigit((unsigned char)text[0])) {
+        return 0;
+    }
+    uint64_t size = strtoull(text, &end, 10);
+    const char *unit = (*end != '\0') ? strchr(units, toupper((unsigned char)*end)) : NULL;
+    if (*end != '\0' && (unit == NULL || end[1] != '\0')) {
+        return 0;
+    }
+    int shift = (unit != NULL) ? 10 * (int)(unit - units + 1) : 0;
+    return (size > UINT64_MAX >> shift) ? 0 : size << shift;
+}
+
+/* Writes count FAT entries of value, from entry first on, to the FAT at fat_offset. */
+static bool fill_fat(int fd, off_t fat_offset, uint32_t first, uint32_t count, uint32_t value) {
+    uint32_t *buffer = malloc(FILL_ENTRIES * sizeof(uint32_t));
+    bool ok = buffer != NULL;
+    for (uint32_t i = 0; ok && i < FILL_ENTRIES; i++) {
+        buffer[i] = htonl(value);
+    }
+    while (ok && count > 0) {
+        uint32_t batch = (count < FILL_ENTRIES) ? count : FILL_ENTRIES;
+        off_t offset = fat_offset + (off_t)first * sizeof(uint32_t);
+        SFS_COUNT_IO(true, offset, batch * sizeof(uint32_t));
+        ok = pwrite(fd, buffer, batch * sizeof(uint32_t), offset) == (ssize_t)(batch * sizeof(uint32_t));
+        first += batch;
+        count -= batch;
+    }
+    free(buffer);
+    return ok;
+}
+
+/* Fills block 0 with super_block, given in host byte order, and a summary in the given state. */
+static void fill_block_zero(uint8_t *block, const superblock_t *super_block, const sfs_census_t *census, uint32_t state) {
+    superblock_t *out = (superblock_t *)block;
+    memcpy(out->fs_id, "CSC360FS", sizeof(out->fs_id));
+    out->block_size = htons(super_block->block_size);
+    out->block_count = htonl(super_block->block_count);
+    out->fat_start = htonl(super_block->fat_start);
+    out->fat_blocks = htonl(super_block->fat_blocks);
+    out->root_dir_start = htonl(super_block->root_dir_start);
+    out->root_dir_blocks = htonl(super_block->root_dir_blocks);
+    if (super_block->block_size < SFS_EXT_OFFSET + sizeof(sfs_ext_t)) {
+        return;
+    }
+    sfs_ext_t *ext = (sfs_ext_t *)(block + SFS_EXT_OFFSET);
+    ext->magic = htonl(SFS_EXT_MAGIC);
+    ext->summary_state = htonl(state);
+    ext->free_blocks = htonl(census->free_blocks);
+    ext->reserved_blocks = htonl(census->reserved_blocks);
+    ext->allocated_blocks = htonl(census->allocated_blocks);
+    ext->summary_check = htonl(sfs_summary_check(super_block, census));
+}
+
+/*
+ * Creates an empty image. The file is sized with ftruncate(), and with
+ * format->preallocate also allocated with fallocate(); either way it reads
+ * back as zeros, which is a free FAT entry and an empty directory slot, so
+ * only block 0 and the FAT entries of the reserved blocks are written.
+ */
+bool sfs_format(const char *path, const sfs_format_t *format) {
+    uint32_t block_size = format->block_size;
+    if (block_size < sizeof(dir_entry_t) || block_size > UINT16_MAX || block_size % sizeof(dir_entry_t) != 0 || format->root_dir_blocks == 0) {
+        fprintf(stderr, "Invalid image parameters.\n");
+        return false;
+    }
+    uint32_t fat_blocks = fat_blocks_for(block_size, format->block_count);
+    uint64_t fat_entries = (uint64_t)fat_blocks * block_size / sizeof(uint32_t);
+    uint64_t reserved = 1 + (uint64_t)fat_blocks + format->root_dir_blocks;
+    if (fat_entries >= SFS_FAT_EOF) {
+        fprintf(stderr, "Too many blocks for a 32-bit FAT.\n");
+        return false;
+    }
+    if (reserved >= format->block_count) {
+        fprintf(stderr, "Block count too small for the FAT and root directory.\n");
+        return false;
+    }
+
+    superblock_t super_block = {.block_size = block_size, .block_count = format->block_count, .fat_start = 1, .fat_blocks = fat_blocks, .root_dir_start = 1 + fat_blocks, .root_dir_blocks = format->root_dir_blocks};
+    sfs_census_t census = {fat_entries - reserved, reserved, 0};
+    off_t size = (off_t)format->block_count * block_size;
+    uint8_t *block = calloc(1, block_size);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    bool ok = block != NULL && fd != -1;
+    if (ok) {
+        fill_block_zero(block, &super_block, &census, SFS_SUMMARY_VALID);
+        SFS_COUNT_IO(true, 0, block_size);
+        ok = ftruncate(fd, size) == 0 && (!format->preallocate || fallocate(fd, 0, 0, size) == 0) && fill_fat(fd, block_size, 0, reserved, SFS_FAT_RESERVED) && pwrite(fd, block, block_size, 0) == block_size && fdatasync(fd) == 0;
+    }
+    if (!ok) {
+        perror("Error creating file system image.");
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    free(block);
+    return ok;
+}
+
+static void recount(sfs_census_t *census, uint32_t value, int delta) {
+    if (value == SFS_FAT_FREE) {
+        census->free_blocks += delta;
+    } else if (value == SFS_FAT_RESERVED) {
+        census->reserved_blocks += delta;
+    } else {
+        census->allocated_blocks += delta;
+    }
+}
+
+static void add_run(grow_t *grow, uint32_t first, uint32_t count, uint32_t value) {
+    const sfs_image_t *img = grow->img;
+    for (uint32_t block = first; block < first + count; block++) {
+        recount(&grow->census, (block < img->fat_entries) ? ntohl(img->fat[block]) : SFS_FAT_FREE, -1);
+        recount(&grow->census, value, 1);
+    }
+    grow->runs[grow->num_runs++] = (fat_run_t){first, count, value};
+}
+
+/* Takes blocks from the space being added, or returns SFS_FAT_EOF if it is used up. */
+static uint32_t claim(grow_t *grow, uint32_t blocks) {
+    uint32_t start = grow->next_block;
+    if ((uint64_t)start + blocks > grow->block_count) {
+        return SFS_FAT_EOF;
+    }
+    grow->next_block += blocks;
+    return start;
+}
+
+/*
+ * Decides where everything goes. The FAT grows over the blocks after it
+ * when they are free or hold only the root directory, which then moves
+ * into the new space; anything else there and the whole FAT moves there
+ * instead. A checksum area too small for the new size is replaced too.
+ */
+static bool plan_grow(sfs_image_t *img, uint64_t block_count, grow_t *grow) {
+    const superblock_t *sb = &img->super_block;
+    uint32_t fat_blocks = fat_blocks_for(sb->block_size, block_count);
+    uint32_t fat_end = sb->fat_start + sb->fat_blocks;
+    uint32_t root_end = sb->root_dir_start + sb->root_dir_blocks;
+    memset(grow, 0, sizeof(grow_t));
+    if (block_count <= sb->block_count) {
+        fprintf(stderr, "The image already has %u blocks; it can only grow.\n", sb->block_count);
+        return false;
+    }
+    if ((uint64_t)fat_blocks * sb->block_size / sizeof(uint32_t) >= SFS_FAT_EOF) {
+        fprintf(stderr, "Too many blocks for a 32-bit FAT.\n");
+        return false;
+    }
+    grow->img = img;
+    grow->block_count = block_count;
+    grow->fat_start = sb->fat_start;
+    grow->fat_blocks = (fat_blocks > sb->fat_blocks) ? fat_blocks : sb->fat_blocks;
+    grow->root_dir_start = sb->root_dir_start;
+    grow->next_block = sb->block_count;
+    if (img->summary_known) {
+        grow->census = img->summary;
+    } else {
+        sfs_fat_census(img->fat, img->fat_entries, &grow->census);
+    }
+    grow->census.free_blocks += (uint64_t)grow->fat_blocks * sb->block_size / sizeof(uint32_t) - img->fat_entries;
+
+    bool moved = false;
+    if (fat_blocks > sb->fat_blocks) {
+        uint32_t grown_end = sb->fat_start + fat_blocks;
+        bool in_place = true;
+        for (uint32_t block = fat_end; in_place && block < grown_end && block < sb->block_count; block++) {
+            bool in_root = block >= sb->root_dir_start && block < root_end;
+            moved = moved || in_root;
+            in_place = in_root || block >= img->fat_entries || img->fat[block] == SFS_FAT_FREE;
+        }
+        if (in_place) {
+            grow->next_block = (grown_end > grow->next_block) ? grown_end : grow->next_block;
+            add_run(grow, fat_end, fat_blocks - sb->fat_blocks, SFS_FAT_RESERVED);
+        } else {
+            moved = false;
+            grow->fat_start = claim(grow, fat_blocks);
+            if (grow->fat_start == SFS_FAT_EOF) {
+                fprintf(stderr, "Grow by at least %u blocks to make room for the FAT.\n", fat_blocks);
+                return false;
+            }
+            add_run(grow, grow->fat_start, fat_blocks, SFS_FAT_RESERVED);
+            add_run(grow, sb->fat_start, sb->fat_blocks, SFS_FAT_FREE);
+        }
+        if (moved) {
+            grow->root_dir_start = claim(grow, sb->root_dir_blocks);
+            if (grow->root_dir_start == SFS_FAT_EOF) {
+                fprintf(stderr, "Grow by more blocks to make room for the root directory.\n");
+                return false;
+            }
+            add_run(grow, grow->root_dir_start, sb->root_dir_blocks, SFS_FAT_RESERVED);
+            if (root_end > grown_end) {
+                add_run(grow, grown_end, root_end - grown_end, SFS_FAT_FREE);
+            }
+        }
+    }
+
+    const sfs_ext_t *ext = sfs_ext(img);
+    if (img->checksums != NULL) {
+        uint32_t needed = fat_blocks_for(sb->block_size, block_count);
+        grow->checksum_start = ntohl(ext->checksum_start);
+        grow->checksum_blocks = ntohl(ext->checksum_blocks);
+        if (needed > grow->checksum_blocks) {
+            uint32_t start = claim(grow, needed);
+            if (start == SFS_FAT_EOF) {
+                fprintf(stderr, "Grow by more blocks to make room for the block checksums.\n");
+                return false;
+            }
+            add_run(grow, start, needed, SFS_FAT_RESERVED);
+            add_run(grow, grow->checksum_start, grow->checksum_blocks, SFS_FAT_FREE);
+            grow->checksum_start = start;
+            grow->checksum_blocks = needed;
+        }
+    }
+    return true;
+}
+
+static bool write_runs(const grow_t *grow, off_t fat_offset) {
+    for (int i = 0; i < grow->num_runs; i++) {
+        const fat_run_t *run = &grow->runs[i];
+        if (!fill_fat(grow->img->fd, fat_offset, run->first, run->count, run->value)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Writes block 0 for the grown image and syncs it. The interim version
+ * keeps the old FAT, so it can go out before the FAT is extended over
+ * blocks the old root directory used; its summary is marked dirty.
+ */
+static bool write_block_zero(const grow_t *grow, bool final) {
+    const sfs_image_t *img = grow->img;
+    superblock_t super_block = img->super_block;
+    uint32_t block_size = super_block.block_size;
+    uint8_t *block = malloc(block_size);
+    if (block == NULL) {
+        return false;
+    }
+    memcpy(block, img->base, block_size);
+    super_block.block_count = grow->block_count;
+    super_block.root_dir_start = grow->root_dir_start;
+    if (final) {
+        super_block.fat_start = grow->fat_start;
+        super_block.fat_blocks = grow->fat_blocks;
+    }
+    fill_block_zero(block, &super_block, &grow->census, final ? SFS_SUMMARY_VALID : SFS_SUMMARY_DIRTY);
+    if (grow->checksum_blocks != 0) {
+        sfs_ext_t *ext = (sfs_ext_t *)(block + SFS_EXT_OFFSET);
+        ext->checksum_start = htonl(grow->checksum_start);
+        ext->checksum_blocks = htonl(grow->checksum_blocks);
+    }
+    SFS_COUNT_IO(true, 0, block_size);
+    bool ok = pwrite(img->fd, block, block_size, 0) == block_size && fdatasync(img->fd) == 0;
+    free(block);
+    return ok;
+}
+
+static bool write_back(const sfs_image_t *img, const void *address, size_t length) {
+    off_t offset = (const uint8_t *)address - img->base;
+    SFS_COUNT_IO(true, offset, length);
+    return pwrite(img->fd, address, length, offset) == (ssize_t)length;
+}
+
+/* Points the root's index and the ".." entries below it, where there are any, at its new place. */
+static bool relink_root(sfs_image_t *img, uint32_t new_start) {
+    sfs_dir_iter_t root;
+    sfs_dir_iter_t child;
+    dir_entry_t *entry;
+    char name[32];
+    bool ok = true;
+    sfs_dir_open_root(img, &root);
+    sfs_dir_index_t *index = sfs_dir_index(&root);
+    if (index != NULL) {
+        sfs_index_relocate(img, &root, new_start);
+        ok = write_back(img, index, sizeof(sfs_dir_index_t) + (size_t)root.num_blocks * sizeof(uint32_t));
+    }
+    while (ok && (entry = sfs_dir_next(&root)) != NULL) {
+        sfs_entry_name(entry, name);
+        if (!sfs_entry_in_use(entry) || !sfs_entry_is_dir(entry) || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+        sfs_dir_open(img, entry, &child);
+        dir_entry_t *link = sfs_find_entry(&child, "..");
+        if (link != NULL && sfs_entry_is_dir(link) && ntohl(link->starting_block) == root.start_block) {
+            link->starting_block = htonl(new_start);
+            ok = write_back(img, link, sizeof(dir_entry_t));
+        }
+    }
+    return ok;
+}
+
+/*
+ * Grows the image at path to size bytes in place. Whatever the new layout
+ * needs is written into the added space first, where the old superblock
+ * does not look, and block 0 is switched last. When the FAT grows over
+ * the old root directory, an interim block 0 moves the root first, so a
+ * crash at any point leaves an image that opens; at worst the new blocks
+ * are not yet in the FAT.
+ */
+bool sfs_grow(const char *path, uint64_t size) {
+    sfs_image_t img;
+    sfs_copier_t copier;
+    grow_t grow;
+    if (!sfs_open(path, true, &img)) {
+        return false;
+    }
+    const superblock_t *sb = &img.super_block;
+    if (!plan_grow(&img, size / sb->block_size, &grow) || !sfs_copier_init(&copier)) {
+        sfs_close(&img);
+        return false;
+    }
+    bool in_place = grow.fat_start == sb->fat_start;
+    off_t fat_offset = sfs_block_offset(&img, grow.fat_start);
+    off_t new_size = (off_t)grow.block_count * sb->block_size;
+    sfs_copy_seg_t segs[3];
+    size_t num_segs = 0;
+    if (grow.root_dir_start != sb->root_dir_start) {
+        segs[num_segs++] = (sfs_copy_seg_t){sfs_block_offset(&img, sb->root_dir_start), sfs_block_offset(&img, grow.root_dir_start), (size_t)sb->root_dir_blocks * sb->block_size};
+    }
+    if (img.checksums != NULL && grow.checksum_start != ntohl(sfs_ext(&img)->checksum_start)) {
+        segs[num_segs++] = (sfs_copy_seg_t){(const uint8_t *)img.checksums - img.base, sfs_block_offset(&img, grow.checksum_start), (size_t)sb->block_count * sizeof(uint32_t)};
+    }
+    if (!in_place) {
+        segs[num_segs++] = (sfs_copy_seg_t){sfs_block_offset(&img, sb->fat_start), fat_offset, (size_t)sb->fat_blocks * sb->block_size};
+    }
+
+    /* Anything past the old last block is cut off first, so the added space reads as zeros. */
+    bool ok = ftruncate(img.fd, (off_t)sb->block_count * sb->block_size) == 0 && ftruncate(img.fd, new_size) == 0 && sfs_copy_within(&copier, img.fd, segs, num_segs) && (in_place || write_runs(&grow, fat_offset)) && fdatasync(img.fd) == 0;
+    if (ok && in_place && grow.num_runs > 0) {
+        uint32_t fat_end = sb->fat_start + sb->fat_blocks;
+        uint32_t zero_end = (grow.fat_start + grow.fat_blocks < sb->block_count) ? grow.fat_start + grow.fat_blocks : sb->block_count;
+        uint32_t stale = (zero_end > fat_end) ? (zero_end - fat_end) * (sb->block_size / sizeof(uint32_t)) : 0;
+        ok = write_block_zero(&grow, false) && (grow.root_dir_start == sb->root_dir_start || relink_root(&img, grow.root_dir_start)) && fill_fat(img.fd, fat_offset, img.fat_entries, stale, SFS_FAT_FREE) && write_runs(&grow, fat_offset) && fdatasync(img.fd) == 0;
+    }
+    ok = ok && write_block_zero(&grow, true);
+    if (!ok) {
+        perror("Error growing file system image.");
+    }
+    sfs_copier_free(&copier);
+    sfs_close(&img);
+    return ok;
+}
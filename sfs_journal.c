@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "sfs.h"
+
+#define JOURNAL_FRACTION 64
+
+static uint32_t checksum(uint32_t hash, const void *data, size_t length) {
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t descriptor_blocks(const sfs_image_t *img, uint32_t count) {
+    uint32_t block_size = img->super_block.block_size;
+    return (sizeof(sfs_txn_header_t) + (uint64_t)count * sizeof(uint32_t) + block_size - 1) / block_size;
+}
+
+bool sfs_journal_fits(const sfs_image_t *img, uint32_t count) {
+    return (uint64_t)descriptor_blocks(img, count) + count < img->journal_blocks;
+}
+
+/*
+ * Returns the length in blocks of the transaction at head if it is intact
+ * and carries the expected sequence, or 0. The first transaction of a log
+ * may be newer than the header says: a checkpoint's header write is not
+ * ordered against the commit that follows it.
+ */
+static uint32_t valid_txn(const sfs_image_t *img, uint32_t head, uint32_t sequence, bool first) {
+    uint32_t block_size = img->super_block.block_size;
+    if (head >= img->journal_blocks) {
+        return 0;
+    }
+    const sfs_txn_header_t *txn = (const sfs_txn_header_t *)sfs_block(img, img->journal_start + head);
+    uint32_t count = ntohl(txn->count);
+    uint32_t txn_sequence = ntohl(txn->sequence);
+    if (ntohl(txn->magic) != SFS_TXN_MAGIC || count == 0 || count >= img->journal_blocks || (first ? txn_sequence < sequence : txn_sequence != sequence)) {
+        return 0;
+    }
+    uint32_t length = descriptor_blocks(img, count) + count;
+    if ((uint64_t)head + length > img->journal_blocks) {
+        return 0;
+    }
+    const uint32_t *blocks = (const uint32_t *)(txn + 1);
+    for (uint32_t i = 0; i < count; i++) {
+        if (ntohl(blocks[i]) >= img->super_block.block_count) {
+            return 0;
+        }
+    }
+    sfs_txn_header_t header = *txn;
+    header.checksum = 0;
+    uint32_t hash = checksum(2166136261u, &header, sizeof(header));
+    hash = checksum(hash, blocks, (size_t)count * sizeof(uint32_t));
+    hash = checksum(hash, sfs_block(img, img->journal_start + head + length - count), (size_t)count * block_size);
+    return (hash == ntohl(txn->checksum)) ? length : 0;
+}
+
+static bool map_private(sfs_image_t *img) {
+    uint8_t *base = mmap(NULL, img->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, img->fd, 0);
+    if (base == MAP_FAILED) {
+        perror("Error mapping file system image.");
+        return false;
+    }
+    munmap(img->base, img->size);
+    img->base = base;
+    return true;
+}
+
+/*
+ * Finds the journal and replays whatever it still holds. A writable image
+ * gets the blocks written back in place and the log emptied; a read-only
+ * one is remapped privately so the replay only lives in memory.
+ */
+bool sfs_journal_open(sfs_image_t *img) {
+    const sfs_ext_t *ext = sfs_ext(img);
+    uint32_t block_size = img->super_block.block_size;
+    img->journal_blocks = 0;
+    if (ext == NULL || ntohl(ext->magic) != SFS_EXT_MAGIC) {
+        return true;
+    }
+    uint32_t start = ntohl(ext->journal_start);
+    uint32_t blocks = ntohl(ext->journal_blocks);
+    if (start == 0 || blocks < 2 || (uint64_t)start + blocks > img->super_block.block_count) {
+        return true;
+    }
+    const sfs_journal_header_t *header = (const sfs_journal_header_t *)sfs_block(img, start);
+    if (ntohl(header->magic) != SFS_JOURNAL_MAGIC) {
+        return true;
+    }
+    img->journal_start = start;
+    img->journal_blocks = blocks;
+    img->journal_sequence = ntohl(header->sequence);
+    img->journal_head = 1;
+    uint32_t length = valid_txn(img, 1, img->journal_sequence, true);
+    if (length == 0) {
+        return true;
+    }
+    if (!img->writable && !map_private(img)) {
+        return false;
+    }
+
+    uint32_t replayed = 0;
+    uint64_t phase SFS_PHASE_SCOPED = SFS_PHASE_BEGIN();
+    while (length > 0) {
+        const sfs_txn_header_t *txn = (const sfs_txn_header_t *)sfs_block(img, img->journal_start + img->journal_head);
+        const uint32_t *txn_blocks = (const uint32_t *)(txn + 1);
+        uint32_t count = ntohl(txn->count);
+        const uint8_t *data = sfs_block(img, img->journal_start + img->journal_head + length - count);
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t block = ntohl(txn_blocks[i]);
+            memcpy(sfs_block(img, block), data + (size_t)i * block_size, block_size);
+            if (!img->writable) {
+                continue;
+            }
+            SFS_COUNT_IO(true, sfs_block_offset(img, block), block_size);
+            if (pwrite(img->fd, data + (size_t)i * block_size, block_size, sfs_block_offset(img, block)) != block_size) {
+                perror("Error replaying journal.");
+                return false;
+            }
+        }
+        img->journal_sequence = ntohl(txn->sequence) + 1;
+        img->journal_head += length;
+        replayed++;
+        length = valid_txn(img, img->journal_head, img->journal_sequence, false);
+    }
+    SFS_PHASE_END(SFS_PHASE_FLUSH, phase);
+    if (!img->writable) {
+        return true;
+    }
+    fprintf(stderr, "Recovered %u metadata transactions from the journal.\n", replayed);
+    return sfs_journal_checkpoint(img, true);
+}
+
+/*
+ * Reserves a contiguous run for the journal, about 1/64 of the image up
+ * to SFS_JOURNAL_MAX_BYTES, and makes it known with one unjournaled flush.
+ * Images too full to spare the run carry on without one.
+ */
+bool sfs_journal_create(sfs_allocator_t *alloc) {
+    sfs_image_t *img = alloc->img;
+    sfs_ext_t *ext = sfs_ext(img);
+    uint32_t block_size = img->super_block.block_size;
+    if (img->journal_blocks != 0) {
+        return true;
+    }
+    uint32_t blocks = img->super_block.block_count / JOURNAL_FRACTION;
+    if (blocks > SFS_JOURNAL_MAX_BYTES / block_size) {
+        blocks = SFS_JOURNAL_MAX_BYTES / block_size;
+    }
+    if (blocks < SFS_JOURNAL_MIN_BLOCKS) {
+        blocks = SFS_JOURNAL_MIN_BLOCKS;
+    }
+    if (ext == NULL || !img->writable || blocks > alloc->free_count / 4) {
+        return false;
+    }
+    uint32_t start = sfs_find_contiguous(alloc, blocks, alloc->entries);
+    if (start == SFS_FAT_EOF) {
+        return false;
+    }
+
+    uint8_t *first = calloc(2, block_size);
+    if (first == NULL) {
+        return false;
+    }
+    sfs_journal_header_t *header = (sfs_journal_header_t *)first;
+    header->magic = htonl(SFS_JOURNAL_MAGIC);
+    header->sequence = htonl(1);
+    SFS_COUNT_IO(true, sfs_block_offset(img, start), 2 * block_size);
+    bool ok = pwrite(img->fd, first, 2 * block_size, sfs_block_offset(img, start)) == 2 * block_size;
+    free(first);
+    if (!ok) {
+        perror("Error creating journal.");
+        return false;
+    }
+
+    sfs_claim_contiguous(alloc, start, blocks);
+    for (uint32_t i = 0; i < blocks; i++) {
+        sfs_fat_set(img, start + i, SFS_FAT_RESERVED);
+    }
+    ext->magic = htonl(SFS_EXT_MAGIC);
+    ext->journal_start = htonl(start);
+    ext->journal_blocks = htonl(blocks);
+    sfs_mark_dirty(img, ext, sizeof(sfs_ext_t));
+    if (!sfs_flush(img) || fdatasync(img->fd) == -1) {
+        return false;
+    }
+    img->journal_start = start;
+    img->journal_blocks = blocks;
+    img->journal_head = 1;
+    img->journal_sequence = 1;
+    return true;
+}
+
+/* Appends one transaction to the log and commits it with one fdatasync(). */
+bool sfs_journal_write(sfs_image_t *img, const sfs_txn_t *txn) {
+    uint32_t block_size = img->super_block.block_size;
+    uint32_t header_blocks = descriptor_blocks(img, txn->count);
+    uint32_t length = header_blocks + txn->count;
+    if (img->journal_head + length > img->journal_blocks && !sfs_journal_checkpoint(img, false)) {
+        return false;
+    }
+
+    sfs_txn_header_t *header = calloc(header_blocks, block_size);
+    if (header == NULL) {
+        perror("Error allocating journal buffer.");
+        return false;
+    }
+    uint32_t *blocks = (uint32_t *)(header + 1);
+    header->magic = htonl(SFS_TXN_MAGIC);
+    header->sequence = htonl(img->journal_sequence);
+    header->count = htonl(txn->count);
+    for (uint32_t i = 0; i < txn->count; i++) {
+        blocks[i] = htonl(txn->blocks[i]);
+    }
+    uint32_t hash = checksum(2166136261u, header, sizeof(sfs_txn_header_t) + (size_t)txn->count * sizeof(uint32_t));
+    header->checksum = htonl(checksum(hash, txn->data, (size_t)txn->count * block_size));
+
+    struct iovec iov[2] = {{header, (size_t)header_blocks * block_size}, {txn->data, (size_t)txn->count * block_size}};
+    off_t offset = sfs_block_offset(img, img->journal_start + img->journal_head);
+    ssize_t expected = (ssize_t)length * block_size;
+    SFS_COUNT_IO(true, offset, expected);
+    SFS_COUNT(syscalls, 1);
+    bool ok = pwritev(img->fd, iov, 2, offset) == expected && fdatasync(img->fd) == 0;
+    free(header);
+    if (!ok) {
+        perror("Error writing journal.");
+        return false;
+    }
+    img->journal_head += length;
+    img->journal_sequence++;
+    return true;
+}
+
+/*
+ * Empties the log once the blocks it covers are safely in place. The new
+ * header only has to be durable before blocks are written outside the
+ * journal; replaying a log whose blocks already landed changes nothing.
+ */
+bool sfs_journal_checkpoint(sfs_image_t *img, bool durable) {
+    if (img->journal_blocks == 0 || img->journal_head <= 1) {
+        return true;
+    }
+    sfs_journal_header_t header = {htonl(SFS_JOURNAL_MAGIC), htonl(img->journal_sequence)};
+    off_t offset = sfs_block_offset(img, img->journal_start);
+    SFS_COUNT_IO(true, offset, sizeof(header));
+    SFS_COUNT(syscalls, durable ? 2 : 1);
+    bool ok = fdatasync(img->fd) == 0 && pwrite(img->fd, &header, sizeof(header), offset) == sizeof(header) && (!durable || fdatasync(img->fd) == 0);
+    if (!ok) {
+        perror("Error checkpointing journal.");
+        return false;
+    }
+    img->journal_head = 1;
+    return true;
+}
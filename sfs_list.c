@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "sfs.h"
+
+typedef struct {
+    sfs_dir_iter_t dir;
+    char *path;
+    uint32_t depth;
+} list_dir_t;
+
+/*
+ * A listing in progress. The dirs array is the work queue: next_dir is
+ * its head, and a worker holds busy until it has queued the
+ * subdirectories of the directory it took.
+ */
+typedef struct {
+    const sfs_list_opts_t *opts;
+    FILE *out;
+    list_dir_t *dirs;
+    size_t num_dirs;
+    size_t capacity;
+    size_t next_dir;
+    uint32_t busy;
+    bool failed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} list_job_t;
+
+static uint64_t parse_time(const char *text) {
+    unsigned year, month, day, hour = 0, minute = 0, second = 0;
+    int fields = sscanf(text, "%u/%u/%u %u:%u:%u", &year, &month, &day, &hour, &minute, &second);
+    if ((fields != 3 && fields != 6) || month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 59) {
+        return 0;
+    }
+    return ((((uint64_t)year * 100 + month) * 100 + day) * 100 + hour) * 10000 + minute * 100 + second;
+}
+
+static uint64_t entry_time(const dir_entry_t *entry) {
+    const dir_entry_timedate_t *t = &entry->modify_time;
+    return ((((uint64_t)ntohs(t->year) * 100 + t->month) * 100 + t->day) * 100 + t->hour) * 10000 + t->minute * 100 + t->second;
+}
+
+/*
+ * Reads disklist's options from the front of argv: -R, -j <threads> (0
+ * for one per CPU), -n <glob>, -s <min:max> (either bound may be left
+ * out) and -t <YYYY/MM/DD[ hh:mm:ss]>. Returns how many arguments they
+ * took, or -1 if one is malformed.
+ */
+int sfs_list_args(int argc, char *argv[], sfs_list_opts_t *opts) {
+    memset(opts, 0, sizeof(sfs_list_opts_t));
+    opts->threads = 1;
+    opts->max_size = UINT64_MAX;
+    int i = 0;
+    while (i < argc && argv[i][0] == '-' && argv[i][1] != '\0') {
+        const char *option = argv[i++];
+        if (strcmp(option, "-R") == 0) {
+            opts->recursive = true;
+            continue;
+        }
+        if (i == argc) {
+            return -1;
+        }
+        char *value = argv[i++];
+        char *end;
+        if (strcmp(option, "-j") == 0) {
+            long threads = strtol(value, &end, 10);
+            if (*end != '\0' || threads < 0) {
+                return -1;
+            }
+            if (threads == 0) {
+                threads = sysconf(_SC_NPROCESSORS_ONLN);
+            }
+            opts->threads = (threads < 1) ? 1 : (threads > SFS_LIST_MAX_THREADS) ? SFS_LIST_MAX_THREADS : threads;
+        } else if (strcmp(option, "-n") == 0) {
+            opts->name = value;
+        } else if (strcmp(option, "-s") == 0) {
+            char *colon = strchr(value, ':');
+            if (colon == NULL) {
+                return -1;
+            }
+            opts->min_size = (colon == value) ? 0 : strtoull(value, &end, 10);
+            if (colon != value && end != colon) {
+                return -1;
+            }
+            opts->max_size = (colon[1] == '\0') ? UINT64_MAX : strtoull(colon + 1, &end, 10);
+            if ((colon[1] != '\0' && *end != '\0') || opts->min_size > opts->max_size) {
+                return -1;
+            }
+        } else if (strcmp(option, "-t") == 0) {
+            opts->since = parse_time(value);
+            if (opts->since == 0) {
+                return -1;
+            }
+        } else {
+            return -1;
+        }
+    }
+    return i;
+}
+
+static bool filtered(const sfs_list_opts_t *opts) {
+    return opts->name != NULL || opts->min_size > 0 || opts->max_size < UINT64_MAX || opts->since != 0;
+}
+
+static bool matches(const sfs_list_opts_t *opts, const dir_entry_t *entry, const char *name) {
+    uint64_t size = sfs_entry_size(entry);
+    if (size < opts->min_size || size > opts->max_size) {
+        return false;
+    }
+    if (opts->since != 0 && entry_time(entry) < opts->since) {
+        return false;
+    }
+    return opts->name == NULL || fnmatch(opts->name, name, 0) == 0;
+}
+
+/* Called with the job locked. */
+static bool queue_dir(list_job_t *job, const sfs_dir_iter_t *dir, char *path, uint32_t depth) {
+    if (job->num_dirs == job->capacity) {
+        size_t capacity = job->capacity ? job->capacity * 2 : 256;
+        list_dir_t *grown = realloc(job->dirs, capacity * sizeof(list_dir_t));
+        if (grown == NULL) {
+            return false;
+        }
+        job->dirs = grown;
+        job->capacity = capacity;
+    }
+    list_dir_t *item = &job->dirs[job->num_dirs++];
+    item->dir = *dir;
+    item->path = path;
+    item->depth = depth;
+    return true;
+}
+
+static char *child_path(const char *parent, const char *name) {
+    size_t length = strlen(parent);
+    char *path = malloc(length + strlen(name) + 2);
+    if (path != NULL) {
+        sprintf(path, (length > 0 && parent[length - 1] == '/') ? "%s%s" : "%s/%s", parent, name);
+    }
+    return path;
+}
+
+/*
+ * Formats one directory into a buffer of its own, so a directory's lines
+ * reach the output together whichever thread listed it, and collects
+ * its subdirectories for the queue.
+ */
+static bool list_directory(list_job_t *job, list_dir_t *item, char **text, size_t *length, list_dir_t **children, size_t *num_children) {
+    const sfs_list_opts_t *opts = job->opts;
+    const sfs_image_t *img = item->dir.img;
+    size_t capacity = 0;
+    dir_entry_t *entry;
+    char name[32];
+    uint32_t printed = 0;
+    FILE *out = open_memstream(text, length);
+    if (out == NULL) {
+        return false;
+    }
+    if (opts->recursive) {
+        fprintf(out, "%s:\n", item->path);
+        sfs_dir_readahead(&item->dir);
+        sfs_dir_prefetch_children(&item->dir);
+    } else {
+        sfs_dir_readahead(&item->dir);
+    }
+    bool ok = true;
+    while (ok && (entry = sfs_dir_next(&item->dir)) != NULL) {
+        if (!sfs_entry_in_use(entry)) {
+            continue;
+        }
+        sfs_entry_name(entry, name);
+        if (matches(opts, entry, name)) {
+            sfs_print_entry(out, img, entry);
+            printed++;
+        }
+        if (!opts->recursive || !sfs_entry_is_dir(entry) || name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+        if (item->depth >= SFS_LIST_MAX_DEPTH) {
+            fprintf(stderr, "%s/%s: Directory tree too deep.\n", item->path, name);
+            continue;
+        }
+        if (*num_children == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            list_dir_t *grown = realloc(*children, capacity * sizeof(list_dir_t));
+            ok = grown != NULL;
+            *children = ok ? grown : *children;
+        }
+        if (ok) {
+            list_dir_t *child = &(*children)[*num_children];
+            sfs_dir_open(img, entry, &child->dir);
+            child->path = child_path(item->path, name);
+            child->depth = item->depth + 1;
+            ok = child->path != NULL;
+            *num_children += ok;
+        }
+    }
+    if (opts->recursive) {
+        fprintf(out, "\n");
+    }
+    fclose(out);
+    if (printed == 0 && filtered(opts)) {
+        *length = 0;
+    }
+    return ok;
+}
+
+static void *list_worker(void *arg) {
+    list_job_t *job = arg;
+    list_dir_t *children = NULL;
+    pthread_mutex_lock(&job->lock);
+    for (;;) {
+        while (job->next_dir == job->num_dirs && job->busy > 0 && !job->failed) {
+            pthread_cond_wait(&job->changed, &job->lock);
+        }
+        if (job->next_dir == job->num_dirs || job->failed) {
+            break;
+        }
+        list_dir_t item = job->dirs[job->next_dir++];
+        job->busy++;
+        pthread_mutex_unlock(&job->lock);
+
+        char *text = NULL;
+        size_t length = 0;
+        size_t num_children = 0;
+        bool ok = list_directory(job, &item, &text, &length, &children, &num_children);
+
+        pthread_mutex_lock(&job->lock);
+        for (size_t i = 0; i < num_children; i++) {
+            if (!ok || !queue_dir(job, &children[i].dir, children[i].path, children[i].depth)) {
+                free(children[i].path);
+                ok = false;
+            }
+        }
+        if (length > 0) {
+            fwrite(text, 1, length, job->out);
+        }
+        job->failed = job->failed || !ok;
+        job->busy--;
+        pthread_cond_broadcast(&job->changed);
+        free(text);
+        free(item.path);
+    }
+    pthread_mutex_unlock(&job->lock);
+    free(children);
+    return NULL;
+}
+
+/*
+ * Lists dir, or with opts->recursive everything below it breadth first,
+ * to out. Directories are taken off one queue by opts->threads workers;
+ * with more than one, sibling directories may come out in any order.
+ */
+bool sfs_list_tree(FILE *out, const sfs_dir_iter_t *dir, const char *path, const sfs_list_opts_t *opts) {
+    list_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.opts = opts;
+    job.out = out;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.changed, NULL);
+    char *root_path = strdup(path);
+    if (root_path == NULL || !queue_dir(&job, dir, root_path, 0)) {
+        free(root_path);
+        perror("Error allocating memory for the listing.");
+        return false;
+    }
+    sfs_dir_rewind(&job.dirs[0].dir);
+
+    uint64_t phase SFS_PHASE_SCOPED = SFS_PHASE_BEGIN();
+    pthread_t threads[SFS_LIST_MAX_THREADS];
+    uint32_t started = 0;
+    for (uint32_t i = 1; opts->recursive && i < opts->threads; i++) {
+        if (pthread_create(&threads[started], NULL, list_worker, &job) == 0) {
+            started++;
+        }
+    }
+    list_worker(&job);
+    for (uint32_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    SFS_PHASE_END(SFS_PHASE_PATH, phase);
+
+    for (size_t i = job.next_dir; i < job.num_dirs; i++) {
+        free(job.dirs[i].path);
+    }
+    free(job.dirs);
+    pthread_cond_destroy(&job.changed);
+    pthread_mutex_destroy(&job.lock);
+    if (job.failed) {
+        perror("Error allocating memory for the listing.");
+    }
+    return !job.failed;
+}
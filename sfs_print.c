@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <arpa/inet.h>
+#include "sfs.h"
+
+void sfs_print_super_block(FILE *out, const superblock_t *super_block) {
+    fprintf(out, "Super block information\n");
+    fprintf(out, "Block size: %u\n", super_block->block_size);
+    fprintf(out, "Block count: %u\n", super_block->block_count);
+    fprintf(out, "FAT starts: %u\n", super_block->fat_start);
+    fprintf(out, "FAT blocks: %u\n", super_block->fat_blocks);
+    fprintf(out, "Root directory starts: %u\n", super_block->root_dir_start);
+    fprintf(out, "Root directory blocks: %u\n", super_block->root_dir_blocks);
+}
+
+void sfs_print_fat_info(FILE *out, const sfs_census_t *census) {
+    fprintf(out, "FAT information\n");
+    fprintf(out, "Free blocks: %u\n", census->free_blocks);
+    fprintf(out, "Reserved blocks: %u\n", census->reserved_blocks);
+    fprintf(out, "Allocated blocks: %u\n", census->allocated_blocks);
+}
+
+void sfs_print_info(FILE *out, const sfs_image_t *img) {
+    sfs_census_t census;
+    sfs_print_super_block(out, &img->super_block);
+    uint64_t phase SFS_PHASE_SCOPED = SFS_PHASE_BEGIN();
+    if (!sfs_read_summary(img, &census)) {
+        sfs_fat_census(img->fat, img->fat_entries, &census);
+    }
+    SFS_PHASE_END(SFS_PHASE_FAT, phase);
+    fprintf(out, "\n");
+    sfs_print_fat_info(out, &census);
+}
+
+/* Compressed files get their stored size after the date. */
+void sfs_print_entry(FILE *out, const sfs_image_t *img, const dir_entry_t *entry) {
+    char name[32];
+    sfs_entry_name(entry, name);
+    fprintf(out, "%c %10llu %30s %04u/%02u/%02u %02u:%02u:%02u", (entry->status == 3) ? 'F' : 'D', (unsigned long long)sfs_entry_size(entry), name, ntohs(entry->modify_time.year), entry->modify_time.month, entry->modify_time.day, entry->modify_time.hour, entry->modify_time.minute, entry->modify_time.second);
+    if (sfs_entry_is_compressed(entry)) {
+        fprintf(out, " %10llu", (unsigned long long)sfs_stored_size(img, entry));
+    }
+    fprintf(out, "\n");
+}
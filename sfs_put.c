@@ -0,0 +1,876 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include "sfs.h"
+
+#define PUT_BUFFER_SIZE (1024 * 1024)
+#define STREAM_BUFFERS 4
+
+/*
+ * A session for sfs_put_receive() only: it has buffers to copy with but no
+ * allocator, so any number of them can fill reserved chains alongside the
+ * one session that allocates. Ended with sfs_put_end() like any other.
+ */
+bool sfs_put_worker_begin(sfs_image_t *img, sfs_put_session_t *session) {
+    memset(session, 0, sizeof(sfs_put_session_t));
+    session->img = img;
+    session->buffer = malloc(PUT_BUFFER_SIZE);
+    if (session->buffer == NULL) {
+        perror("Error allocating copy buffer.");
+        return false;
+    }
+    if (!sfs_copier_init(&session->copier)) {
+        free(session->buffer);
+        session->buffer = NULL;
+        return false;
+    }
+    return true;
+}
+
+bool sfs_put_begin(sfs_image_t *img, sfs_put_session_t *session) {
+    if (!sfs_put_worker_begin(img, session)) {
+        return false;
+    }
+    if (!sfs_allocator_init(img, &session->alloc)) {
+        sfs_copier_free(&session->copier);
+        free(session->buffer);
+        return false;
+    }
+    /* Without room for a journal, puts are written back unjournaled. */
+    sfs_journal_create(&session->alloc);
+    return true;
+}
+
+void sfs_put_end(sfs_put_session_t *session) {
+    sfs_allocator_free(&session->alloc);
+    sfs_copier_free(&session->copier);
+    free(session->dirs);
+    free(session->buffer);
+    session->dirs = NULL;
+    session->buffer = NULL;
+}
+
+void sfs_set_entry_time(dir_entry_timedate_t *timedate, time_t when) {
+    struct tm time_info;
+    localtime_r(&when, &time_info);
+    timedate->year = htons(time_info.tm_year + 1900);
+    timedate->month = time_info.tm_mon + 1;
+    timedate->day = time_info.tm_mday;
+    timedate->hour = time_info.tm_hour;
+    timedate->minute = time_info.tm_min;
+    timedate->second = time_info.tm_sec;
+}
+
+/* A compressed file gets its chain from sfs_compress_reserve() instead. */
+static bool prepare_new_directory_entry(dir_entry_t *entry, const char *filename, uint64_t size, sfs_allocator_t *alloc, bool compress) {
+    uint32_t block_size = alloc->img->super_block.block_size;
+    uint32_t block_count = (size + block_size - 1) / block_size;
+    memset(entry, 0, sizeof(dir_entry_t));
+    entry->status = SFS_STATUS_FILE;
+    size_t length = strlen(filename);
+    memcpy(entry->filename, filename, (length < sizeof(entry->filename)) ? length : sizeof(entry->filename) - 1);
+    sfs_entry_set_size(entry, size);
+    entry->block_count = htonl(block_count);
+    sfs_set_entry_time(&entry->create_time, time(NULL));
+    entry->modify_time = entry->create_time;
+    if (compress) {
+        entry->starting_block = htonl(SFS_FAT_EOF);
+        entry->block_count = 0;
+        return true;
+    }
+
+    uint32_t free_block = sfs_allocate_chain(alloc, block_count);
+    if (free_block == SFS_FAT_EOF && block_count > 0) {
+        return false;
+    }
+    entry->starting_block = htonl(free_block);
+    return true;
+}
+
+/*
+ * Destination directories already written to in this session keep their
+ * iterator positioned at the last slot handed out, so a batch fills an
+ * unindexed directory in one pass instead of rescanning it for every file.
+ */
+sfs_dir_iter_t *sfs_put_open_dir(sfs_put_session_t *session, const char *path) {
+    for (int i = 0; i < session->num_dirs; i++) {
+        if (strcmp(session->dirs[i].path, path) == 0) {
+            return &session->dirs[i].dir;
+        }
+    }
+    sfs_dir_iter_t dir;
+    if (!sfs_open_dir(session->img, path, &dir)) {
+        return NULL;
+    }
+    sfs_dest_dir_t *dirs = realloc(session->dirs, (session->num_dirs + 1) * sizeof(sfs_dest_dir_t));
+    if (dirs == NULL) {
+        return NULL;
+    }
+    session->dirs = dirs;
+    snprintf(dirs[session->num_dirs].path, sizeof(dirs[session->num_dirs].path), "%s", path);
+    dirs[session->num_dirs].dir = dir;
+    return &dirs[session->num_dirs++].dir;
+}
+
+/*
+ * Splits the destination into the image directory and the new file name.
+ * A destination ending in '/' or naming an existing directory keeps the
+ * source file's own name.
+ */
+static bool split_destination(const sfs_image_t *img, const char *source_name, const char *dest, char dir_path[1024], char name[32]) {
+    size_t dest_length = strlen(dest);
+    const char *slash = strrchr(dest, '/');
+    const dir_entry_t *existing = sfs_lookup(img, dest);
+
+    if (dest_length == 0 || dest[dest_length - 1] == '/' || (existing != NULL && sfs_entry_is_dir(existing))) {
+        snprintf(dir_path, 1024, "%s", dest);
+        snprintf(name, 32, "%s", source_name);
+        return strlen(source_name) < sizeof(((dir_entry_t *)0)->filename);
+    }
+    snprintf(dir_path, 1024, "%.*s", slash ? (int)(slash - dest) : 0, dest);
+    snprintf(name, 32, "%s", slash ? slash + 1 : dest);
+    return strlen(slash ? slash + 1 : dest) < sizeof(((dir_entry_t *)0)->filename);
+}
+
+/*
+ * A regular source file is copied with positioned I/O through the
+ * session's copier, one segment per extent of the new chain.
+ */
+static bool copy_regular_file(int source, sfs_put_session_t *session, uint32_t start_block, uint64_t file_size) {
+    sfs_image_t *img = session->img;
+    uint32_t block_size = img->super_block.block_size;
+    uint32_t block_count = (file_size + block_size - 1) / block_size;
+    sfs_extent_t *extents;
+    uint32_t num_extents = sfs_chain_extents(img, start_block, block_count, &extents);
+    sfs_copy_seg_t *segs = malloc((num_extents + 1) * sizeof(sfs_copy_seg_t));
+    off_t source_offset = lseek(source, 0, SEEK_CUR);
+    size_t num_segs = 0;
+    uint64_t remaining = file_size;
+    bool ok = extents != NULL && segs != NULL && source_offset != -1;
+
+    for (uint32_t i = 0; ok && i < num_extents && remaining > 0; i++) {
+        size_t length = (size_t)extents[i].length * block_size;
+        if (length > remaining) {
+            length = remaining;
+        }
+        segs[num_segs].src_offset = source_offset + (file_size - remaining);
+        segs[num_segs].dst_offset = sfs_block_offset(img, extents[i].start);
+        segs[num_segs].length = length;
+        num_segs++;
+        remaining -= length;
+    }
+    ok = ok && remaining == 0;
+    if (ok && !sfs_copy(&session->copier, source, img->fd, segs, num_segs)) {
+        snprintf(session->error, sizeof(session->error), "Error copying file data: %s.", strerror(errno));
+        ok = false;
+    } else if (!ok) {
+        snprintf(session->error, sizeof(session->error), "Error reading FAT chain.");
+    }
+    if (ok) {
+        session->bytes_read = file_size;
+        lseek(source, source_offset + file_size, SEEK_SET);
+    }
+    free(extents);
+    free(segs);
+    return ok;
+}
+
+static bool copy_file_to_sfs(int source, sfs_put_session_t *session, uint32_t start_block, uint64_t file_size) {
+    struct stat st;
+    if (fstat(source, &st) == 0 && S_ISREG(st.st_mode)) {
+        return copy_regular_file(source, session, start_block, file_size);
+    }
+
+    sfs_image_t *img = session->img;
+    uint32_t block_size = img->super_block.block_size;
+    uint32_t blocks_per_buffer = PUT_BUFFER_SIZE / block_size;
+    uint32_t current_block = start_block;
+    uint64_t bytes_copied = 0;
+
+    while (bytes_copied < file_size && current_block < img->super_block.block_count) {
+        uint32_t run = 1;
+        while (run < blocks_per_buffer && sfs_fat_get(img, current_block + run - 1) == current_block + run) {
+            run++;
+        }
+        size_t bytes_to_copy = (size_t)run * block_size;
+        if (file_size - bytes_copied < bytes_to_copy) {
+            bytes_to_copy = file_size - bytes_copied;
+        }
+        size_t filled = 0;
+        while (filled < bytes_to_copy) {
+            ssize_t got = read(source, session->buffer + filled, bytes_to_copy - filled);
+            SFS_COUNT_IO(false, session->bytes_read, got > 0 ? got : 0);
+            if (got <= 0) {
+                snprintf(session->error, sizeof(session->error), "Error reading source file.");
+                return false;
+            }
+            filled += got;
+            session->bytes_read += got;
+        }
+        SFS_COUNT_IO(true, sfs_block_offset(img, current_block), bytes_to_copy);
+        if (pwrite(img->fd, session->buffer, bytes_to_copy, sfs_block_offset(img, current_block)) != (ssize_t)bytes_to_copy) {
+            snprintf(session->error, sizeof(session->error), "Error writing to file system.");
+            return false;
+        }
+        bytes_copied += bytes_to_copy;
+        current_block = sfs_fat_get(img, current_block + run - 1);
+    }
+
+    return bytes_copied == file_size;
+}
+
+/*
+ * A source of unknown length. The calling thread reads it into a ring of
+ * buffers while a writer thread takes each full buffer, allocates blocks
+ * for it, extends the chain and writes it out, so reading the pipe
+ * overlaps writing the image. Buffers hold whole blocks until the last.
+ */
+typedef struct {
+    sfs_put_session_t *session;
+    uint8_t *buffers;
+    size_t capacity;
+    size_t lengths[STREAM_BUFFERS];
+    bool full[STREAM_BUFFERS];
+    bool finished;
+    bool failed;
+    uint32_t first_block;
+    uint32_t last_block;
+    uint32_t block_count;
+    uint64_t size;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} stream_put_t;
+
+static bool stream_write(stream_put_t *stream, const uint8_t *data, size_t length) {
+    sfs_image_t *img = stream->session->img;
+    sfs_allocator_t *alloc = &stream->session->alloc;
+    uint32_t block_size = img->super_block.block_size;
+    uint32_t blocks = (length + block_size - 1) / block_size;
+    if (stream->size + length > SFS_MAX_FILE_SIZE) {
+        snprintf(stream->session->error, sizeof(stream->session->error), "File too large.");
+        return false;
+    }
+    if (blocks > alloc->free_count) {
+        snprintf(stream->session->error, sizeof(stream->session->error), "Not enough free space in the file system.");
+        return false;
+    }
+    while (blocks > 0) {
+        uint32_t start;
+        uint32_t run = sfs_allocate_extent(alloc, blocks, &start);
+        if (stream->first_block == SFS_FAT_EOF) {
+            stream->first_block = start;
+        } else {
+            sfs_fat_set(img, stream->last_block, start);
+        }
+        for (uint32_t i = 0; i + 1 < run; i++) {
+            sfs_fat_set(img, start + i, start + i + 1);
+        }
+        sfs_fat_set(img, start + run - 1, SFS_FAT_EOF);
+        stream->last_block = start + run - 1;
+        stream->block_count += run;
+
+        size_t bytes = ((size_t)run * block_size < length) ? (size_t)run * block_size : length;
+        SFS_COUNT_IO(true, sfs_block_offset(img, start), bytes);
+        if (pwrite(img->fd, data, bytes, sfs_block_offset(img, start)) != (ssize_t)bytes) {
+            snprintf(stream->session->error, sizeof(stream->session->error), "Error writing to file system.");
+            return false;
+        }
+        data += bytes;
+        length -= bytes;
+        stream->size += bytes;
+        blocks -= run;
+    }
+    return true;
+}
+
+static void *stream_writer(void *arg) {
+    stream_put_t *stream = arg;
+    for (int turn = 0;; turn = (turn + 1) % STREAM_BUFFERS) {
+        pthread_mutex_lock(&stream->lock);
+        while (!stream->full[turn] && !stream->finished) {
+            pthread_cond_wait(&stream->changed, &stream->lock);
+        }
+        bool stop = !stream->full[turn];
+        pthread_mutex_unlock(&stream->lock);
+        if (stop) {
+            return NULL;
+        }
+        bool ok = stream_write(stream, stream->buffers + turn * stream->capacity, stream->lengths[turn]);
+        pthread_mutex_lock(&stream->lock);
+        stream->full[turn] = false;
+        stream->failed = !ok;
+        stream->finished = stream->finished || !ok;
+        pthread_cond_broadcast(&stream->changed);
+        pthread_mutex_unlock(&stream->lock);
+        if (!ok) {
+            return NULL;
+        }
+    }
+}
+
+/* Reads one buffer's worth; a short count means the source has ended. */
+static bool stream_read(int source, sfs_put_session_t *session, uint8_t *buffer, size_t capacity, size_t *length) {
+    *length = 0;
+    while (*length < capacity) {
+        ssize_t got = read(source, buffer + *length, capacity - *length);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got == -1) {
+            return false;
+        }
+        if (got == 0) {
+            break;
+        }
+        SFS_COUNT_IO(false, session->bytes_read, got);
+        *length += got;
+        session->bytes_read += got;
+    }
+    return true;
+}
+
+/* Fills in the entry's chain and size once the source has ended. */
+static bool copy_stream_to_sfs(int source, sfs_put_session_t *session, dir_entry_t *entry) {
+    uint32_t block_size = session->img->super_block.block_size;
+    stream_put_t stream;
+    pthread_t writer;
+    memset(&stream, 0, sizeof(stream));
+    stream.session = session;
+    stream.capacity = (PUT_BUFFER_SIZE / block_size) * block_size;
+    stream.first_block = SFS_FAT_EOF;
+    stream.buffers = malloc(STREAM_BUFFERS * stream.capacity);
+    if (stream.buffers == NULL) {
+        snprintf(session->error, sizeof(session->error), "Out of memory.");
+        return false;
+    }
+    pthread_mutex_init(&stream.lock, NULL);
+    pthread_cond_init(&stream.changed, NULL);
+    bool threaded = pthread_create(&writer, NULL, stream_writer, &stream) == 0;
+
+    bool read_ok = true;
+    bool more = true;
+    for (int turn = 0; more; turn = (turn + 1) % STREAM_BUFFERS) {
+        pthread_mutex_lock(&stream.lock);
+        while (stream.full[turn] && !stream.failed) {
+            pthread_cond_wait(&stream.changed, &stream.lock);
+        }
+        bool stop = stream.failed;
+        pthread_mutex_unlock(&stream.lock);
+        if (stop) {
+            break;
+        }
+        size_t length;
+        uint8_t *buffer = stream.buffers + turn * stream.capacity;
+        read_ok = stream_read(source, session, buffer, stream.capacity, &length);
+        more = read_ok && length == stream.capacity;
+        if (length == 0) {
+            break;
+        }
+        if (!threaded) {
+            stream.failed = !stream_write(&stream, buffer, length);
+            more = more && !stream.failed;
+            continue;
+        }
+        pthread_mutex_lock(&stream.lock);
+        stream.lengths[turn] = length;
+        stream.full[turn] = true;
+        pthread_cond_broadcast(&stream.changed);
+        pthread_mutex_unlock(&stream.lock);
+    }
+    if (threaded) {
+        pthread_mutex_lock(&stream.lock);
+        stream.finished = true;
+        pthread_cond_broadcast(&stream.changed);
+        pthread_mutex_unlock(&stream.lock);
+        pthread_join(writer, NULL);
+    }
+    pthread_mutex_destroy(&stream.lock);
+    pthread_cond_destroy(&stream.changed);
+    free(stream.buffers);
+
+    if (!read_ok && !stream.failed) {
+        snprintf(session->error, sizeof(session->error), "Error reading source file.");
+    }
+    if (!read_ok || stream.failed) {
+        if (stream.first_block != SFS_FAT_EOF) {
+            sfs_free_chain(&session->alloc, stream.first_block);
+        }
+        return false;
+    }
+    entry->starting_block = htonl(stream.first_block);
+    entry->block_count = htonl(stream.block_count);
+    sfs_entry_set_size(entry, stream.size);
+    return true;
+}
+
+/* Allocates the chain for size bytes and fills in the entry; the data comes later. */
+static bool reserve_chain(sfs_put_session_t *session, uint64_t size, const char *name, dir_entry_t *entry) {
+    if (size > SFS_MAX_FILE_SIZE) {
+        snprintf(session->error, sizeof(session->error), "File too large.");
+        return false;
+    }
+    bool compress = session->compress && size > 0;
+    if (!prepare_new_directory_entry(entry, name, size, &session->alloc, compress)) {
+        snprintf(session->error, sizeof(session->error), "Not enough free space in the file system.");
+        return false;
+    }
+    return !compress || sfs_compress_reserve(session, size, entry);
+}
+
+/* Writes the checksum words of a filled chain, when the image keeps them. */
+static bool fill_checksums(sfs_put_session_t *session, dir_entry_t *entry) {
+    if (session->img->checksums == NULL) {
+        return true;
+    }
+    if (!sfs_checksum_fill(session->img, ntohl(entry->starting_block), ntohl(entry->block_count))) {
+        snprintf(session->error, sizeof(session->error), "Error reading back file data.");
+        return false;
+    }
+    entry->unused[0] |= SFS_FLAG_CHECKSUMMED;
+    return true;
+}
+
+/*
+ * Fills a reserved chain from source. Only the image file, the chain's
+ * own FAT entries and its checksum words are touched, so this needs no
+ * allocator and nothing else may use the chain until it is settled.
+ */
+static bool receive_chain(sfs_put_session_t *session, int source, dir_entry_t *entry) {
+    uint64_t phase SFS_PHASE_SCOPED = SFS_PHASE_BEGIN();
+    bool copied;
+    if (sfs_entry_is_compressed(entry)) {
+        copied = sfs_compress_write(session, source, entry);
+    } else {
+        copied = copy_file_to_sfs(source, session, ntohl(entry->starting_block), sfs_entry_size(entry));
+    }
+    copied = copied && fill_checksums(session, entry);
+    SFS_PHASE_END(SFS_PHASE_COPY, phase);
+    return copied;
+}
+
+/* Gives back what a compressed chain did not use and marks the checksums written. */
+static void settle_chain(sfs_put_session_t *session, const dir_entry_t *entry) {
+    if (sfs_entry_is_compressed(entry)) {
+        sfs_compress_trim(&session->alloc, entry);
+    }
+    if (session->img->checksums != NULL && sfs_entry_is_checksummed(entry)) {
+        sfs_checksum_mark(session->img, ntohl(entry->starting_block), ntohl(entry->block_count));
+    }
+}
+
+/*
+ * Copies source into a newly allocated chain and fills in entry for it,
+ * without linking it into any directory. On failure nothing stays
+ * allocated and the reason is left in session->error.
+ */
+bool sfs_put_chain(sfs_put_session_t *session, int source, uint64_t size, const char *name, dir_entry_t *entry) {
+    bool copied;
+    if (size == SFS_SIZE_STREAM) {
+        if (session->compress) {
+            snprintf(session->error, sizeof(session->error), "Compression needs the size in advance.");
+            return false;
+        }
+        prepare_new_directory_entry(entry, name, 0, &session->alloc, false);
+        uint64_t phase SFS_PHASE_SCOPED = SFS_PHASE_BEGIN();
+        copied = copy_stream_to_sfs(source, session, entry) && fill_checksums(session, entry);
+        SFS_PHASE_END(SFS_PHASE_COPY, phase);
+    } else {
+        if (!reserve_chain(session, size, name, entry)) {
+            return false;
+        }
+        copied = receive_chain(session, source, entry);
+    }
+    if (!copied) {
+        sfs_free_chain(&session->alloc, ntohl(entry->starting_block));
+        return false;
+    }
+    settle_chain(session, entry);
+    return true;
+}
+
+/* Opens dir_path through the session's cache, provided name is still free in it. */
+static sfs_dir_iter_t *destination_dir(sfs_put_session_t *session, const char *dir_path, const char *name) {
+    sfs_dir_iter_t *dir = sfs_put_open_dir(session, dir_path);
+    if (dir == NULL) {
+        snprintf(session->error, sizeof(session->error), "Directory not found.");
+        return NULL;
+    }
+    sfs_dir_iter_t probe = *dir;
+    sfs_dir_rewind(&probe);
+    uint64_t phase SFS_PHASE_SCOPED = SFS_PHASE_BEGIN();
+    dir_entry_t *existing = sfs_find_entry(&probe, name);
+    SFS_PHASE_END(SFS_PHASE_PATH, phase);
+    if (existing != NULL) {
+        snprintf(session->error, sizeof(session->error), "File already exists.");
+        return NULL;
+    }
+    return dir;
+}
+
+/* Resolves dest_path into the directory a put goes to and the new file's name. */
+static sfs_dir_iter_t *find_destination(sfs_put_session_t *session, const char *source_name, const char *dest_path, char dir_path[1024], char name[32]) {
+    if (!split_destination(session->img, source_name, dest_path, dir_path, name)) {
+        snprintf(session->error, sizeof(session->error), "File name too long.");
+        return NULL;
+    }
+    if (name[0] == '\0') {
+        snprintf(session->error, sizeof(session->error), "A file name is needed.");
+        return NULL;
+    }
+    return destination_dir(session, dir_path, name);
+}
+
+/*
+ * Copies size bytes read from source into the image, or with
+ * SFS_SIZE_STREAM everything up to the end of source. Data goes straight
+ * to the file; the FAT chain and directory entry only change in the
+ * mapping and reach the file with the session's next sfs_flush(). On
+ * failure the reason is left in session->error.
+ */
+bool sfs_put_fd(sfs_put_session_t *session, int source, uint64_t size, const char *source_name, const char *dest_path) {
+    char dir_path[1024];
+    char name[32];
+
+    session->bytes_read = 0;
+    sfs_dir_iter_t *dir = find_destination(session, source_name, dest_path, dir_path, name);
+    if (dir == NULL) {
+        return false;
+    }
+
+    dir_entry_t entry;
+    if (!sfs_put_chain(session, source, size, name, &entry)) {
+        return false;
+    }
+    uint32_t start_block = ntohl(entry.starting_block);
+
+    uint64_t phase SFS_PHASE_SCOPED = SFS_PHASE_BEGIN();
+    dir_entry_t *inserted = sfs_dir_insert(&session->alloc, dir, &entry);
+    SFS_PHASE_END(SFS_PHASE_ALLOC, phase);
+    if (inserted == NULL) {
+        snprintf(session->error, sizeof(session->error), "Failed to add file to directory.");
+        sfs_free_chain(&session->alloc, start_block);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * First step of a split put: checks the destination and allocates the
+ * chain for size bytes, which must be known in advance. The chain is
+ * allocated but belongs to no file until sfs_put_publish().
+ */
+bool sfs_put_reserve(sfs_put_session_t *session, uint64_t size, const char *source_name, const char *dest_path, sfs_put_slot_t *slot) {
+    char name[32];
+    session->bytes_read = 0;
+    if (size == SFS_SIZE_STREAM) {
+        snprintf(session->error, sizeof(session->error), "The size is needed in advance.");
+        return false;
+    }
+    return find_destination(session, source_name, dest_path, slot->dir_path, name) != NULL && reserve_chain(session, size, name, &slot->entry);
+}
+
+/*
+ * Second step: fills the reserved chain from source. Runs on a worker
+ * session and leaves the mapping's dirty state, the allocator and every
+ * directory alone, so it needs no lock shared with other puts.
+ */
+bool sfs_put_receive(sfs_put_session_t *worker, int source, sfs_put_slot_t *slot) {
+    worker->bytes_read = 0;
+    return receive_chain(worker, source, &slot->entry);
+}
+
+/*
+ * Last step: links the received file into its directory. The name is
+ * checked again, since another put may have taken it meanwhile; on
+ * failure the chain is given back.
+ */
+bool sfs_put_publish(sfs_put_session_t *session, sfs_put_slot_t *slot) {
+    sfs_dir_iter_t *dir = destination_dir(session, slot->dir_path, slot->entry.filename);
+    if (dir == NULL) {
+        sfs_put_cancel(session, slot);
+        return false;
+    }
+    uint64_t phase SFS_PHASE_SCOPED = SFS_PHASE_BEGIN();
+    dir_entry_t *inserted = sfs_dir_insert(&session->alloc, dir, &slot->entry);
+    SFS_PHASE_END(SFS_PHASE_ALLOC, phase);
+    if (inserted == NULL) {
+        snprintf(session->error, sizeof(session->error), "Failed to add file to directory.");
+        sfs_put_cancel(session, slot);
+        return false;
+    }
+    settle_chain(session, &slot->entry);
+    return true;
+}
+
+/* Gives back the chain of a reserved put that will not be published. */
+void sfs_put_cancel(sfs_put_session_t *session, sfs_put_slot_t *slot) {
+    sfs_free_chain(&session->alloc, ntohl(slot->entry.starting_block));
+}
+
+/*
+ * Finds the entry at path and opens the directory holding it; the entry's
+ * name goes to name and the directory's path to parent_path.
+ */
+static dir_entry_t *find_source(const sfs_image_t *img, const char *path, char parent_path[1024], char name[32], sfs_dir_iter_t *parent) {
+    size_t length = strlen(path);
+    while (length > 0 && path[length - 1] == '/') {
+        length--;
+    }
+    const char *base = path + length;
+    while (base > path && base[-1] != '/') {
+        base--;
+    }
+    const char *slash = (base > path) ? base - 1 : NULL;
+    if (length >= 1024 || base == path + length || (size_t)(path + length - base) >= sizeof(((dir_entry_t *)0)->filename)) {
+        return NULL;
+    }
+    snprintf(parent_path, 1024, "%.*s", slash ? (int)(slash - path) : 0, path);
+    snprintf(name, 32, "%.*s", (int)(path + length - base), base);
+    if (!sfs_open_dir(img, parent_path, parent)) {
+        return NULL;
+    }
+    sfs_dir_iter_t probe = *parent;
+    return sfs_find_entry(&probe, name);
+}
+
+/* Whether the directory at path is dir itself or lies somewhere below it. */
+static bool path_within(const sfs_image_t *img, const char *path, const dir_entry_t *dir) {
+    char *temp_path = strdup(path);
+    char *saveptr;
+    bool within = false;
+    sfs_dir_iter_t it;
+    sfs_dir_open_root(img, &it);
+    for (char *cur = temp_path ? strtok_r(temp_path, "/", &saveptr) : NULL; cur != NULL && !within; cur = strtok_r(NULL, "/", &saveptr)) {
+        dir_entry_t *entry = sfs_find_entry(&it, cur);
+        if (entry == NULL) {
+            break;
+        }
+        within = entry->starting_block == dir->starting_block;
+        sfs_dir_open(img, entry, &it);
+    }
+    free(temp_path);
+    return within;
+}
+
+/* A moved directory's ".." entry, where it has one, follows it to the new parent. */
+static void relink_parent(sfs_image_t *img, const dir_entry_t *moved, const sfs_dir_iter_t *parent) {
+    sfs_dir_iter_t it;
+    sfs_dir_open(img, moved, &it);
+    dir_entry_t *link = sfs_find_entry(&it, "..");
+    if (link != NULL && sfs_entry_is_dir(link)) {
+        link->starting_block = htonl(parent->start_block);
+        link->block_count = htonl(parent->num_blocks);
+        sfs_mark_dirty(img, link, sizeof(dir_entry_t));
+    }
+}
+
+/*
+ * Moves or renames a file or directory inside the image. Only directory
+ * entries change: the entry is added under its new name and then removed
+ * from its old directory, so no data block is read or written.
+ */
+bool sfs_move_path(sfs_put_session_t *session, const char *source_path, const char *dest_path) {
+    sfs_image_t *img = session->img;
+    char source_dir[1024];
+    char source_name[32];
+    char dir_path[1024];
+    char name[32];
+    sfs_dir_iter_t source_parent;
+
+    dir_entry_t *source = find_source(img, source_path, source_dir, source_name, &source_parent);
+    if (source == NULL) {
+        snprintf(session->error, sizeof(session->error), "File not found.");
+        return false;
+    }
+    if (!split_destination(img, source_name, dest_path, dir_path, name)) {
+        snprintf(session->error, sizeof(session->error), "File name too long.");
+        return false;
+    }
+    sfs_dir_iter_t *dir = sfs_put_open_dir(session, dir_path);
+    if (dir == NULL) {
+        snprintf(session->error, sizeof(session->error), "Directory not found.");
+        return false;
+    }
+    if (sfs_entry_is_dir(source) && path_within(img, dir_path, source)) {
+        snprintf(session->error, sizeof(session->error), "Cannot move a directory into itself.");
+        return false;
+    }
+    sfs_dir_iter_t probe = *dir;
+    sfs_dir_rewind(&probe);
+    if (sfs_find_entry(&probe, name) != NULL) {
+        snprintf(session->error, sizeof(session->error), "File already exists.");
+        return false;
+    }
+
+    dir_entry_t entry = *source;
+    memset(entry.filename, 0, sizeof(entry.filename));
+    memcpy(entry.filename, name, strlen(name));
+    uint64_t phase SFS_PHASE_SCOPED = SFS_PHASE_BEGIN();
+    dir_entry_t *inserted = sfs_dir_insert(&session->alloc, dir, &entry);
+    if (inserted == NULL) {
+        SFS_PHASE_END(SFS_PHASE_ALLOC, phase);
+        snprintf(session->error, sizeof(session->error), "Failed to add file to directory.");
+        return false;
+    }
+    /* The insert may have grown or indexed the source directory. */
+    sfs_open_dir(img, source_dir, &source_parent);
+    sfs_dir_remove(img, &source_parent, source);
+    if (sfs_entry_is_dir(inserted)) {
+        relink_parent(img, inserted, dir);
+        /* Cached iterators point at the old entry and are keyed by old paths. */
+        session->num_dirs = 0;
+    }
+    SFS_PHASE_END(SFS_PHASE_ALLOC, phase);
+    return true;
+}
+
+/* Pairs up two chains of the same length extent by extent as copy segments. */
+static sfs_copy_seg_t *pair_extents(const sfs_image_t *img, const sfs_extent_t *from, uint32_t num_from, const sfs_extent_t *to, uint32_t num_to, size_t *count) {
+    uint32_t block_size = img->super_block.block_size;
+    sfs_copy_seg_t *segs = malloc(((size_t)num_from + num_to) * sizeof(sfs_copy_seg_t));
+    uint32_t i = 0, j = 0, from_used = 0, to_used = 0;
+    *count = 0;
+    while (segs != NULL && i < num_from && j < num_to) {
+        uint32_t from_left = from[i].length - from_used;
+        uint32_t to_left = to[j].length - to_used;
+        uint32_t blocks = (from_left < to_left) ? from_left : to_left;
+        segs[*count].src_offset = sfs_block_offset(img, from[i].start + from_used);
+        segs[*count].dst_offset = sfs_block_offset(img, to[j].start + to_used);
+        segs[*count].length = (size_t)blocks * block_size;
+        (*count)++;
+        from_used += blocks;
+        to_used += blocks;
+        if (from_used == from[i].length) {
+            i++;
+            from_used = 0;
+        }
+        if (to_used == to[j].length) {
+            j++;
+            to_used = 0;
+        }
+    }
+    return segs;
+}
+
+/*
+ * Copies the blocks of one chain onto another inside the image. A
+ * checksummed source passes its checksums on; other files get fresh ones
+ * when the image keeps them.
+ */
+static bool copy_chain(sfs_put_session_t *session, const dir_entry_t *source, dir_entry_t *entry) {
+    sfs_image_t *img = session->img;
+    uint32_t block_size = img->super_block.block_size;
+    uint32_t block_count = ntohl(entry->block_count);
+    sfs_extent_t *from;
+    sfs_extent_t *to;
+    size_t num_segs = 0;
+    if (block_count == 0) {
+        return true;
+    }
+    uint32_t num_from = sfs_chain_extents(img, ntohl(source->starting_block), block_count, &from);
+    uint32_t num_to = sfs_chain_extents(img, ntohl(entry->starting_block), block_count, &to);
+    sfs_copy_seg_t *segs = (from != NULL && to != NULL) ? pair_extents(img, from, num_from, to, num_to, &num_segs) : NULL;
+    uint64_t paired = 0;
+    for (size_t i = 0; segs != NULL && i < num_segs; i++) {
+        paired += segs[i].length;
+    }
+    bool ok = paired == (uint64_t)block_count * block_size && sfs_copy_within(&session->copier, img->fd, segs, num_segs);
+    if (paired != (uint64_t)block_count * block_size) {
+        snprintf(session->error, sizeof(session->error), "The source file's chain is damaged.");
+    } else if (!ok) {
+        snprintf(session->error, sizeof(session->error), "Error copying file data.");
+    } else if (img->checksums != NULL && sfs_entry_is_checksummed(source)) {
+        for (size_t i = 0; i < num_segs; i++) {
+            sfs_checksum_copy(img, segs[i].src_offset / block_size, segs[i].dst_offset / block_size, segs[i].length / block_size);
+        }
+    } else if (img->checksums != NULL) {
+        ok = sfs_checksum_chain(img, ntohl(entry->starting_block), block_count);
+        entry->unused[0] |= SFS_FLAG_CHECKSUMMED;
+        if (!ok) {
+            snprintf(session->error, sizeof(session->error), "Error reading back file data.");
+        }
+    }
+    free(segs);
+    free(from);
+    free(to);
+    return ok;
+}
+
+/*
+ * Copies a file to a new one inside the image. The new chain is
+ * allocated in one pass and filled from the old one with
+ * copy_file_range() on the image, so the data never leaves the kernel.
+ * Compressed files are copied as they are stored.
+ */
+bool sfs_copy_path(sfs_put_session_t *session, const char *source_path, const char *dest_path) {
+    sfs_image_t *img = session->img;
+    char source_dir[1024];
+    char source_name[32];
+    char dir_path[1024];
+    char name[32];
+    sfs_dir_iter_t source_parent;
+
+    dir_entry_t *source = find_source(img, source_path, source_dir, source_name, &source_parent);
+    if (source == NULL) {
+        snprintf(session->error, sizeof(session->error), "File not found.");
+        return false;
+    }
+    if (sfs_entry_is_dir(source)) {
+        snprintf(session->error, sizeof(session->error), "Cannot copy a directory.");
+        return false;
+    }
+    if (!split_destination(img, source_name, dest_path, dir_path, name)) {
+        snprintf(session->error, sizeof(session->error), "File name too long.");
+        return false;
+    }
+    sfs_dir_iter_t *dir = sfs_put_open_dir(session, dir_path);
+    if (dir == NULL) {
+        snprintf(session->error, sizeof(session->error), "Directory not found.");
+        return false;
+    }
+    sfs_dir_iter_t probe = *dir;
+    sfs_dir_rewind(&probe);
+    if (sfs_find_entry(&probe, name) != NULL) {
+        snprintf(session->error, sizeof(session->error), "File already exists.");
+        return false;
+    }
+
+    dir_entry_t entry = *source;
+    memset(entry.filename, 0, sizeof(entry.filename));
+    memcpy(entry.filename, name, strlen(name));
+    sfs_set_entry_time(&entry.create_time, time(NULL));
+    entry.modify_time = entry.create_time;
+    uint32_t block_count = ntohl(entry.block_count);
+    uint64_t phase SFS_PHASE_SCOPED = SFS_PHASE_BEGIN();
+    uint32_t start_block = sfs_allocate_chain(&session->alloc, block_count);
+    SFS_PHASE_END(SFS_PHASE_ALLOC, phase);
+    if (start_block == SFS_FAT_EOF && block_count > 0) {
+        snprintf(session->error, sizeof(session->error), "Not enough free space in the file system.");
+        return false;
+    }
+    entry.starting_block = htonl(start_block);
+
+    phase = SFS_PHASE_BEGIN();
+    bool copied = copy_chain(session, source, &entry);
+    SFS_PHASE_END(SFS_PHASE_COPY, phase);
+    if (!copied) {
+        sfs_free_chain(&session->alloc, start_block);
+        return false;
+    }
+
+    phase = SFS_PHASE_BEGIN();
+    dir_entry_t *inserted = sfs_dir_insert(&session->alloc, dir, &entry);
+    SFS_PHASE_END(SFS_PHASE_ALLOC, phase);
+    if (inserted == NULL) {
+        snprintf(session->error, sizeof(session->error), "Failed to add file to directory.");
+        sfs_free_chain(&session->alloc, start_block);
+        return false;
+    }
+    return true;
+}
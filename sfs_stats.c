@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sfs.h"
+
+int sfs_stats_mode = SFS_STATS_OFF;
+sfs_stats_t sfs_stats;
+
+static const char *phase_names[SFS_NUM_PHASES] = { "superblock", "fat", "path", "allocation", "copy", "flush" };
+static uint64_t last_end[2];
+static uint64_t run_start;
+static __thread int phase_depth;
+static __thread uint64_t open_start;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void report_at_exit(void) {
+    sfs_stats_report(stderr);
+}
+
+/*
+ * Removes --stats, --stats=human or --stats=json from the arguments and
+ * arranges for the report to go to stderr when the tool exits, so each
+ * tool only needs this one call.
+ */
+void sfs_stats_args(int *argc, char *argv[]) {
+    int kept = 1;
+    for (int i = 1; i < *argc; i++) {
+        if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats=human") == 0) {
+            sfs_stats_mode = SFS_STATS_HUMAN;
+        } else if (strcmp(argv[i], "--stats=json") == 0) {
+            sfs_stats_mode = SFS_STATS_JSON;
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    argv[kept] = NULL;
+    *argc = kept;
+    if (sfs_stats_mode != SFS_STATS_OFF) {
+        run_start = now_ns();
+        atexit(report_at_exit);
+    }
+}
+
+/*
+ * Counts one read or write syscall. An access that does not start where
+ * the previous one of the same kind ended counts as a seek.
+ */
+void sfs_stats_io(bool write, off_t offset, uint64_t bytes) {
+    uint64_t previous = __atomic_exchange_n(&last_end[write], (uint64_t)offset + bytes, __ATOMIC_RELAXED);
+    if (previous != (uint64_t)offset) {
+        __atomic_fetch_add(&sfs_stats.seeks, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&sfs_stats.syscalls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(write ? &sfs_stats.bytes_written : &sfs_stats.bytes_read, bytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * Phases nest (a lookup inside a put, a census inside a flush); only the
+ * outermost one on a thread is timed so no time is counted twice.
+ */
+uint64_t sfs_phase_begin(void) {
+    if (phase_depth++ != 0) {
+        return 0;
+    }
+    open_start = now_ns();
+    return open_start;
+}
+
+void sfs_phase_end(sfs_phase_t phase, uint64_t start) {
+    __atomic_fetch_add(&sfs_stats.phase_ns[phase], now_ns() - start, __ATOMIC_RELAXED);
+    phase_depth = 0;
+    open_start = 0;
+}
+
+/*
+ * Called when an SFS_PHASE_SCOPED start goes out of scope. If its phase is
+ * still the open one, the function returned before SFS_PHASE_END(); the
+ * phase is dropped untimed so later phases on this thread are timed again.
+ */
+void sfs_phase_abandon(uint64_t start) {
+    if (start == open_start) {
+        phase_depth = 0;
+        open_start = 0;
+    }
+}
+
+void sfs_stats_report(FILE *out) {
+    double total_ms = (now_ns() - run_start) / 1e6;
+    if (sfs_stats_mode == SFS_STATS_JSON) {
+        fprintf(out, "{\"syscalls\":%llu,\"bytes_read\":%llu,\"bytes_written\":%llu,\"seeks\":%llu,\"blocks_visited\":%llu,\"phases_ms\":{", (unsigned long long)sfs_stats.syscalls, (unsigned long long)sfs_stats.bytes_read, (unsigned long long)sfs_stats.bytes_written, (unsigned long long)sfs_stats.seeks, (unsigned long long)sfs_stats.blocks_visited);
+        for (int i = 0; i < SFS_NUM_PHASES; i++) {
+            fprintf(out, "%s\"%s\":%.3f", i ? "," : "", phase_names[i], sfs_stats.phase_ns[i] / 1e6);
+        }
+        fprintf(out, "},\"total_ms\":%.3f}\n", total_ms);
+        return;
+    }
+    fprintf(out, "I/O statistics\n");
+    fprintf(out, "Syscalls: %llu\n", (unsigned long long)sfs_stats.syscalls);
+    fprintf(out, "Bytes read: %llu\n", (unsigned long long)sfs_stats.bytes_read);
+    fprintf(out, "Bytes written: %llu\n", (unsigned long long)sfs_stats.bytes_written);
+    fprintf(out, "Seeks: %llu\n", (unsigned long long)sfs_stats.seeks);
+    fprintf(out, "Blocks visited: %llu\n", (unsigned long long)sfs_stats.blocks_visited);
+    for (int i = 0; i < SFS_NUM_PHASES; i++) {
+        fprintf(out, "Phase %s: %.3f ms\n", phase_names[i], sfs_stats.phase_ns[i] / 1e6);
+    }
+    fprintf(out, "Total: %.3f ms\n", total_ms);
+}
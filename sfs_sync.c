@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "sfs.h"
+
+#define SYNC_BUFFER_SIZE (1024 * 1024)
+
+/*
+ * Creates an empty directory called name in dir_path, which must exist.
+ * Returns its entry, or NULL with session->error set.
+ */
+dir_entry_t *sfs_make_dir(sfs_put_session_t *session, const char *dir_path, const char *name) {
+    sfs_image_t *img = session->img;
+    uint32_t block_size = img->super_block.block_size;
+    dir_entry_t entry;
+    if (strlen(name) >= sizeof(entry.filename)) {
+        snprintf(session->error, sizeof(session->error), "File name too long.");
+        return NULL;
+    }
+    sfs_dir_iter_t *dir = sfs_put_open_dir(session, dir_path);
+    if (dir == NULL) {
+        snprintf(session->error, sizeof(session->error), "Directory not found.");
+        return NULL;
+    }
+    sfs_dir_iter_t probe = *dir;
+    sfs_dir_rewind(&probe);
+    if (sfs_find_entry(&probe, name) != NULL) {
+        snprintf(session->error, sizeof(session->error), "File already exists.");
+        return NULL;
+    }
+
+    memset(&entry, 0, sizeof(dir_entry_t));
+    entry.status = SFS_STATUS_DIRECTORY;
+    memcpy(entry.filename, name, strlen(name));
+    entry.block_count = htonl(1);
+    sfs_entry_set_size(&entry, block_size);
+    sfs_set_entry_time(&entry.create_time, time(NULL));
+    entry.modify_time = entry.create_time;
+    uint32_t block = sfs_allocate_chain(&session->alloc, 1);
+    if (block == SFS_FAT_EOF) {
+        snprintf(session->error, sizeof(session->error), "Not enough free space in the file system.");
+        return NULL;
+    }
+    memset(sfs_block(img, block), 0, block_size);
+    sfs_mark_dirty(img, sfs_block(img, block), block_size);
+    entry.starting_block = htonl(block);
+    dir_entry_t *inserted = sfs_dir_insert(&session->alloc, dir, &entry);
+    if (inserted == NULL) {
+        snprintf(session->error, sizeof(session->error), "Failed to add directory.");
+        sfs_free_chain(&session->alloc, block);
+    }
+    return inserted;
+}
+
+/* Cuts entry's chain to block_count blocks or extends it with newly allocated ones. */
+static bool resize_chain(sfs_allocator_t *alloc, dir_entry_t *entry, uint32_t block_count) {
+    sfs_image_t *img = alloc->img;
+    uint32_t old_count = ntohl(entry->block_count);
+    uint32_t kept = (old_count < block_count) ? old_count : block_count;
+    uint32_t last = ntohl(entry->starting_block);
+    if (block_count == old_count) {
+        return true;
+    }
+    for (uint32_t i = 1; i < kept && last < img->super_block.block_count; i++) {
+        last = sfs_fat_get(img, last);
+    }
+    if (block_count < old_count) {
+        uint32_t rest = (kept > 0) ? sfs_fat_get(img, last) : last;
+        if (kept > 0) {
+            sfs_fat_set(img, last, SFS_FAT_EOF);
+        } else {
+            entry->starting_block = htonl(SFS_FAT_EOF);
+        }
+        sfs_free_chain(alloc, rest);
+    } else {
+        uint32_t added = sfs_allocate_chain(alloc, block_count - old_count);
+        if (added == SFS_FAT_EOF) {
+            return false;
+        }
+        if (kept > 0) {
+            sfs_fat_set(img, last, added);
+        } else {
+            entry->starting_block = htonl(added);
+        }
+    }
+    entry->block_count = htonl(block_count);
+    return true;
+}
+
+static bool read_source(int source, uint8_t *buffer, size_t length, off_t offset) {
+    size_t filled = 0;
+    while (filled < length) {
+        ssize_t got = pread(source, buffer + filled, length - filled, offset + filled);
+        SFS_COUNT_IO(false, offset + filled, got > 0 ? got : 0);
+        if (got <= 0) {
+            errno = (got == 0) ? EIO : errno;
+            return false;
+        }
+        filled += got;
+    }
+    return true;
+}
+
+/*
+ * Rewrites the blocks of entry's chain that differ from the source. The
+ * first kept blocks held the file before and are compared: with their
+ * stored checksums when the file has them, so the image is not read at
+ * all, otherwise by reading them back. Blocks past those are new and are
+ * written. The last block's tail past the end of the file keeps what the
+ * image had there, so blocks compare and checksum whole.
+ */
+static bool update_blocks(sfs_put_session_t *session, int source, uint64_t size, const dir_entry_t *entry, uint32_t kept, sfs_sync_stats_t *stats) {
+    sfs_image_t *img = session->img;
+    uint32_t block_size = img->super_block.block_size;
+    uint32_t per_batch = SYNC_BUFFER_SIZE / block_size;
+    bool checksummed = img->checksums != NULL && sfs_entry_is_checksummed(entry);
+    sfs_extent_t *extents;
+    uint32_t num_extents = sfs_chain_extents(img, ntohl(entry->starting_block), ntohl(entry->block_count), &extents);
+    uint8_t *data = malloc(SYNC_BUFFER_SIZE);
+    uint8_t *current = malloc(SYNC_BUFFER_SIZE);
+    uint32_t *crcs = malloc(per_batch * sizeof(uint32_t));
+    bool ok = extents != NULL && data != NULL && current != NULL && crcs != NULL;
+    uint32_t index = 0;
+
+    for (uint32_t i = 0; ok && i < num_extents; i++) {
+        for (uint32_t done = 0; ok && done < extents[i].length; done += per_batch) {
+            uint32_t count = (extents[i].length - done < per_batch) ? extents[i].length - done : per_batch;
+            uint32_t block = extents[i].start + done;
+            uint32_t old = (kept > index) ? ((kept - index < count) ? kept - index : count) : 0;
+            uint64_t offset = (uint64_t)index * block_size;
+            size_t length = (size_t)count * block_size;
+            size_t wanted = (size - offset < length) ? size - offset : length;
+            ok = read_source(source, data, wanted, offset);
+            if (ok && old > 0 && !checksummed) {
+                SFS_COUNT_IO(false, sfs_block_offset(img, block), (size_t)old * block_size);
+                ok = pread(img->fd, current, (size_t)old * block_size, sfs_block_offset(img, block)) == (ssize_t)((size_t)old * block_size);
+            }
+            if (ok && wanted < length && old < count) {
+                memset(data + wanted, 0, length - wanted);
+            } else if (ok && wanted < length && !checksummed) {
+                memcpy(data + wanted, current + wanted, length - wanted);
+            } else if (ok && wanted < length) {
+                SFS_COUNT_IO(false, sfs_block_offset(img, block) + wanted, length - wanted);
+                ok = pread(img->fd, data + wanted, length - wanted, sfs_block_offset(img, block) + wanted) == (ssize_t)(length - wanted);
+            }
+            if (ok && old > 0 && checksummed) {
+                sfs_crc32c_blocks(data, old, block_size, crcs);
+            }
+
+            uint32_t run = 0;
+            for (uint32_t j = 0; ok && j <= count; j++) {
+                const uint8_t *wanted_block = data + (size_t)j * block_size;
+                bool differs = j < count && (j >= old || (checksummed ? crcs[j] != ntohl(img->checksums[block + j]) : memcmp(wanted_block, current + (size_t)j * block_size, block_size) != 0));
+                if (differs) {
+                    run++;
+                    continue;
+                }
+                if (run == 0) {
+                    continue;
+                }
+                uint32_t first = block + j - run;
+                size_t run_length = (size_t)run * block_size;
+                SFS_COUNT_IO(true, sfs_block_offset(img, first), run_length);
+                ok = pwrite(img->fd, wanted_block - run_length, run_length, sfs_block_offset(img, first)) == (ssize_t)run_length;
+                if (ok && checksummed) {
+                    sfs_checksum_set(img, first, wanted_block - run_length, run);
+                }
+                stats->blocks_written += ok ? run : 0;
+                run = 0;
+            }
+            stats->blocks_compared += old;
+            index += count;
+        }
+    }
+    free(extents);
+    free(data);
+    free(current);
+    free(crcs);
+    return ok;
+}
+
+/*
+ * Brings name in dir_path up to date with source, size bytes last
+ * modified at mtime. A file whose size and modify time already match is
+ * left alone and a missing one is put. A changed one keeps its chain, cut
+ * or extended to the new length, and only the blocks that differ are
+ * written; a compressed one cannot be patched and is put again whole,
+ * replacing the old copy only once the new one is complete.
+ */
+bool sfs_sync_fd(sfs_put_session_t *session, int source, uint64_t size, time_t mtime, const char *dir_path, const char *name, sfs_sync_stats_t *stats) {
+    sfs_image_t *img = session->img;
+    uint32_t block_size = img->super_block.block_size;
+    dir_entry_timedate_t modified;
+    char path[1024];
+    sfs_set_entry_time(&modified, mtime);
+    /* Always joined with a slash, so sfs_put_fd() splits off dir_path as given and shares its cached iterator. */
+    snprintf(path, sizeof(path), "%s/%s", dir_path, name);
+
+    sfs_dir_iter_t *dir = sfs_put_open_dir(session, dir_path);
+    if (dir == NULL) {
+        snprintf(session->error, sizeof(session->error), "Directory not found.");
+        return false;
+    }
+    sfs_dir_iter_t probe = *dir;
+    sfs_dir_rewind(&probe);
+    dir_entry_t *entry = sfs_find_entry(&probe, name);
+    if (entry != NULL && sfs_entry_is_dir(entry)) {
+        snprintf(session->error, sizeof(session->error), "A directory of that name is in the way.");
+        return false;
+    }
+    if (entry != NULL && sfs_entry_size(entry) == size && memcmp(&entry->modify_time, &modified, sizeof(modified)) == 0) {
+        stats->files_unchanged++;
+        return true;
+    }
+    if (size > SFS_MAX_FILE_SIZE) {
+        snprintf(session->error, sizeof(session->error), "File too large.");
+        return false;
+    }
+
+    if (entry == NULL) {
+        if (!sfs_put_fd(session, source, size, name, path)) {
+            return false;
+        }
+        probe = *sfs_put_open_dir(session, dir_path);
+        sfs_dir_rewind(&probe);
+        entry = sfs_find_entry(&probe, name);
+        entry->modify_time = modified;
+        sfs_mark_dirty(img, entry, sizeof(dir_entry_t));
+        stats->files_added++;
+        stats->blocks_written += ntohl(entry->block_count);
+        return true;
+    }
+    if (sfs_entry_is_compressed(entry)) {
+        /* The new copy is written whole before the entry switches to it, so a failure keeps the old one. */
+        dir_entry_t replacement;
+        bool compress = session->compress;
+        session->compress = true;
+        bool ok = sfs_put_chain(session, source, size, name, &replacement);
+        session->compress = compress;
+        if (!ok) {
+            return false;
+        }
+        uint32_t old_start = ntohl(entry->starting_block);
+        bool has_chain = entry->block_count != 0;
+        replacement.create_time = entry->create_time;
+        replacement.modify_time = modified;
+        *entry = replacement;
+        sfs_mark_dirty(img, entry, sizeof(dir_entry_t));
+        if (has_chain) {
+            sfs_free_chain(&session->alloc, old_start);
+        }
+        stats->files_updated++;
+        stats->blocks_written += ntohl(entry->block_count);
+        return true;
+    }
+
+    uint32_t old_count = ntohl(entry->block_count);
+    uint32_t block_count = (size + block_size - 1) / block_size;
+    if (!resize_chain(&session->alloc, entry, block_count)) {
+        snprintf(session->error, sizeof(session->error), "Not enough free space in the file system.");
+        return false;
+    }
+    bool ok = update_blocks(session, source, size, entry, (old_count < block_count) ? old_count : block_count, stats);
+    if (!ok) {
+        snprintf(session->error, sizeof(session->error), "Error updating file data: %s.", strerror(errno));
+    }
+    /* A failed update keeps its old modify time, so the next sync looks at it again. */
+    sfs_entry_set_size(entry, size);
+    if (ok) {
+        entry->modify_time = modified;
+    }
+    sfs_mark_dirty(img, entry, sizeof(dir_entry_t));
+    stats->files_updated += ok;
+    return ok;
+}
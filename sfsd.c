@@ -0,0 +1,582 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "sfs.h"
+
+#define SFSD_DEFAULT_THREADS 4
+#define SFSD_MAX_THREADS 64
+#define SFSD_MAX_FIELDS 16
+
+/*
+ * One image kept open for the daemon's lifetime. Lists and info run
+ * concurrently under the read side of the lock; moves and copies take the
+ * write side, so the mapping, allocator and directory cache only ever
+ * have one writer. A get takes the read side only to find its file's
+ * extents and sends the data without it, pinning the allocator so freed
+ * blocks are not reused meanwhile. A put takes the write side only to
+ * reserve its chain and to publish its entry, and receives the data in
+ * between without it, into blocks no other request can reach yet. Each
+ * change takes a ticket and is acknowledged once a commit covers it. A
+ * grow waits for the gets and puts in flight, holding off new ones, and
+ * closes and reopens the image under the write side; shutdown waits for
+ * them the same way.
+ */
+typedef struct {
+    sfs_image_t img;
+    sfs_put_session_t session;
+    pthread_rwlock_t lock;
+    pthread_mutex_t commit_lock;
+    pthread_cond_t commit_done;
+    uint64_t puts;
+    uint64_t committed;
+    bool committing;
+    bool commit_failed;
+    uint32_t in_flight;
+    bool paused;
+    int listener;
+    const char *path;
+    char spool_dir[1024];
+    dev_t dev;
+    ino_t ino;
+} sfsd_t;
+
+bool send_header(int sock, uint64_t size) {
+    char line[64];
+    snprintf(line, sizeof(line), "OK %llu\n", (unsigned long long)size);
+    return sfs_write_all(sock, line, strlen(line));
+}
+
+bool send_reply(int sock, const char *payload, size_t size) {
+    return send_header(sock, size) && sfs_write_all(sock, payload, size);
+}
+
+bool send_error(int sock, const char *message) {
+    char line[256];
+    snprintf(line, sizeof(line), "ERR %s\n", message);
+    return sfs_write_all(sock, line, strlen(line));
+}
+
+bool handle_info(sfsd_t *sfsd, int sock) {
+    char *text = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&text, &size);
+    if (out == NULL) {
+        return send_error(sock, "Out of memory.");
+    }
+    pthread_rwlock_rdlock(&sfsd->lock);
+    sfs_print_info(out, &sfsd->img);
+    pthread_rwlock_unlock(&sfsd->lock);
+    fclose(out);
+    bool ok = send_reply(sock, text, size);
+    free(text);
+    return ok;
+}
+
+/* The path may be followed by disklist options, one per field. */
+bool handle_list(sfsd_t *sfsd, int sock, char *args) {
+    char *fields[SFSD_MAX_FIELDS];
+    int num_fields = 0;
+    char *saveptr;
+    for (char *field = strtok_r(args, "\t", &saveptr); field != NULL && num_fields < SFSD_MAX_FIELDS; field = strtok_r(NULL, "\t", &saveptr)) {
+        fields[num_fields++] = field;
+    }
+    sfs_list_opts_t opts;
+    if (num_fields == 0 || sfs_list_args(num_fields - 1, fields + 1, &opts) != num_fields - 1) {
+        return send_error(sock, "Malformed request.");
+    }
+
+    char *text = NULL;
+    size_t size = 0;
+    sfs_dir_iter_t dir;
+    FILE *out = open_memstream(&text, &size);
+    if (out == NULL) {
+        return send_error(sock, "Out of memory.");
+    }
+    pthread_rwlock_rdlock(&sfsd->lock);
+    bool found = sfs_open_dir(&sfsd->img, fields[0], &dir);
+    bool listed = found && sfs_list_tree(out, &dir, fields[0], &opts);
+    pthread_rwlock_unlock(&sfsd->lock);
+    fclose(out);
+    bool ok = listed ? send_reply(sock, text, size) : send_error(sock, found ? "Out of memory." : "Subdirectory not found.");
+    free(text);
+    return ok;
+}
+
+/*
+ * A put counts as in flight from before it reserves until it has
+ * published or cancelled, and a get from before it looks up its file
+ * until it has sent it; both work on the image partly without its lock.
+ */
+void begin_request(sfsd_t *sfsd) {
+    pthread_mutex_lock(&sfsd->commit_lock);
+    while (sfsd->paused) {
+        pthread_cond_wait(&sfsd->commit_done, &sfsd->commit_lock);
+    }
+    sfsd->in_flight++;
+    pthread_mutex_unlock(&sfsd->commit_lock);
+}
+
+void end_request(sfsd_t *sfsd) {
+    pthread_mutex_lock(&sfsd->commit_lock);
+    sfsd->in_flight--;
+    pthread_cond_broadcast(&sfsd->commit_done);
+    pthread_mutex_unlock(&sfsd->commit_lock);
+}
+
+/*
+ * Holds off new puts and gets and waits for those in flight; called
+ * without the image lock, which they may still need to finish.
+ */
+void pause_requests(sfsd_t *sfsd) {
+    pthread_mutex_lock(&sfsd->commit_lock);
+    while (sfsd->committing || sfsd->paused) {
+        pthread_cond_wait(&sfsd->commit_done, &sfsd->commit_lock);
+    }
+    sfsd->committing = true;
+    sfsd->paused = true;
+    while (sfsd->in_flight > 0) {
+        pthread_cond_wait(&sfsd->commit_done, &sfsd->commit_lock);
+    }
+    pthread_mutex_unlock(&sfsd->commit_lock);
+}
+
+/*
+ * The entry and its extents are taken under the read lock; the data is
+ * sent without it, with the allocator pinned so that blocks freed in the
+ * meantime are not reused before the get is done with them.
+ */
+bool handle_get(sfsd_t *sfsd, int sock, const char *path) {
+    const sfs_image_t *img = &sfsd->img;
+    sfs_extent_t *extents = NULL;
+    uint32_t num_extents = 0;
+    bool ok = true;
+
+    begin_request(sfsd);
+    pthread_rwlock_rdlock(&sfsd->lock);
+    dir_entry_t *found = sfs_lookup(img, path);
+    if (found == NULL || sfs_entry_is_dir(found)) {
+        pthread_rwlock_unlock(&sfsd->lock);
+        end_request(sfsd);
+        return send_error(sock, "File not found.");
+    }
+    dir_entry_t entry = *found;
+    num_extents = sfs_chain_extents(img, ntohl(entry.starting_block), ntohl(entry.block_count), &extents);
+    sfs_allocator_pin(&sfsd->session.alloc);
+    pthread_rwlock_unlock(&sfsd->lock);
+
+    uint64_t remaining_size = sfs_entry_size(&entry);
+    ok = (extents != NULL || remaining_size == 0) && send_header(sock, remaining_size);
+    if (ok && sfs_entry_is_compressed(&entry)) {
+        ok = sfs_get_compressed(img, &entry, extents, num_extents, sock);
+        remaining_size = 0;
+        num_extents = 0;
+    } else if (ok && img->checksums != NULL && sfs_entry_is_checksummed(&entry)) {
+        uint32_t bad_block;
+        ok = sfs_write_verified(img, extents, num_extents, remaining_size, sock, &bad_block);
+        if (!ok && bad_block != SFS_FAT_EOF) {
+            fprintf(stderr, "%s: block %u fails its checksum.\n", path, bad_block);
+        }
+        remaining_size = 0;
+        num_extents = 0;
+    }
+    uint32_t advised = 0;
+    for (uint32_t i = 0; ok && i < num_extents && remaining_size > 0; i++) {
+        if (advised < num_extents && advised <= i + 1) {
+            advised = sfs_readahead(img, extents, num_extents, advised, SFS_READAHEAD_BYTES);
+        }
+        off_t offset = sfs_block_offset(img, extents[i].start);
+        size_t length = (size_t)extents[i].length * img->super_block.block_size;
+        if (length > remaining_size) {
+            length = remaining_size;
+        }
+        remaining_size -= length;
+        while (ok && length > 0) {
+            ssize_t sent = sendfile(sock, img->fd, &offset, length);
+            ok = sent > 0 || (sent == -1 && errno == EINTR);
+            length -= (sent > 0) ? sent : 0;
+        }
+    }
+    free(extents);
+    if (sfs_allocator_unpin(&sfsd->session.alloc)) {
+        pthread_rwlock_wrlock(&sfsd->lock);
+        sfs_allocator_release(&sfsd->session.alloc);
+        pthread_rwlock_unlock(&sfsd->lock);
+    }
+    end_request(sfsd);
+    return ok && remaining_size == 0;
+}
+
+/* Skips what is left of a failed put; SFS_SIZE_STREAM reads to the end. */
+bool drain(int sock, uint64_t size) {
+    char buffer[64 * 1024];
+    bool to_end = size == SFS_SIZE_STREAM;
+    while (size > 0) {
+        ssize_t got = read(sock, buffer, size < sizeof(buffer) ? size : sizeof(buffer));
+        if (got == 0 && to_end) {
+            return true;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        size -= to_end ? 0 : got;
+    }
+    return true;
+}
+
+/*
+ * Group commit. The first put to find no commit running captures every
+ * dirty block and commits them outside the image lock; puts finishing in
+ * the meantime wait and go out together in the next commit, so a burst
+ * of puts costs one fdatasync() per commit rather than one each. After a
+ * failed commit the mapping no longer matches the file, so no later put
+ * is acknowledged.
+ */
+bool commit_put(sfsd_t *sfsd, uint64_t ticket) {
+    pthread_mutex_lock(&sfsd->commit_lock);
+    while (sfsd->committed < ticket && !sfsd->commit_failed) {
+        if (sfsd->committing) {
+            pthread_cond_wait(&sfsd->commit_done, &sfsd->commit_lock);
+            continue;
+        }
+        sfsd->committing = true;
+        pthread_mutex_unlock(&sfsd->commit_lock);
+
+        sfs_txn_t txn;
+        pthread_rwlock_wrlock(&sfsd->lock);
+        uint64_t target = sfsd->puts;
+        sfs_allocator_release(&sfsd->session.alloc);
+        bool ok = sfs_flush_begin(&sfsd->img, &txn);
+        pthread_rwlock_unlock(&sfsd->lock);
+        ok = sfs_flush_commit(&sfsd->img, &txn) && ok;
+
+        pthread_mutex_lock(&sfsd->commit_lock);
+        sfsd->committing = false;
+        sfsd->committed = ok ? target : sfsd->committed;
+        sfsd->commit_failed = !ok;
+        pthread_cond_broadcast(&sfsd->commit_done);
+    }
+    bool ok = sfsd->committed >= ticket;
+    pthread_mutex_unlock(&sfsd->commit_lock);
+    return ok;
+}
+
+/* Moves and copies change the image like puts and share their commits. */
+bool handle_edit(sfsd_t *sfsd, int sock, char *args, bool move) {
+    char *saveptr;
+    char *source_path = strtok_r(args, "\t", &saveptr);
+    char *dest_path = strtok_r(NULL, "\t", &saveptr);
+    if (source_path == NULL || dest_path == NULL) {
+        return send_error(sock, "Malformed request.");
+    }
+
+    pthread_rwlock_wrlock(&sfsd->lock);
+    bool ok = move ? sfs_move_path(&sfsd->session, source_path, dest_path) : sfs_copy_path(&sfsd->session, source_path, dest_path);
+    char error[128];
+    snprintf(error, sizeof(error), "%s", sfsd->session.error);
+    uint64_t ticket = ++sfsd->puts;
+    pthread_rwlock_unlock(&sfsd->lock);
+
+    if (ok && !commit_put(sfsd, ticket)) {
+        snprintf(error, sizeof(error), "Failed to write file system metadata.");
+        ok = false;
+    }
+    return ok ? send_header(sock, 0) : send_error(sock, error);
+}
+
+/*
+ * Copies a streamed put into an unlinked file next to the image, so its
+ * size is known before blocks are reserved for it. Returns the file
+ * positioned at its start, or -1 once the client's data is used up.
+ */
+int spool(sfsd_t *sfsd, int sock, uint64_t *size) {
+    char path[1100];
+    char buffer[64 * 1024];
+    snprintf(path, sizeof(path), "%s/.sfsd-spool-XXXXXX", sfsd->spool_dir);
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        drain(sock, SFS_SIZE_STREAM);
+        return -1;
+    }
+    unlink(path);
+    bool ok = true;
+    *size = 0;
+    for (;;) {
+        ssize_t got = read(sock, buffer, sizeof(buffer));
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            ok = ok && got == 0;
+            break;
+        }
+        ok = ok && sfs_write_all(fd, buffer, got);
+        *size += got;
+    }
+    if (!ok || lseek(fd, 0, SEEK_SET) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * The chain is reserved and the entry published under the write lock;
+ * the data is received from the client in between without it, through
+ * the connection's own worker session. A streamed put is spooled first.
+ */
+bool handle_put(sfsd_t *sfsd, int sock, char *args, sfs_put_session_t *worker) {
+    char *saveptr;
+    char *size_text = strtok_r(args, "\t", &saveptr);
+    char *source_name = strtok_r(NULL, "\t", &saveptr);
+    char *dest_path = strtok_r(NULL, "\t", &saveptr);
+    char *flags = strtok_r(NULL, "\t", &saveptr);
+    if (size_text == NULL || source_name == NULL || dest_path == NULL) {
+        return send_error(sock, "Malformed request.") && false;
+    }
+    /* A streamed put sends "-" for its size and ends by shutting down its side. */
+    bool stream = strcmp(size_text, "-") == 0;
+    uint64_t size = stream ? SFS_SIZE_STREAM : strtoull(size_text, NULL, 10);
+    bool compress = flags != NULL && strchr(flags, 'z') != NULL;
+    if (strcmp(source_name, "-") == 0) {
+        source_name = "";
+    }
+    if (stream && compress) {
+        return drain(sock, size) && send_error(sock, "Compression needs the size in advance.");
+    }
+    if (worker->buffer == NULL && !sfs_put_worker_begin(&sfsd->img, worker)) {
+        return drain(sock, size) && send_error(sock, "Out of memory.");
+    }
+    int source = stream ? spool(sfsd, sock, &size) : sock;
+    if (source == -1) {
+        return send_error(sock, "Error spooling the streamed file.");
+    }
+
+    sfs_put_slot_t slot;
+    char error[128];
+    begin_request(sfsd);
+    pthread_rwlock_wrlock(&sfsd->lock);
+    sfsd->session.compress = compress;
+    bool reserved = sfs_put_reserve(&sfsd->session, size, source_name, dest_path, &slot);
+    snprintf(error, sizeof(error), "%s", sfsd->session.error);
+    pthread_rwlock_unlock(&sfsd->lock);
+
+    worker->bytes_read = 0;
+    bool ok = reserved && sfs_put_receive(worker, source, &slot);
+    if (reserved && !ok) {
+        snprintf(error, sizeof(error), "%s", worker->error);
+    }
+    uint64_t consumed = stream ? size : worker->bytes_read;
+
+    pthread_rwlock_wrlock(&sfsd->lock);
+    if (ok) {
+        ok = sfs_put_publish(&sfsd->session, &slot);
+        snprintf(error, sizeof(error), "%s", sfsd->session.error);
+    } else if (reserved) {
+        sfs_put_cancel(&sfsd->session, &slot);
+    }
+    uint64_t ticket = ++sfsd->puts;
+    pthread_rwlock_unlock(&sfsd->lock);
+    end_request(sfsd);
+    if (stream) {
+        close(source);
+    }
+
+    if (ok && !commit_put(sfsd, ticket)) {
+        snprintf(error, sizeof(error), "Failed to write file system metadata.");
+        ok = false;
+    }
+
+    if (ok) {
+        return send_header(sock, 0);
+    }
+    return drain(sock, size - consumed) && send_error(sock, error);
+}
+
+/*
+ * Grows the image while it is served. The image is closed for the grow,
+ * so this stands in for a commit: changes made so far are flushed first
+ * and count as committed, and no other request runs until the image is
+ * open again.
+ */
+bool handle_grow(sfsd_t *sfsd, int sock, const char *size_text) {
+    uint64_t size = strtoull(size_text, NULL, 10);
+    pause_requests(sfsd);
+    pthread_mutex_lock(&sfsd->commit_lock);
+    bool usable = !sfsd->commit_failed;
+    pthread_mutex_unlock(&sfsd->commit_lock);
+
+    pthread_rwlock_wrlock(&sfsd->lock);
+    uint64_t target = sfsd->puts;
+    bool larger = size / sfsd->img.super_block.block_size > sfsd->img.super_block.block_count;
+    bool flushed = usable && sfs_flush(&sfsd->img);
+    bool ok = false;
+    if (flushed && larger) {
+        sfs_put_end(&sfsd->session);
+        sfs_close(&sfsd->img);
+        ok = sfs_grow(sfsd->path, size);
+        if (!sfs_open(sfsd->path, true, &sfsd->img) || !sfs_put_begin(&sfsd->img, &sfsd->session)) {
+            fprintf(stderr, "Error reopening file system image %s.\n", sfsd->path);
+            exit(1);
+        }
+    }
+    pthread_rwlock_unlock(&sfsd->lock);
+
+    pthread_mutex_lock(&sfsd->commit_lock);
+    sfsd->committing = false;
+    sfsd->paused = false;
+    sfsd->committed = flushed ? target : sfsd->committed;
+    sfsd->commit_failed = !flushed;
+    pthread_cond_broadcast(&sfsd->commit_done);
+    pthread_mutex_unlock(&sfsd->commit_lock);
+    if (!flushed) {
+        return send_error(sock, "Failed to write file system metadata.");
+    }
+    if (!larger) {
+        return send_error(sock, "The image can only grow.");
+    }
+    return ok ? send_header(sock, 0) : send_error(sock, "Failed to grow the image; see the sfsd log.");
+}
+
+void serve_connection(sfsd_t *sfsd, int sock) {
+    char line[1200];
+    unsigned long dev, ino;
+    if (!sfs_read_line(sock, line, sizeof(line)) || sscanf(line, "SFS\t%lu\t%lu", &dev, &ino) != 2) {
+        return;
+    }
+    if (dev != (unsigned long)sfsd->dev || ino != (unsigned long)sfsd->ino) {
+        send_error(sock, "Image not served by this sfsd.");
+        return;
+    }
+    if (!send_header(sock, 0)) {
+        return;
+    }
+
+    sfs_put_session_t worker;
+    memset(&worker, 0, sizeof(worker));
+    bool ok = true;
+    while (ok && sfs_read_line(sock, line, sizeof(line))) {
+        char *args = strchr(line, '\t');
+        if (args != NULL) {
+            *args++ = '\0';
+        }
+        if (strcmp(line, "INFO") == 0) {
+            ok = handle_info(sfsd, sock);
+        } else if (strcmp(line, "LIST") == 0 && args != NULL) {
+            ok = handle_list(sfsd, sock, args);
+        } else if (strcmp(line, "GET") == 0 && args != NULL) {
+            ok = handle_get(sfsd, sock, args);
+        } else if (strcmp(line, "PUT") == 0 && args != NULL) {
+            ok = handle_put(sfsd, sock, args, &worker);
+        } else if ((strcmp(line, "MOVE") == 0 || strcmp(line, "COPY") == 0) && args != NULL) {
+            ok = handle_edit(sfsd, sock, args, line[0] == 'M');
+        } else if (strcmp(line, "GROW") == 0 && args != NULL) {
+            ok = handle_grow(sfsd, sock, args);
+        } else {
+            ok = send_error(sock, "Unknown request.") && false;
+        }
+    }
+    sfs_put_end(&worker);
+}
+
+void *sfsd_worker(void *arg) {
+    sfsd_t *sfsd = arg;
+    for (;;) {
+        int sock = accept(sfsd->listener, NULL, NULL);
+        if (sock == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("Error accepting connection.");
+            return NULL;
+        }
+        serve_connection(sfsd, sock);
+        close(sock);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3 || argc > 4) {
+        fprintf(stderr, "Usage: sfsd <file system image> <socket path> <optional: threads>\n");
+        return 1;
+    }
+    int num_threads = (argc == 4) ? atoi(argv[3]) : SFSD_DEFAULT_THREADS;
+    if (num_threads < 1 || num_threads > SFSD_MAX_THREADS) {
+        fprintf(stderr, "Thread count must be between 1 and %d.\n", SFSD_MAX_THREADS);
+        return 1;
+    }
+
+    static sfsd_t sfsd;
+    struct stat st;
+    if (stat(argv[1], &st) == -1) {
+        fprintf(stderr, "Error opening file system image %s.\n", argv[1]);
+        return 1;
+    }
+    if (!sfs_open(argv[1], true, &sfsd.img)) {
+        return 1;
+    }
+    sfsd.path = argv[1];
+    const char *slash = strrchr(argv[1], '/');
+    snprintf(sfsd.spool_dir, sizeof(sfsd.spool_dir), "%.*s", slash ? (int)(slash - argv[1]) : 1, slash ? argv[1] : ".");
+    sfsd.dev = st.st_dev;
+    sfsd.ino = st.st_ino;
+    if (!sfs_put_begin(&sfsd.img, &sfsd.session)) {
+        sfs_close(&sfsd.img);
+        return 1;
+    }
+    pthread_rwlock_init(&sfsd.lock, NULL);
+    pthread_mutex_init(&sfsd.commit_lock, NULL);
+    pthread_cond_init(&sfsd.commit_done, NULL);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(argv[2]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long.\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, argv[2]);
+    unlink(argv[2]);
+    sfsd.listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sfsd.listener == -1 || bind(sfsd.listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(sfsd.listener, 128) == -1) {
+        perror("Error creating socket.");
+        return 1;
+    }
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t threads[SFSD_MAX_THREADS];
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, sfsd_worker, &sfsd) != 0) {
+            perror("Error starting worker thread.");
+            return 1;
+        }
+    }
+
+    int sig;
+    sigwait(&signals, &sig);
+    pause_requests(&sfsd);
+    pthread_rwlock_wrlock(&sfsd.lock);
+    bool ok = sfs_flush(&sfsd.img);
+    close(sfsd.listener);
+    unlink(argv[2]);
+    sfs_put_end(&sfsd.session);
+    sfs_close(&sfsd.img);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "sfs.h"
+
+#define GEN_BUFFER_SIZE (1024 * 1024)
+
+typedef struct {
+    uint32_t block_size;
+    uint32_t block_count;
+    uint32_t root_dir_blocks;
+    uint32_t depth;
+    uint32_t fan_out;
+    uint32_t files_per_dir;
+    uint32_t min_size;
+    uint32_t max_size;
+    uint32_t frag_percent;
+    uint64_t seed;
+} gen_params_t;
+
+typedef struct {
+    const gen_params_t *params;
+    sfs_image_t *img;
+    sfs_allocator_t alloc;
+    uint64_t rng;
+    uint8_t *buffer;
+    uint32_t num_dirs;
+    uint32_t num_files;
+    uint64_t bytes;
+    uint64_t fragments;
+} gen_state_t;
+
+uint64_t next_random(gen_state_t *gen) {
+    gen->rng ^= gen->rng << 13;
+    gen->rng ^= gen->rng >> 7;
+    gen->rng ^= gen->rng << 17;
+    return gen->rng;
+}
+
+/*
+ * Allocates a chain like sfs_allocate_chain, except that each block ends
+ * its run with probability frag_percent and the next run starts from a
+ * random block, so the file and the free space around it end up broken
+ * into pieces.
+ */
+uint32_t allocate_fragmented(gen_state_t *gen, uint32_t block_count) {
+    sfs_allocator_t *alloc = &gen->alloc;
+    uint32_t first = SFS_FAT_EOF;
+    uint32_t prev = SFS_FAT_EOF;
+    uint32_t remaining = block_count;
+    if (block_count > alloc->free_count) {
+        return SFS_FAT_EOF;
+    }
+    bool jump = false;
+    while (remaining > 0) {
+        if (jump) {
+            alloc->cursor = next_random(gen) % alloc->entries;
+        }
+        uint32_t run = 1;
+        while (run < remaining && next_random(gen) % 100 >= gen->params->frag_percent) {
+            run++;
+        }
+        jump = run < remaining;
+        uint32_t start;
+        uint32_t length = sfs_allocate_extent(alloc, run, &start);
+        if (prev == SFS_FAT_EOF) {
+            first = start;
+        } else {
+            sfs_fat_set(gen->img, prev, start);
+        }
+        for (uint32_t i = 0; i + 1 < length; i++) {
+            sfs_fat_set(gen->img, start + i, start + i + 1);
+        }
+        if (start != prev + 1) {
+            gen->fragments++;
+        }
+        prev = start + length - 1;
+        remaining -= length;
+    }
+    sfs_fat_set(gen->img, prev, SFS_FAT_EOF);
+    return first;
+}
+
+/*
+ * File sizes are drawn log-uniformly between min_size and max_size, which
+ * gives the many-small, few-large mix real trees have.
+ */
+uint32_t pick_file_size(gen_state_t *gen) {
+    const gen_params_t *params = gen->params;
+    if (params->max_size <= params->min_size) {
+        return params->min_size;
+    }
+    double low = log((double)params->min_size + 1);
+    double high = log((double)params->max_size + 1);
+    double r = (next_random(gen) >> 11) * (1.0 / 9007199254740992.0);
+    double size = exp(low + r * (high - low)) - 1;
+    return (size > params->max_size) ? params->max_size : (uint32_t)size;
+}
+
+bool write_file_data(gen_state_t *gen, uint32_t start_block, uint32_t block_count, uint32_t size) {
+    sfs_image_t *img = gen->img;
+    sfs_extent_t *extents = NULL;
+    uint32_t num_extents = sfs_chain_extents(img, start_block, block_count, &extents);
+    bool ok = extents != NULL || size == 0;
+    for (uint32_t i = 0; ok && i < num_extents && size > 0; i++) {
+        off_t offset = sfs_block_offset(img, extents[i].start);
+        uint64_t length = (uint64_t)extents[i].length * img->super_block.block_size;
+        if (length > size) {
+            length = size;
+        }
+        size -= length;
+        while (ok && length > 0) {
+            size_t chunk = (length < GEN_BUFFER_SIZE) ? length : GEN_BUFFER_SIZE;
+            for (size_t j = 0; j < chunk; j += sizeof(uint64_t)) {
+                uint64_t value = next_random(gen);
+                memcpy(gen->buffer + j, &value, sizeof(value));
+            }
+            ok = pwrite(img->fd, gen->buffer, chunk, offset) == (ssize_t)chunk;
+            offset += chunk;
+            length -= chunk;
+        }
+    }
+    free(extents);
+    return ok;
+}
+
+bool generate_file(gen_state_t *gen, sfs_dir_iter_t *dir, uint32_t number) {
+    uint32_t block_size = gen->img->super_block.block_size;
+    uint32_t size = pick_file_size(gen);
+    uint32_t block_count = ((uint64_t)size + block_size - 1) / block_size;
+    dir_entry_t entry;
+
+    memset(&entry, 0, sizeof(dir_entry_t));
+    entry.status = SFS_STATUS_FILE;
+    snprintf(entry.filename, sizeof(entry.filename), "f%u.bin", number);
+    entry.size = htonl(size);
+    entry.block_count = htonl(block_count);
+    sfs_set_entry_time(&entry.create_time, time(NULL));
+    entry.modify_time = entry.create_time;
+    uint32_t start_block = (block_count > 0) ? allocate_fragmented(gen, block_count) : 0;
+    if (start_block == SFS_FAT_EOF) {
+        fprintf(stderr, "Image full after %u files.\n", gen->num_files);
+        return false;
+    }
+    entry.starting_block = htonl(start_block);
+    if (!write_file_data(gen, start_block, block_count, size)) {
+        perror("Error writing file data.");
+        return false;
+    }
+    if (sfs_dir_insert(&gen->alloc, dir, &entry) == NULL) {
+        fprintf(stderr, "Directory full after %u files.\n", gen->num_files);
+        return false;
+    }
+    gen->num_files++;
+    gen->bytes += size;
+    return true;
+}
+
+bool generate_directory(gen_state_t *gen, sfs_dir_iter_t *dir, uint32_t depth) {
+    sfs_image_t *img = gen->img;
+    uint32_t block_size = img->super_block.block_size;
+
+    for (uint32_t i = 0; i < gen->params->files_per_dir; i++) {
+        if (!generate_file(gen, dir, i)) {
+            return false;
+        }
+    }
+    if (depth == 0) {
+        return true;
+    }
+    for (uint32_t i = 0; i < gen->params->fan_out; i++) {
+        dir_entry_t entry;
+        memset(&entry, 0, sizeof(dir_entry_t));
+        entry.status = SFS_STATUS_DIRECTORY;
+        snprintf(entry.filename, sizeof(entry.filename), "d%u", i);
+        entry.block_count = htonl(1);
+        entry.size = htonl(block_size);
+        sfs_set_entry_time(&entry.create_time, time(NULL));
+        entry.modify_time = entry.create_time;
+        uint32_t block = sfs_allocate_chain(&gen->alloc, 1);
+        if (block == SFS_FAT_EOF) {
+            fprintf(stderr, "Image full after %u directories.\n", gen->num_dirs);
+            return false;
+        }
+        memset(sfs_block(img, block), 0, block_size);
+        sfs_mark_dirty(img, sfs_block(img, block), block_size);
+        entry.starting_block = htonl(block);
+
+        dir_entry_t *slot = sfs_dir_insert(&gen->alloc, dir, &entry);
+        if (slot == NULL) {
+            fprintf(stderr, "Directory full after %u directories.\n", gen->num_dirs);
+            return false;
+        }
+        gen->num_dirs++;
+        sfs_dir_iter_t child;
+        sfs_dir_open(img, slot, &child);
+        if (!generate_directory(gen, &child, depth - 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void usage(void) {
+    fprintf(stderr, "Usage: sfsgen [options] <file system image>\n");
+    fprintf(stderr, "  -b <bytes>     block size (default 512)\n");
+    fprintf(stderr, "  -n <blocks>    block count (default 65536)\n");
+    fprintf(stderr, "  -r <blocks>    root directory blocks (default 16)\n");
+    fprintf(stderr, "  -d <levels>    directory depth below the root (default 2)\n");
+    fprintf(stderr, "  -w <dirs>      subdirectories per directory (default 4)\n");
+    fprintf(stderr, "  -f <files>     files per directory (default 8)\n");
+    fprintf(stderr, "  -s <min:max>   file size range in bytes, log-uniform (default 512:65536)\n");
+    fprintf(stderr, "  -F <percent>   chance per block of starting a new fragment (default 0)\n");
+    fprintf(stderr, "  -S <seed>      random seed (default 1)\n");
+}
+
+int main(int argc, char *argv[]) {
+    gen_params_t params = { 512, 65536, 16, 2, 4, 8, 512, 65536, 0, 1 };
+    int opt;
+    while ((opt = getopt(argc, argv, "b:n:r:d:w:f:s:F:S:")) != -1) {
+        switch (opt) {
+        case 'b': params.block_size = strtoul(optarg, NULL, 10); break;
+        case 'n': params.block_count = strtoul(optarg, NULL, 10); break;
+        case 'r': params.root_dir_blocks = strtoul(optarg, NULL, 10); break;
+        case 'd': params.depth = strtoul(optarg, NULL, 10); break;
+        case 'w': params.fan_out = strtoul(optarg, NULL, 10); break;
+        case 'f': params.files_per_dir = strtoul(optarg, NULL, 10); break;
+        case 's':
+            if (sscanf(optarg, "%u:%u", &params.min_size, &params.max_size) == 1) {
+                params.max_size = params.min_size;
+            }
+            break;
+        case 'F': params.frag_percent = strtoul(optarg, NULL, 10); break;
+        case 'S': params.seed = strtoull(optarg, NULL, 10); break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+        return 1;
+    }
+    if (params.block_size < sizeof(dir_entry_t) || params.block_size > UINT16_MAX || params.block_size % sizeof(dir_entry_t) != 0 || params.root_dir_blocks == 0 || params.frag_percent > 100 || params.min_size > params.max_size) {
+        fprintf(stderr, "Invalid image parameters.\n");
+        return 1;
+    }
+
+    const char *path = argv[optind];
+    sfs_format_t format = {params.block_size, params.block_count, params.root_dir_blocks, false};
+    sfs_image_t img;
+    gen_state_t gen;
+    memset(&gen, 0, sizeof(gen));
+    gen.params = &params;
+    gen.img = &img;
+    gen.rng = params.seed * 0x9E3779B97F4A7C15ull + 1;
+    gen.buffer = malloc(GEN_BUFFER_SIZE);
+    if (gen.buffer == NULL || !sfs_format(path, &format) || !sfs_open(path, true, &img)) {
+        free(gen.buffer);
+        return 1;
+    }
+    if (!sfs_allocator_init(&img, &gen.alloc)) {
+        sfs_close(&img);
+        free(gen.buffer);
+        return 1;
+    }
+
+    sfs_dir_iter_t root;
+    sfs_dir_open_root(&img, &root);
+    bool ok = generate_directory(&gen, &root, params.depth);
+    if (!sfs_flush(&img)) {
+        fprintf(stderr, "Failed to write file system metadata.\n");
+        ok = false;
+    }
+    printf("%s: %u directories, %u files, %llu bytes, %llu fragments\n", path, gen.num_dirs, gen.num_files, (unsigned long long)gen.bytes, (unsigned long long)gen.fragments);
+
+    sfs_allocator_free(&gen.alloc);
+    sfs_close(&img);
+    free(gen.buffer);
+    return ok ? 0 : 1;
+}